@@ -0,0 +1,149 @@
+/*
+ * Memory use and traversal speed of bson_t trees against compact trees on a million-node document.
+ *
+ *     gcc -std=gnu2x -O2 bench/compact.c src/bson.c src/compact.c src/view.c -o compact && ./compact
+ */
+#include <malloc.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "../src/compact.h"
+
+#define ROWS 110000
+#define ROUNDS 5
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double) time.tv_sec + (double) time.tv_nsec * 1e-9;
+}
+
+static size_t heap_in_use(void) {
+    return mallinfo2().uordblks + mallinfo2().hblkhd;
+}
+
+static double sum_bson(const bson_t *bson) { // NOLINT(*-no-recursion)
+    double sum = 0;
+    switch (bson->type) {
+        case BSON_U16:
+            return bson->u16;
+        case BSON_I64:
+            return (double) bson->i64;
+        case BSON_F64:
+            return bson->f64;
+        case BSON_TRUE:
+            return 1;
+        case BSON_STRING:
+            return bson->string.length;
+        case BSON_ARRAY:
+            for (uint32_t i = 0; i < bson->array.length; i++) sum += sum_bson(&bson->array.elements[i]);
+            return sum;
+        case BSON_OBJECT:
+            for (uint32_t i = 0; i < bson->object.length; i++) sum += sum_bson(&bson->object.elements[i].value);
+            return sum;
+        default:
+            return 0;
+    }
+}
+
+static double sum_compact(const bson_compact_t *tree, const bson_node_t *node) { // NOLINT(*-no-recursion)
+    double sum = 0;
+    switch (node->type) {
+        case BSON_U16:
+            return node->u16;
+        case BSON_I64:
+            return (double) node->i64;
+        case BSON_F64:
+            return node->f64;
+        case BSON_TRUE:
+            return 1;
+        case BSON_STRING:
+            return node->length;
+        case BSON_ARRAY:
+        case BSON_OBJECT:
+            for (uint32_t i = 0; i < node->length; i++) sum += sum_compact(tree, &tree->nodes[node->offset + i]);
+            return sum;
+        default:
+            return 0;
+    }
+}
+
+static uint8_t *corpus(size_t *length) {
+    static char names[ROWS][16];
+    bson_t *rows = malloc(ROWS * sizeof(bson_t));
+    for (uint32_t i = 0; i < ROWS; i++) {
+        bson_t *tags = malloc(3 * sizeof(bson_t));
+        for (uint32_t j = 0; j < 3; j++) tags[j] = bson_u16(i * 3 + j);
+        object_pair_t *pairs = malloc(5 * sizeof(object_pair_t));
+        const int name_length = snprintf(names[i], sizeof(names[i]), "user-%u", i);
+        pairs[0] = (object_pair_t){string("id"), bson_i64(i)};
+        pairs[1] = (object_pair_t){string("name"), bson_string_heap(names[i], name_length)};
+        pairs[2] = (object_pair_t){string("score"), bson_f64(i * 0.5)};
+        pairs[3] = (object_pair_t){string("active"), bson_bool(i % 3 == 0)};
+        pairs[4] = (object_pair_t){string("tags"), bson_array_heap(tags, 3)};
+        pairs[1].value.string.alloc = 0;
+        rows[i] = bson_object_heap(pairs, 5);
+    }
+    bson_t document = bson_array_heap(rows, ROWS);
+    uint8_t *buffer;
+    if (bson_serialize(&buffer, &document) != 0) exit(1);
+    *length = 1 + document.size;
+    bson_free(&document);
+    return buffer;
+}
+
+int main(void) {
+    size_t length;
+    uint8_t *buffer = corpus(&length);
+    printf("document   %zu bytes serialized, %u nodes\n", length, 1 + ROWS * 9);
+
+    size_t before = heap_in_use();
+    double start = now();
+    uint32_t index = 0;
+    bson_t bson = bson_deserialize(buffer, &index);
+    const double bson_decode = now() - start;
+    const size_t bson_memory = heap_in_use() - before;
+
+    before = heap_in_use();
+    start = now();
+    index = 0;
+    bson_compact_t tree;
+    if (bson_compact_deserialize(&tree, buffer, &index) != 0) return 1;
+    const double compact_decode = now() - start;
+    const size_t compact_memory = heap_in_use() - before;
+
+    double bson_sum = 0, compact_sum = 0;
+    start = now();
+    for (int i = 0; i < ROUNDS; i++) bson_sum += sum_bson(&bson);
+    const double bson_walk = (now() - start) / ROUNDS;
+    start = now();
+    for (int i = 0; i < ROUNDS; i++) compact_sum += sum_compact(&tree, &tree.nodes[0]);
+    const double compact_walk = (now() - start) / ROUNDS;
+    if (bson_sum != compact_sum) return 1;
+
+    uint8_t *output;
+    size_t output_length;
+    start = now();
+    bson_serialize(&output, &bson);
+    const double bson_encode = now() - start;
+    free(output);
+    start = now();
+    bson_compact_serialize(&output, &output_length, &tree);
+    const double compact_encode = now() - start;
+    free(output);
+
+    start = now();
+    bson_free(&bson);
+    const double bson_release = now() - start;
+    start = now();
+    bson_compact_free(&tree);
+    const double compact_release = now() - start;
+
+    printf("%-10s %10s %10s %10s %10s %10s\n", "", "memory", "decode", "traverse", "encode", "free");
+    printf("%-10s %8.1fMB %8.2fms %8.2fms %8.2fms %8.2fms\n", "bson_t", bson_memory / 1e6, bson_decode * 1e3,
+           bson_walk * 1e3, bson_encode * 1e3, bson_release * 1e3);
+    printf("%-10s %8.1fMB %8.2fms %8.2fms %8.2fms %8.2fms\n", "compact", compact_memory / 1e6, compact_decode * 1e3,
+           compact_walk * 1e3, compact_encode * 1e3, compact_release * 1e3);
+    free(buffer);
+    return 0;
+}
@@ -0,0 +1,142 @@
+/*
+ * Cost per node of bson_optimize, bson_write_iter, bson_deserialize, bson_deserialize_into (into the previous copy),
+ * bson_read and bson_free on documents made of long chains of nested containers, where every other node is an array or
+ * an object, and on a shallow document.
+ *
+ *     gcc -std=gnu2x -O2 bench/nesting.c src/bson.c src/view.c -o nesting && ./nesting
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/bson.h"
+
+#define CHAINS 400
+#define DEPTH 500
+#define ROWS 40000
+#define ROUNDS 10
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double) time.tv_sec + (double) time.tv_nsec * 1e-9;
+}
+
+// Containers that are read back have their sizes cached, bson_optimize only walks them once they are reset
+static void reset_sizes(bson_t *bson) { // NOLINT(*-no-recursion)
+    if (bson->type == BSON_ARRAY) {
+        bson->size = 1 << 25;
+        for (uint32_t i = 0; i < bson->array.length; i++) reset_sizes(&bson->array.elements[i]);
+    } else if (bson->type == BSON_OBJECT) {
+        bson->size = 1 << 25;
+        for (uint32_t i = 0; i < bson->object.length; i++) reset_sizes(&bson->object.elements[i].value);
+    }
+}
+
+// Array of `CHAINS` chains of `DEPTH` arrays or objects, each holding a number and the next one
+static bson_t chains(const int objects, uint32_t *nodes) {
+    bson_t *roots = malloc(CHAINS * sizeof(bson_t));
+    for (uint32_t i = 0; i < CHAINS; i++) {
+        bson_t inner = bson_u32(i);
+        for (uint32_t d = 0; d < DEPTH; d++) {
+            if (objects) {
+                object_pair_t *pairs = malloc(2 * sizeof(object_pair_t));
+                pairs[0] = (object_pair_t){string("n"), bson_u32(d)};
+                pairs[1] = (object_pair_t){string("child"), inner};
+                inner = bson_object_heap(pairs, 2);
+            } else {
+                bson_t *elements = malloc(2 * sizeof(bson_t));
+                elements[0] = bson_u32(d);
+                elements[1] = inner;
+                inner = bson_array_heap(elements, 2);
+            }
+        }
+        roots[i] = inner;
+    }
+    *nodes = 1 + CHAINS * (2 * DEPTH + 1);
+    return bson_array_heap(roots, CHAINS);
+}
+
+// Array of `ROWS` small records nested three levels deep at most
+static bson_t rows(uint32_t *nodes) {
+    bson_t *records = malloc(ROWS * sizeof(bson_t));
+    for (uint32_t i = 0; i < ROWS; i++) {
+        bson_t *tags = malloc(3 * sizeof(bson_t));
+        for (uint32_t j = 0; j < 3; j++) tags[j] = bson_u16(i + j);
+        object_pair_t *location = malloc(2 * sizeof(object_pair_t));
+        location[0] = (object_pair_t){string("x"), bson_f64(i * 0.25)};
+        location[1] = (object_pair_t){string("y"), bson_f64(i * 0.5)};
+        object_pair_t *pairs = malloc(5 * sizeof(object_pair_t));
+        pairs[0] = (object_pair_t){string("id"), bson_i64(i)};
+        pairs[1] = (object_pair_t){string("name"), bson_string("record")};
+        pairs[2] = (object_pair_t){string("active"), bson_bool(i % 2)};
+        pairs[3] = (object_pair_t){string("tags"), bson_array_heap(tags, 3)};
+        pairs[4] = (object_pair_t){string("location"), bson_object_heap(location, 2)};
+        records[i] = bson_object_heap(pairs, 5);
+    }
+    *nodes = 1 + ROWS * 11;
+    return bson_array_heap(records, ROWS);
+}
+
+static void run(const char *name, bson_t document, const uint32_t nodes) {
+    uint8_t *buffer;
+    if (bson_serialize(&buffer, &document) != 0) exit(1);
+    const size_t length = 1 + document.size;
+    bson_free(&document);
+    uint8_t *output = malloc(length);
+
+    double decode = 0, into = 0, read = 0, optimize = 0, encode = 0, release = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        double start = now();
+        uint32_t index = 0;
+        bson_t bson = bson_deserialize(buffer, &index);
+        decode += now() - start;
+        if (bson.type == BSON_INVALID) exit(1);
+
+        index = 0;
+        start = now();
+        if (bson_deserialize_into(&bson, buffer, &index) != 0) exit(1);
+        into += now() - start;
+
+        FILE *file = fmemopen(buffer, length, "rb");
+        start = now();
+        bson_t loaded = bson_read(file);
+        read += now() - start;
+        fclose(file);
+        if (loaded.type == BSON_INVALID) exit(1);
+        bson_free(&loaded);
+
+        reset_sizes(&bson);
+        start = now();
+        if (bson_optimize(&bson) + 1 != length) exit(1);
+        optimize += now() - start;
+
+        start = now();
+        if (bson_write_iter(output, 0, &bson) != length) exit(1);
+        encode += now() - start;
+
+        start = now();
+        bson_free(&bson);
+        release += now() - start;
+    }
+    if (memcmp(buffer, output, length) != 0) exit(1);
+
+    const double scale = 1e9 / ROUNDS / nodes;
+    printf("%-8s %9u %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f\n", name, nodes, decode * scale, into * scale, read * scale,
+           optimize * scale, encode * scale, release * scale);
+    free(output);
+    free(buffer);
+}
+
+int main(void) {
+    printf("ns/node  %9s %9s %9s %9s %9s %9s %9s\n", "nodes", "decode", "into", "read", "optimize", "encode", "free");
+    uint32_t nodes;
+    bson_t document = chains(0, &nodes);
+    run("arrays", document, nodes);
+    document = chains(1, &nodes);
+    run("objects", document, nodes);
+    document = rows(&nodes);
+    run("rows", document, nodes);
+    return 0;
+}
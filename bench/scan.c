@@ -0,0 +1,133 @@
+/*
+ * Throughput of bson_scan_file on a file of back to back documents with a selective equality and range filter, on one
+ * thread and on several, against reading every document with bson_read and testing the tree.
+ *
+ *     gcc -std=gnu2x -O2 -pthread bench/scan.c src/bson.c src/scan.c src/view.c -o scan && ./scan
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/scan.h"
+
+#define DOCUMENTS 400000
+#define ROUNDS 5
+
+// Matches 11 documents: the 10 whose score is in [1000, 1005) and one by name
+#define FILTER "score >= 1000 && score < 1005 || name == \"user-77777\""
+#define MATCHES 11
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double) time.tv_sec + (double) time.tv_nsec * 1e-9;
+}
+
+static const bson_t *member(const bson_t *object, const char *key) {
+    const size_t length = strlen(key);
+    for (uint32_t i = 0; i < object->object.length; i++) {
+        const string_t *name = &object->object.elements[i].key;
+        if (name->length == length && memcmp(name->data, key, length) == 0) return &object->object.elements[i].value;
+    }
+    return NULL;
+}
+
+// Same test as FILTER on a decoded document
+static int tree_match(const bson_t *document) {
+    if (document->type != BSON_OBJECT) return 0;
+    const bson_t *score = member(document, "score");
+    if (score && score->type == BSON_F64 && score->f64 >= 1000 && score->f64 < 1005) return 1;
+    const bson_t *name = member(document, "name");
+    return name && name->type == BSON_STRING && name->string.length == 10 &&
+           memcmp(name->string.data, "user-77777", 10) == 0;
+}
+
+// Writes `DOCUMENTS` records like the rows of bench/compact.c to a temporary file
+static size_t corpus(char *path) {
+    const int fd = mkstemp(path);
+    if (fd < 0) exit(1);
+    FILE *file = fdopen(fd, "wb");
+    if (!file) exit(1);
+    for (uint32_t i = 0; i < DOCUMENTS; i++) {
+        char name[16];
+        const int name_length = snprintf(name, sizeof(name), "user-%u", i);
+        bson_t tags[] = {bson_u16(i * 3), bson_u16(i * 3 + 1), bson_u16(i * 3 + 2)};
+        object_pair_t pairs[] = {
+            {string("id"), bson_i64(i)},
+            {string("name"), bson_string_heap(name, name_length)},
+            {string("score"), bson_f64(i * 0.5)},
+            {string("active"), bson_bool(i % 3 == 0)},
+            {string("tags"), bson_array(tags)},
+        };
+        pairs[1].value.string.alloc = 0;
+        bson_t document = bson_object(pairs);
+        if (bson_write(file, &document) != 0) exit(1);
+    }
+    const long length = ftell(file);
+    if (length < 0 || fclose(file) != 0) exit(1);
+    return length;
+}
+
+static void report(const char *name, const size_t length, const double seconds, const size_t matches) {
+    printf("%-22s %8.2fms %8.2fGB/s %8zu\n", name, seconds * 1e3, length / seconds / 1e9, matches);
+}
+
+// Best of `ROUNDS` scans of the file with `threads` threads
+static void scan(const char *name, const char *path, const size_t length, const bson_filter_t *filter,
+                 const int threads) {
+    double best = 0;
+    size_t matches = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        bson_scan_result_t result = empty_bson_scan_result;
+        const double start = now();
+        if (bson_scan_file(path, filter, threads, 0, &result) != 0) exit(1);
+        const double seconds = now() - start;
+        if (round == 0 || seconds < best) best = seconds;
+        matches = result.length;
+        bson_scan_result_free(&result);
+    }
+    if (matches != MATCHES) exit(1);
+    report(name, length, best, matches);
+}
+
+int main(void) {
+    char path[] = "/tmp/bson-scan-XXXXXX";
+    const size_t length = corpus(path);
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("file       %zu bytes, %u documents, %ld CPUs\n", length, DOCUMENTS, cpus);
+    printf("filter     %s\n", FILTER);
+
+    bson_filter_t *filter = bson_filter_compile(FILTER);
+    if (!filter) return 1;
+
+    double best = 0;
+    size_t matches = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        FILE *file = fopen(path, "rb");
+        if (!file) return 1;
+        const double start = now();
+        matches = 0;
+        for (uint32_t i = 0; i < DOCUMENTS; i++) {
+            bson_t document = bson_read(file);
+            if (document.type == BSON_INVALID) return 1;
+            matches += tree_match(&document);
+            bson_free(&document);
+        }
+        const double seconds = now() - start;
+        if (ftell(file) != (long) length || matches != MATCHES) return 1;
+        fclose(file);
+        if (round == 0 || seconds < best) best = seconds;
+    }
+
+    printf("%-22s %10s %10s %8s\n", "", "time", "speed", "matches");
+    report("bson_read + tree", length, best, matches);
+    scan("scan, 1 thread", path, length, filter, 1);
+    scan("scan, 4 threads", path, length, filter, 4);
+    scan("scan, 1 thread per CPU", path, length, filter, 0);
+
+    bson_filter_free(filter);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * Throughput of UTF-8 validation, scalar and in blocks of 16 bytes, on texts of 1 to 4 byte code points, and of
+ * bson_validate on a document of strings. The block version is first checked to agree with the scalar one on every
+ * pair of bytes around a block boundary and on random texts with errors. The file includes src/view.c to reach both.
+ *
+ *     gcc -std=gnu2x -O2 bench/validate.c src/bson.c -o validate && ./validate
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../src/view.c"
+
+#define TEXT (1 << 20)
+#define STRINGS 100000
+#define CHECKS 2000000
+#define ROUNDS 200
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double) time.tv_sec + (double) time.tv_nsec * 1e-9;
+}
+
+static uint32_t seed = 1;
+
+static uint32_t next_random(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+// Encodes a random code point of `bytes` bytes, or of 1 to 4 bytes if `bytes` is 0
+static size_t code_point(uint8_t *text, int bytes) {
+    if (bytes == 0) bytes = 1 + next_random() % 4;
+    uint32_t value;
+    switch (bytes) {
+        case 1:
+            text[0] = 0x20 + next_random() % 0x5F;
+            return 1;
+        case 2:
+            value = 0x80 + next_random() % (0x800 - 0x80);
+            text[0] = 0xC0 | value >> 6;
+            text[1] = 0x80 | (value & 0x3F);
+            return 2;
+        case 3:
+            do value = 0x800 + next_random() % (0x10000 - 0x800); while (value >= 0xD800 && value <= 0xDFFF);
+            text[0] = 0xE0 | value >> 12;
+            text[1] = 0x80 | (value >> 6 & 0x3F);
+            text[2] = 0x80 | (value & 0x3F);
+            return 3;
+        default:
+            value = 0x10000 + next_random() % (0x110000 - 0x10000);
+            text[0] = 0xF0 | value >> 18;
+            text[1] = 0x80 | (value >> 12 & 0x3F);
+            text[2] = 0x80 | (value >> 6 & 0x3F);
+            text[3] = 0x80 | (value & 0x3F);
+            return 4;
+    }
+}
+
+// Fills a text with code points, padded with ASCII so that none is cut
+static void fill(uint8_t *text, const size_t length, const int bytes) {
+    size_t i = 0;
+    while (length - i >= 4) i += code_point(&text[i], bytes);
+    while (i < length) text[i++] = 'a';
+}
+
+// Number of inputs on which both versions disagree
+static uint32_t cross_check(void) {
+    uint32_t mismatches = 0;
+    uint8_t text[80];
+
+    // Every pair of bytes on both sides of the first block boundary, after and before valid sequences
+    for (int prefix = 0; prefix < 4; prefix++) {
+        for (uint32_t pair = 0; pair < 1 << 16; pair++) {
+            memset(text, 'a', 32);
+            if (prefix) code_point(&text[14 - prefix], prefix);
+            text[14] = pair >> 8;
+            text[15] = pair & 0xFF;
+            if (prefix == 3) code_point(&text[16], 3);
+            for (size_t length = 16; length <= 32; length += 16) {
+                mismatches += !utf8_valid(text, length) != !utf8_valid_scalar(text, length);
+            }
+        }
+    }
+
+    // Random texts of every length up to 80 bytes, mostly valid, with one to three bytes replaced
+    for (uint32_t i = 0; i < CHECKS; i++) {
+        const size_t length = next_random() % (sizeof(text) + 1);
+        fill(text, length, 0);
+        for (uint32_t errors = next_random() % 4; errors > 0 && length > 0; errors--) {
+            text[next_random() % length] = next_random();
+        }
+        mismatches += !utf8_valid(text, length) != !utf8_valid_scalar(text, length);
+    }
+    return mismatches;
+}
+
+// Document of `STRINGS` strings of 10 to 60 bytes, mixing code points of every length
+static uint8_t *corpus(size_t *length) {
+    bson_t *elements = malloc(STRINGS * sizeof(bson_t));
+    for (uint32_t i = 0; i < STRINGS; i++) {
+        const uint32_t string_length = 10 + next_random() % 51;
+        char *data = malloc(string_length);
+        fill((uint8_t *) data, string_length, 0);
+        elements[i] = bson_string_heap(data, string_length);
+        elements[i].string.alloc = 1;
+    }
+    bson_t document = bson_array_heap(elements, STRINGS);
+    uint8_t *buffer;
+    if (bson_serialize(&buffer, &document) != 0) exit(1);
+    *length = 1 + document.size;
+    bson_free(&document);
+    return buffer;
+}
+
+int main(void) {
+#if defined(UTF8_VECTOR_DISPATCH)
+    const int vector = __builtin_cpu_supports("ssse3");
+#elif defined(UTF8_VECTOR)
+    const int vector = 1;
+#else
+    const int vector = 0;
+#endif
+    printf("blocks of 16 bytes: %s\n", vector ? "yes" : "no, both columns are scalar");
+
+    const uint32_t mismatches = cross_check();
+    printf("cross check: %u mismatches\n", mismatches);
+    if (mismatches) return 1;
+
+    static const char *names[] = {"ascii", "2 bytes", "3 bytes", "4 bytes", "mixed"};
+    static const int bytes[] = {1, 2, 3, 4, 0};
+    uint8_t *text = malloc(TEXT);
+    printf("%-10s %12s %12s\n", "", "scalar", "blocks");
+    for (int k = 0; k < 5; k++) {
+        fill(text, TEXT, bytes[k]);
+        int valid = 1;
+        double start = now();
+        for (int i = 0; i < ROUNDS; i++) valid &= utf8_valid_scalar(text, TEXT);
+        const double scalar = (now() - start) / ROUNDS;
+        start = now();
+        for (int i = 0; i < ROUNDS; i++) valid &= utf8_valid(text, TEXT);
+        const double blocks = (now() - start) / ROUNDS;
+        if (!valid) return 1;
+        printf("%-10s %8.2fGB/s %8.2fGB/s\n", names[k], TEXT / scalar / 1e9, TEXT / blocks / 1e9);
+    }
+    free(text);
+
+    size_t length;
+    uint8_t *buffer = corpus(&length);
+    const double start = now();
+    for (int i = 0; i < ROUNDS / 10; i++) {
+        if (bson_validate(buffer, length) != 0) return 1;
+    }
+    const double validate = (now() - start) / (ROUNDS / 10);
+    printf("bson_validate on %zu bytes of strings: %.2fGB/s\n", length, length / validate / 1e9);
+    free(buffer);
+    return 0;
+}
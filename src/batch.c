@@ -0,0 +1,331 @@
+#include "batch.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include "utils.h"
+
+/**
+ * Caches the size of every document.
+ * @return Size of the documents serialized back to back, type bytes included, SIZE_MAX with errno set to EOVERFLOW if
+ * one of them is nested deeper than BSON_MAX_DEPTH
+ */
+size_t bson_batch_size(bson_t *documents, const uint32_t count) {
+    size_t size = count;
+    for (uint32_t i = 0; i < count; i++) {
+        const size_t document = bson_optimize(&documents[i]);
+        if (document == SIZE_MAX) return SIZE_MAX;
+        size += document;
+    }
+    return size;
+}
+
+/**
+ * Serializes documents back to back into a caller provided buffer.
+ * @param buffer Buffer to write into
+ * @param capacity Length of the buffer, at least bson_batch_size of the documents
+ * @param offsets Receives where every document starts in the buffer, may be NULL
+ * @param documents Documents to serialize, their sizes are cached if they are not yet
+ * @param count Number of documents
+ * @return Number of bytes written, 0 with errno set to ENOBUFS if the buffer is too small or to EOVERFLOW if a
+ * document is nested too deep
+ */
+size_t bson_batch_write(uint8_t *buffer, const size_t capacity, size_t *offsets, bson_t *documents,
+                        const uint32_t count) {
+    const size_t size = bson_batch_size(documents, count);
+    if (size == SIZE_MAX) return 0;
+    if (size > capacity) {
+        errno = ENOBUFS;
+        return 0;
+    }
+    size_t index = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (offsets) offsets[i] = index;
+        index = bson_write_iter(buffer, index, &documents[i]);
+    }
+    return index;
+}
+
+/**
+ * Serializes documents after the ones already in the batch, growing its buffers at most once.
+ * @return 0 on success, non-zero with errno set on failure, in which case the batch is unchanged
+ */
+int bson_batch_append(bson_batch_t *batch, bson_t *documents, const uint32_t count) {
+    const size_t size = bson_batch_size(documents, count);
+    if (size == SIZE_MAX) return 1;
+    if (count > UINT32_MAX - batch->count) {
+        errno = EOVERFLOW;
+        return 1;
+    }
+    if (size > batch->capacity - batch->length) {
+        const size_t capacity = batch->length + size > 2 * batch->capacity ? batch->length + size : 2 * batch->capacity;
+        uint8_t *data = realloc(batch->data, capacity);
+        if (!data) return 1;
+        batch->data = data;
+        batch->capacity = capacity;
+    }
+    if (count > batch->offsets_capacity - batch->count) {
+        const uint32_t needed = batch->count + count;
+        const uint32_t capacity = needed > 2 * batch->offsets_capacity ? needed : 2 * batch->offsets_capacity;
+        size_t *offsets = realloc(batch->offsets, capacity * sizeof(size_t));
+        if (!offsets) return 1;
+        batch->offsets = offsets;
+        batch->offsets_capacity = capacity;
+    }
+
+    size_t index = batch->length;
+    for (uint32_t i = 0; i < count; i++) {
+        batch->offsets[batch->count++] = index;
+        index = bson_write_iter(batch->data, index, &documents[i]);
+    }
+    batch->length = index;
+    return 0;
+}
+
+/**
+ * Empties the batch, keeping its buffers for the next documents.
+ */
+void bson_batch_clear(bson_batch_t *batch) {
+    batch->length = 0;
+    batch->count = 0;
+}
+
+void bson_batch_free(bson_batch_t *batch) {
+    if (!batch) return;
+    free(batch->data);
+    free(batch->offsets);
+    *batch = empty_bson_batch;
+}
+
+// Single block the decoded documents live in, measured by a first pass where `block` is NULL
+typedef struct {
+    uint8_t *block;
+    size_t offset;
+} batch_arena_t;
+
+static void *arena_take(batch_arena_t *arena, const size_t size, const size_t align) {
+    arena->offset = (arena->offset + align - 1) & ~(align - 1);
+    void *ptr = arena->block && size ? &arena->block[arena->offset] : NULL;
+    arena->offset += size;
+    return ptr;
+}
+
+// Payload size of the scalar types plus one, 0 for the others
+static const uint8_t scalar_sizes[256] = {
+    [BSON_I8] = 2, [BSON_U8] = 2, [BSON_I16] = 3, [BSON_U16] = 3, [BSON_I32] = 5, [BSON_U32] = 5, [BSON_F32] = 5,
+    [BSON_I64] = 9, [BSON_U64] = 9, [BSON_F64] = 9, [BSON_DATE] = 9, [BSON_NULL] = 1, [BSON_TRUE] = 1, [BSON_FALSE] = 1
+};
+
+static int arena_read(batch_arena_t *arena, bson_t *bson, uint32_t depth, const uint8_t *buffer, uint32_t *index_ref,
+                      uint8_t type);
+
+/**
+ * Reads a table into the arena as an array of objects, whose rows share the keys of the first one.
+ * @param depth Depth of the table, its values are 2 levels below it
+ */
+static int arena_read_table(batch_arena_t *arena, bson_t *bson, const uint32_t depth, // NOLINT(*-no-recursion)
+                            const uint8_t *buffer, uint32_t *index_ref) {
+    const uint32_t start = *index_ref;
+    const uint32_t rows = buf_read_u32o(buffer, start);
+    const uint32_t size = buf_read_u32o(buffer, start + 4);
+    const uint32_t fields = buf_read_u32o(buffer, start + 8);
+    if (rows > (1 << 24) || fields > (1 << 24)) {
+        errno = EOVERFLOW;
+        return 1;
+    }
+    if (rows == 0 || fields == 0) {
+        errno = EINVAL;
+        return 1;
+    }
+
+    // For every field: where its key is, where its type table is (0 if the column has one type) and its cursor
+    uint32_t *columns = malloc_safe(3 * fields * sizeof(uint32_t), { return 1; });
+    uint32_t *keys = columns, *types = columns + fields, *cursors = columns + 2 * fields;
+    uint32_t index = start + 12;
+    for (uint32_t j = 0; j < fields; j++) {
+        keys[j] = index;
+        index += 1 + 4 + buf_read_u32o(buffer, index + 1);
+    }
+    for (uint32_t j = 0; j < fields; j++) {
+        const uint32_t column_length = buf_read_u32o(buffer, index);
+        types[j] = buffer[keys[j]] == BSON_INVALID ? index + 4 : 0;
+        cursors[j] = index + 4 + (types[j] ? rows : 0);
+        index += 4 + column_length;
+    }
+
+    bson_t *elements = arena_take(arena, rows * sizeof(bson_t), _Alignof(bson_t));
+    if (bson) {
+        *bson = bson_table_heap(elements, rows);
+        bson->array.alloc = 0;
+        bson->size = 8 + size;
+    }
+    object_pair_t *first = NULL;
+    for (uint32_t i = 0; i < rows; i++) {
+        object_pair_t *pairs = arena_take(arena, fields * sizeof(object_pair_t), _Alignof(object_pair_t));
+        if (pairs) elements[i] = bson_object_heap(pairs, fields);
+        if (pairs) elements[i].object.alloc = 0;
+        for (uint32_t j = 0; j < fields; j++) {
+            if (i == 0) {
+                const uint32_t key_length = buf_read_u32o(buffer, keys[j] + 1);
+                char *key = arena_take(arena, key_length, 1);
+                if (key) memcpy(key, &buffer[keys[j] + 5], key_length);
+                if (pairs) pairs[j].key = (string_t){.data = key, .length = key_length};
+            } else if (pairs) {
+                pairs[j].key = first[j].key;
+            }
+            const uint8_t type = types[j] ? buffer[types[j] + i] : buffer[keys[j]];
+            if (arena_read(arena, pairs ? &pairs[j].value : NULL, depth + 2, buffer, &cursors[j], type) != 0) {
+                free(columns);
+                return 1;
+            }
+        }
+        if (i == 0) first = pairs;
+    }
+    free(columns);
+    *index_ref = start + 8 + size;
+    return 0;
+}
+
+/**
+ * Reads a value of a specific type, taking the storage of its strings, keys and containers from the arena. Values
+ * are only written while the arena has a block, otherwise `bson` is NULL and only the room they need is counted.
+ * @param depth Depth of the value, containers at BSON_MAX_DEPTH or below are rejected like bson_deserialize does
+ * @return 0 on success, non-zero with errno set on failure
+ */
+static int arena_read(batch_arena_t *arena, bson_t *bson, const uint32_t depth, // NOLINT(*-no-recursion)
+                      const uint8_t *buffer, uint32_t *index_ref, const uint8_t type) {
+    // Containers recurse once per level, so the depth bounds the C stack taken by hostile input
+    if ((type == BSON_ARRAY || type == BSON_OBJECT || type == BSON_TABLE || type == BSON_DELTA) &&
+        depth >= BSON_MAX_DEPTH) {
+        errno = EOVERFLOW;
+        return 1;
+    }
+    const uint32_t index = *index_ref;
+    uint32_t len0, len1;
+    switch ((bson_type) type) {
+        case BSON_STRING:
+        case BSON_BYTES:
+            len0 = buf_read_u32o(buffer, index);
+            if (len0 > (1 << 24)) {
+                errno = EOVERFLOW;
+                return 1;
+            }
+            char *data = arena_take(arena, len0, 1);
+            if (data) memcpy(data, &buffer[index + 4], len0);
+            if (bson) *bson = (bson_t){.type = type, .size = 4 + len0, .string = {.data = data, .length = len0}};
+            *index_ref += 4 + len0;
+            return 0;
+        case BSON_ARRAY:
+        case BSON_OBJECT:
+            len0 = buf_read_u32o(buffer, index);
+            len1 = buf_read_u32o(buffer, index + 4);
+            if (len0 > (1 << 24) || len1 > (1 << 24)) {
+                errno = EOVERFLOW;
+                return 1;
+            }
+            size_t types_index = index + 8;
+            *index_ref += 8 + len0;
+            if (type == BSON_ARRAY) {
+                bson_t *elements = arena_take(arena, len0 * sizeof(bson_t), _Alignof(bson_t));
+                if (bson) *bson = (bson_t){.type = type, .size = 8 + len1, .array = {.elements = elements, .length = len0}};
+                for (uint32_t i = 0; i < len0; i++) {
+                    bson_t *element = elements ? &elements[i] : NULL;
+                    if (arena_read(arena, element, depth + 1, buffer, index_ref, buffer[types_index++]) != 0) return 1;
+                }
+                return 0;
+            }
+            object_pair_t *pairs = arena_take(arena, len0 * sizeof(object_pair_t), _Alignof(object_pair_t));
+            if (bson) *bson = (bson_t){.type = type, .size = 8 + len1, .object = {.elements = pairs, .length = len0}};
+            for (uint32_t i = 0; i < len0; i++) {
+                const uint32_t key_length = buf_read_u32o(buffer, *index_ref);
+                if (key_length > (1 << 24)) {
+                    errno = EOVERFLOW;
+                    return 1;
+                }
+                char *key = arena_take(arena, key_length, 1);
+                if (key) memcpy(key, &buffer[*index_ref + 4], key_length);
+                if (pairs) pairs[i].key = (string_t){.data = key, .length = key_length};
+                *index_ref += 4 + key_length;
+                bson_t *value = pairs ? &pairs[i].value : NULL;
+                if (arena_read(arena, value, depth + 1, buffer, index_ref, buffer[types_index++]) != 0) return 1;
+            }
+            return 0;
+        case BSON_TABLE:
+            return arena_read_table(arena, bson, depth, buffer, index_ref);
+        case BSON_DELTA:
+            len0 = buf_read_u32o(buffer, index);
+            len1 = buf_read_u32o(buffer, index + 4);
+            if (len0 > (1 << 24) || len1 > (1 << 24)) {
+                errno = EOVERFLOW;
+                return 1;
+            }
+            bson_t *elements = arena_take(arena, len0 * sizeof(bson_t), _Alignof(bson_t));
+            if (!bson) {
+                *index_ref += 8 + len1;
+                return 0;
+            }
+            *bson = bson_array_heap(elements, len0);
+            bson->array.alloc = 0;
+            bson->array.layout = BSON_LAYOUT_DELTA;
+            bson->size = 8 + len1;
+            return bson_deserialize_delta(buffer, index_ref, elements);
+        default:
+            const uint8_t size = scalar_sizes[type];
+            if (size == 0) {
+                errno = EINVAL;
+                return 1;
+            }
+            if (bson) {
+                *bson = (bson_t){.type = type, .size = size - 1};
+                if (size == 2) bson->u8 = buffer[index];
+                if (size == 3) bson->u16 = buf_read_u16o(buffer, index);
+                if (size == 5) bson->u32 = buf_read_u32o(buffer, index);
+                if (size == 9) bson->u64 = buf_read_u64o(buffer, index);
+            }
+            *index_ref += size - 1;
+            return 0;
+    }
+}
+
+/**
+ * Deserializes documents stored back to back into a single allocation, which starts with the array of documents:
+ * freeing the returned pointer releases all of them at once. Every string, array and object of the documents lives in
+ * that allocation, so they must not be grown in place, and calling bson_free on them is not needed. Like the other
+ * decoders, only the bounds of the documents themselves are checked, untrusted input goes through bson_validate.
+ * @param buffer Documents serialized back to back, e.g. by bson_batch_append
+ * @param length Length of the buffer in bytes
+ * @param count Receives the number of documents
+ * @return Array of documents, NULL with errno set on failure, or NULL with a count of 0 for an empty buffer,
+ * EOVERFLOW if one is nested deeper than BSON_MAX_DEPTH
+ */
+bson_t *bson_batch_deserialize(const uint8_t *buffer, const size_t length, uint32_t *count) {
+    *count = 0;
+    if (length > UINT32_MAX) {
+        errno = EOVERFLOW;
+        return NULL;
+    }
+    uint32_t documents = 0;
+    for (size_t index = 0; index < length; documents++) {
+        if (bson_skip(buffer, length, index + 1, buffer[index], &index) != 0) {
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+    if (documents == 0) return NULL;
+
+    batch_arena_t arena = {.block = NULL, .offset = 0};
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) arena = (batch_arena_t){.block = malloc_safe(arena.offset, { return NULL; }), .offset = 0};
+        bson_t *decoded = arena_take(&arena, documents * sizeof(bson_t), _Alignof(bson_t));
+        uint32_t index = 0;
+        for (uint32_t i = 0; i < documents; i++) {
+            const uint8_t type = buffer[index++];
+            if (arena_read(&arena, decoded ? &decoded[i] : NULL, 0, buffer, &index, type) != 0) {
+                free(arena.block);
+                return NULL;
+            }
+        }
+    }
+    *count = documents;
+    return (bson_t *) arena.block;
+}
@@ -0,0 +1,30 @@
+#ifndef BSON_BATCH_H
+#define BSON_BATCH_H
+
+#include "bson.h"
+
+// Documents serialized back to back in one growable buffer, each starting with its type byte
+typedef struct {
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+    size_t *offsets; // where every document starts in `data`
+    uint32_t count;
+    uint32_t offsets_capacity;
+} bson_batch_t;
+
+static const bson_batch_t empty_bson_batch = {.data = NULL, .offsets = NULL};
+
+size_t bson_batch_size(bson_t *documents, uint32_t count);
+
+size_t bson_batch_write(uint8_t *buffer, size_t capacity, size_t *offsets, bson_t *documents, uint32_t count);
+
+int bson_batch_append(bson_batch_t *batch, bson_t *documents, uint32_t count);
+
+void bson_batch_clear(bson_batch_t *batch);
+
+void bson_batch_free(bson_batch_t *batch);
+
+bson_t *bson_batch_deserialize(const uint8_t *buffer, size_t length, uint32_t *count);
+
+#endif
@@ -4,14 +4,66 @@
 #include <string.h>
 
 #include "utils.h"
+#include "view.h"
 #include "errno.h"
 
+/*
+ * Frames the functions that do not take a bson_stack_t keep on the C stack, 12 KiB that cover BSON_MAX_DEPTH. Growing
+ * them on the heap instead would ask malloc for a large block in the middle of decoding or freeing a document, which
+ * makes glibc consolidate its fast bins and scatters the nodes allocated next.
+ */
+#define STACK_FRAMES BSON_MAX_DEPTH
+#define default_stack(frames) \
+    {.frames = (frames), .capacity = STACK_FRAMES, .alloc = 0, .max_depth = BSON_MAX_DEPTH}
+
 /**
- * @param bson BSON object to cache the size of
- * @return Size of the BSON object in bytes
+ * Makes room for the frame at `depth`, moving the frames to the heap if they were not there already.
+ * @return 0 on success, non-zero with errno set to ENOMEM on failure
  */
-size_t bson_optimize(bson_t *bson) { // NOLINT(*-no-recursion)
-    size_t size = 8;
+static int stack_grow(bson_stack_t *stack, const uint32_t depth) {
+    if (depth < stack->capacity) return 0;
+    uint32_t capacity = stack->capacity ? stack->capacity * 2 : 16;
+    if (capacity <= depth) capacity = depth + 1;
+    bson_frame_t *frames;
+    if (stack->alloc) {
+        frames = realloc(stack->frames, capacity * sizeof(bson_frame_t));
+        if (!frames) return 1;
+    } else {
+        frames = malloc_safe(capacity * sizeof(bson_frame_t), { return 1; });
+        if (stack->capacity) memcpy(frames, stack->frames, stack->capacity * sizeof(bson_frame_t));
+    }
+    stack->frames = frames;
+    stack->capacity = capacity;
+    stack->alloc = 1;
+    return 0;
+}
+
+/**
+ * Same as stack_grow, for a container at `depth`, which has to be within the max_depth of the stack.
+ * @return 0 on success, non-zero with errno set to EOVERFLOW or ENOMEM on failure
+ */
+static int stack_reserve(bson_stack_t *stack, const uint32_t depth) {
+    if (depth >= stack->max_depth) {
+        errno = EOVERFLOW;
+        return 1;
+    }
+    return stack_grow(stack, depth);
+}
+
+/**
+ * Frees the frames of a stack that moved to the heap, the stack can still be used afterward.
+ */
+void bson_stack_free(bson_stack_t *stack) {
+    if (stack->alloc) free(stack->frames);
+    stack->frames = NULL;
+    stack->capacity = 0;
+    stack->alloc = 0;
+}
+
+/**
+ * @return Serialized size of a value without walking it, the cached size of arrays and objects
+ */
+static size_t value_size(const bson_t *bson) {
     switch (bson->type) {
         case BSON_I8:
         case BSON_U8:
@@ -32,60 +84,412 @@ size_t bson_optimize(bson_t *bson) { // NOLINT(*-no-recursion)
         case BSON_BYTES:
             return 4 + bson->string.length;
         case BSON_ARRAY:
-            if (bson->size != (1 << 25)) return bson->size;
-            for (size_t i = 0; i < bson->array.length; i++) {
-                size += 1 + bson_optimize(&bson->array.elements[i]);
-            }
-            bson->size = size;
-            return size;
         case BSON_OBJECT:
-            if (bson->size != (1 << 25)) return bson->size;
-            for (size_t i = 0; i < bson->object.length; i++) {
-                object_pair_t *pair = &bson->object.elements[i];
-                size += 4 + pair->key.length;
-                size += 1 + bson_optimize(&pair->value);
-            }
-            bson->size = size;
-            return size;
+            return bson->size;
         case BSON_NULL:
         case BSON_TRUE:
         case BSON_FALSE:
         case BSON_INVALID:
+        case BSON_TABLE:
+        case BSON_DELTA:
         case BSON_MAX:
             break;
     }
     return 0;
 }
 
-#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
-#define LE_bswap16(val) val = __builtin_bswap16(val)
-#define LE_bswap32(val) val = __builtin_bswap32(val)
-#define LE_bswap64(val) val = __builtin_bswap64(val)
-#elif defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
-#define LE_bswap16(val)
-#define LE_bswap32(val)
-#define LE_bswap64(val)
-#else
-#error "Cannot determine endianness"
-#endif
-
-#define buf_write_8o(index, val) buffer[index] = (val) & 0xFF
-#define buf_write_16o(index, val) buf_write_8o(index, val); buf_write_8o(index + 1, (val) >> 8)
-#define buf_write_32o(index, val) buf_write_16o(index, val); buf_write_16o(index + 2, (val) >> 16)
-#define buf_write_64o(index, val) buf_write_32o(index, val); buf_write_32o(index + 4, (val) >> 32)
-#define buf_read_u8o(buf, index) buf[index]
-#define buf_read_u16o(buf, index) (buf[index] | (buf[index + 1] << 8))
-#define buf_read_u32o(buf, index) buf[index] | (buf[index + 1] << 8) | (buf[index + 2] << 16) | (buf[index + 3] << 24)
-#define buf_read_u64o(buf, index) \
-    ((uint64_t)buf[index] | ((uint64_t)buf[index + 1] << 8) | ((uint64_t)buf[index + 2] << 16) | \
-     ((uint64_t)buf[index + 3] << 24) | ((uint64_t)buf[index + 4] << 32) | ((uint64_t)buf[index + 5] << 40) | \
-     ((uint64_t)buf[index + 6] << 48) | ((uint64_t)buf[index + 7] << 56))
-
-#define buf_write_8(val) buffer[index++] = (val) & 0xFF
-#define buf_write_16(val) buf_write_8(val); buf_write_8((val) >> 8)
-#define buf_write_32(val) buf_write_16(val); buf_write_16((val) >> 16)
-#define buf_write_64(val) buf_write_32(val); buf_write_32((val) >> 32)
+/**
+ * An array can be stored as a table when all of its elements are objects with the same keys in the same order.
+ * @param array Array to check
+ * @return Number of fields of every row, 0 if the array cannot be stored as a table
+ */
+static uint32_t table_fields(const array_t *array) {
+    if (array->length == 0 || array->elements[0].type != BSON_OBJECT) return 0;
+    const object_t *first = &array->elements[0].object;
+    for (uint32_t i = 1; i < array->length; i++) {
+        const bson_t *row = &array->elements[i];
+        if (row->type != BSON_OBJECT || row->object.length != first->length) return 0;
+        for (uint32_t j = 0; j < first->length; j++) {
+            const string_t *a = &first->elements[j].key;
+            const string_t *b = &row->object.elements[j].key;
+            if (a->length != b->length || (a->length && memcmp(a->data, b->data, a->length) != 0)) return 0;
+        }
+    }
+    return first->length;
+}
+
+/**
+ * @return Wire type shared by a field in every row, BSON_INVALID if it varies, in which case the column
+ * starts with the type of every value
+ */
+static uint8_t table_column_type(const array_t *array, const uint32_t field) {
+    const uint8_t type = bson_wire_type(&array->elements[0].object.elements[field].value);
+    for (uint32_t i = 1; i < array->length; i++) {
+        if (bson_wire_type(&array->elements[i].object.elements[field].value) != type) return BSON_INVALID;
+    }
+    return type;
+}
+
+/**
+ * A table is laid out as: u32 rows, u32 size, u32 fields, then for every field its type and key (u8 type,
+ * u32 key length, key), then for every field its column (u32 column length, column). A column holds the
+ * values of the field in every row back to back, preceded by their types if they are not all the same.
+ * @param array Array whose rows have their sizes cached
+ * @return Serialized size of the array as a table, 0 if it cannot be stored as one
+ */
+static size_t table_optimize(const array_t *array) {
+    const uint32_t fields = table_fields(array);
+    if (fields == 0) return 0;
+
+    size_t size = 8 + 4;
+    const object_t *first = &array->elements[0].object;
+    for (uint32_t j = 0; j < fields; j++) {
+        size += 1 + 4 + first->elements[j].key.length + 4;
+    }
+    for (uint32_t i = 0; i < array->length; i++) {
+        for (uint32_t j = 0; j < fields; j++) {
+            size += value_size(&array->elements[i].object.elements[j].value);
+        }
+    }
+    for (uint32_t j = 0; j < fields; j++) {
+        if (table_column_type(array, j) == BSON_INVALID) size += array->length;
+    }
+    return size;
+}
+
+static size_t write_at(bson_stack_t *stack, uint32_t base, uint8_t *buffer, size_t index, const bson_t *bson);
+
+/**
+ * @param depth Depth of the table, its values are 2 levels below it
+ * @return Updated index in the buffer after writing, SIZE_MAX with errno set if it is nested too deep
+ */
+static size_t table_write(bson_stack_t *stack, const uint32_t depth, uint8_t *buffer, // NOLINT(*-no-recursion)
+                          size_t index, const array_t *array) {
+    if (depth >= stack->max_depth) {
+        errno = EOVERFLOW;
+        return SIZE_MAX;
+    }
+    const object_t *first = &array->elements[0].object;
+    buf_write_32(array->length);
+    index += 4;
+    const size_t table_start = index;
+    buf_write_32(first->length);
+    for (uint32_t j = 0; j < first->length; j++) {
+        const string_t *key = &first->elements[j].key;
+        buffer[index++] = table_column_type(array, j);
+        buf_write_32(key->length);
+        if (key->length) memcpy(&buffer[index], key->data, key->length);
+        index += key->length;
+    }
+    for (uint32_t j = 0; j < first->length; j++) {
+        const size_t column_start = index + 4;
+        index = column_start;
+        if (table_column_type(array, j) == BSON_INVALID) {
+            for (uint32_t i = 0; i < array->length; i++) {
+                buffer[index++] = bson_wire_type(&array->elements[i].object.elements[j].value);
+            }
+        }
+        for (uint32_t i = 0; i < array->length; i++) {
+            index = write_at(stack, depth + 2, buffer, index, &array->elements[i].object.elements[j].value);
+            if (index == SIZE_MAX) return SIZE_MAX;
+        }
+        buf_write_32o(column_start - 4, index - column_start);
+    }
+    buf_write_32o(table_start - 4, index - table_start);
+    return index;
+}
+
+static bson_t deserialize_at(bson_stack_t *stack, uint32_t base, const uint8_t *buffer, uint32_t *index_ref,
+                             uint8_t type);
+
+/**
+ * Reads a table back into an array of objects, which keeps the columns layout. Its keys, columns and type tables
+ * are checked to be within its size, and every value within its column, before they are decoded.
+ * @param depth Depth of the table, its values are 2 levels below it
+ */
+static bson_t table_deserialize(bson_stack_t *stack, const uint32_t depth, // NOLINT(*-no-recursion)
+                                const uint8_t *buffer, uint32_t *index_ref) {
+    const uint32_t start = *index_ref;
+    const uint32_t rows = buf_read_u32o(buffer, start);
+    const uint32_t size = buf_read_u32o(buffer, start + 4);
+    const uint32_t fields = buf_read_u32o(buffer, start + 8);
+    if (rows > (1 << 24) || fields > (1 << 24) || depth >= stack->max_depth) {
+        errno = EOVERFLOW;
+        return bson_invalid;
+    }
+    if (rows == 0 || fields == 0 || size < 4) {
+        errno = EINVAL;
+        return bson_invalid;
+    }
+
+    // For every field: where its key is, where its type table is (0 if the column has one type), its cursor and
+    // where its column ends. Every one of them is checked to be within the size of the table before decoding.
+    const size_t end = (size_t) start + 8 + size;
+    uint32_t *columns = malloc_safe(4 * fields * sizeof(uint32_t), { return bson_invalid; });
+    uint32_t *keys = columns, *types = columns + fields, *cursors = columns + 2 * fields, *ends = columns + 3 * fields;
+    size_t index = start + 12;
+    for (uint32_t j = 0; j < fields; j++) {
+        if (end - index < 5 || buf_read_u32o(buffer, index + 1) > end - index - 5) goto malformed;
+        keys[j] = index;
+        index += 5 + buf_read_u32o(buffer, index + 1);
+    }
+    for (uint32_t j = 0; j < fields; j++) {
+        if (end - index < 4) goto malformed;
+        const uint32_t column_length = buf_read_u32o(buffer, index);
+        if (column_length > end - index - 4) goto malformed;
+        types[j] = buffer[keys[j]] == BSON_INVALID ? index + 4 : 0;
+        if (types[j] && rows > column_length) goto malformed;
+        cursors[j] = index + 4 + (types[j] ? rows : 0);
+        ends[j] = index + 4 + column_length;
+        index = ends[j];
+    }
+    if (index != end) goto malformed;
+
+    bson_t bson = bson_table_heap(NULL, 0);
+    bson.size = 8 + size;
+    bson.array.elements = malloc_safe(rows * sizeof(bson_t), { free(columns); return bson_invalid; });
+    for (uint32_t i = 0; i < rows; i++) {
+        bson_t row = bson_object_heap(NULL, 0);
+        row.object.elements = malloc_safe(fields * sizeof(object_pair_t), { goto fail; });
+        for (uint32_t j = 0; j < fields; j++) {
+            object_pair_t *pair = &row.object.elements[j];
+            pair->key = empty_string_t;
+            pair->key.length = buf_read_u32o(buffer, keys[j] + 1);
+            pair->key.alloc = pair->key.length != 0;
+            pair->key.data = pair->key.length ? malloc_safe(pair->key.length, { goto fail_row; }) : NULL;
+            if (pair->key.length) memcpy(pair->key.data, &buffer[keys[j] + 5], pair->key.length);
+            const uint8_t type = types[j] ? buffer[types[j] + i] : buffer[keys[j]];
+            size_t next;
+            if (bson_skip(buffer, ends[j], cursors[j], type, &next) != 0) {
+                errno = EINVAL;
+                if (pair->key.alloc) free(pair->key.data);
+                goto fail_row;
+            }
+            pair->value = deserialize_at(stack, depth + 2, buffer, &cursors[j], type);
+            if (pair->value.type == BSON_INVALID) {
+                if (pair->key.alloc) free(pair->key.data);
+                goto fail_row;
+            }
+            row.object.length++;
+            continue;
+
+        fail_row:
+            bson_free(&row);
+            goto fail;
+        }
+        bson.array.elements[bson.array.length++] = row;
+    }
+    free(columns);
+    *index_ref = start + 8 + size;
+    return bson;
+
+fail:
+    free(columns);
+    bson_free(&bson);
+    return bson_invalid;
+
+malformed:
+    free(columns);
+    errno = EINVAL;
+    return bson_invalid;
+}
+
+// Byte width of the integer and date types a delta array can hold, 0 for the others
+static const uint8_t delta_widths[BSON_MAX] = {
+    [BSON_I8] = 1, [BSON_U8] = 1, [BSON_I16] = 2, [BSON_U16] = 2, [BSON_I32] = 4, [BSON_U32] = 4,
+    [BSON_I64] = 8, [BSON_U64] = 8, [BSON_DATE] = 8
+};
+
+// Value of an element of a delta array on 64 bits, sign extended for the signed types
+static uint64_t delta_value(const bson_t *bson) {
+    switch (bson->type) {
+        case BSON_I8:
+            return (uint64_t) (int64_t) bson->i8;
+        case BSON_I16:
+            return (uint64_t) (int64_t) bson->i16;
+        case BSON_I32:
+            return (uint64_t) (int64_t) bson->i32;
+        case BSON_U8:
+            return bson->u8;
+        case BSON_U16:
+            return bson->u16;
+        case BSON_U32:
+            return bson->u32;
+        default:
+            return bson->u64;
+    }
+}
+
+/**
+ * A delta array is laid out as: u32 count, u32 size, u8 type of every element, then every element as the zigzag
+ * varint of its difference with the previous one, the first one with 0. Differences wrap around on 64 bits.
+ * @return Serialized size of the array with deltas, 0 if its elements are not all integers or dates of one type
+ */
+static size_t delta_optimize(const array_t *array) {
+    if (array->length == 0) return 0;
+    const bson_type type = array->elements[0].type;
+    if (type >= BSON_MAX || delta_widths[type] == 0) return 0;
+
+    size_t size = 8 + 1;
+    uint64_t previous = 0;
+    for (uint32_t i = 0; i < array->length; i++) {
+        if (array->elements[i].type != type) return 0;
+        const uint64_t value = delta_value(&array->elements[i]);
+        size += varint_size(zigzag_encode(value - previous));
+        previous = value;
+    }
+    return size;
+}
+
+static size_t delta_write(uint8_t *buffer, size_t index, const array_t *array) {
+    buf_write_32(array->length);
+    index += 4;
+    const size_t start = index;
+    buf_write_8(array->elements[0].type);
+    uint64_t previous = 0;
+    for (uint32_t i = 0; i < array->length; i++) {
+        const uint64_t value = delta_value(&array->elements[i]);
+        uint64_t zigzag = zigzag_encode(value - previous);
+        previous = value;
+        while (zigzag >= 0x80) {
+            buf_write_8(zigzag | 0x80);
+            zigzag >>= 7;
+        }
+        buf_write_8(zigzag);
+    }
+    buf_write_32o(start - 4, index - start);
+    return index;
+}
+
+/**
+ * Decodes the elements of a delta array. The decoding is bound by the stores of the 32 byte elements rather than by
+ * the running sum, so a plain loop stays within a few tens of percent of copying the decoded array.
+ * @param buffer Pointer to a buffer that holds the serialized BSON data
+ * @param index_ref Index of the array just after its BSON_DELTA type byte, moved past it
+ * @param elements Receives as many elements as the count at the start of the array
+ * @return 0 on success, non-zero with errno set if the array is malformed
+ */
+int bson_deserialize_delta(const uint8_t *buffer, uint32_t *index_ref, bson_t *elements) {
+    const uint32_t start = *index_ref;
+    const uint32_t count = buf_read_u32o(buffer, start);
+    const uint32_t size = buf_read_u32o(buffer, start + 4);
+    if (count > (1 << 24) || size > (1 << 24)) {
+        errno = EOVERFLOW;
+        return 1;
+    }
+    const uint8_t type = size ? buffer[start + 8] : BSON_INVALID;
+    const uint8_t width = type < BSON_MAX ? delta_widths[type] : 0;
+    if (count == 0 || width == 0) {
+        errno = EINVAL;
+        return 1;
+    }
+
+    const size_t end = (size_t) start + 8 + size;
+    size_t index = start + 9;
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t zigzag;
+        if (!buf_read_varint(buffer, index, end, zigzag)) {
+            errno = EINVAL;
+            return 1;
+        }
+        value += zigzag_decode(zigzag);
+        bson_t *element = &elements[i];
+        *element = (bson_t){.type = type, .size = width};
+        if (width == 1) element->u8 = value;
+        else if (width == 2) element->u16 = value;
+        else if (width == 4) element->u32 = value;
+        else element->u64 = value;
+    }
+    if (index != end) {
+        errno = EINVAL;
+        return 1;
+    }
+    *index_ref = end;
+    return 0;
+}
+
+// Arrays and objects without a cached size, the only values bson_optimize has to walk
+#define optimize_walked(bson) \
+    (((bson)->type == BSON_ARRAY || (bson)->type == BSON_OBJECT) && (bson)->size == (1 << 25))
+
+/**
+ * Picks the layout of an array once the sizes of its elements are known, and caches the size of an array or object.
+ * @param size Size of the container laid out as rows
+ */
+static size_t optimize_finish(bson_t *bson, size_t size) {
+    if (bson->type == BSON_ARRAY) {
+        if (bson->array.layout == BSON_LAYOUT_COLUMNS) {
+            const size_t table_size = table_optimize(&bson->array);
+            if (table_size != 0) {
+                bson->size = table_size;
+                return table_size;
+            }
+            bson->array.layout = BSON_LAYOUT_ROWS;
+        }
+        const size_t delta_size = delta_optimize(&bson->array);
+        bson->array.layout = delta_size != 0 && delta_size < size ? BSON_LAYOUT_DELTA : BSON_LAYOUT_ROWS;
+        if (bson->array.layout == BSON_LAYOUT_DELTA) size = delta_size;
+    }
+    bson->size = size;
+    return size;
+}
 
+/**
+ * @param bson BSON object to cache the size of
+ * @return Size of the BSON object in bytes, SIZE_MAX with errno set if it is nested deeper than BSON_MAX_DEPTH
+ */
+size_t bson_optimize(bson_t *bson) {
+    if (!optimize_walked(bson)) return value_size(bson);
+    bson_frame_t frames[STACK_FRAMES];
+    bson_stack_t stack = default_stack(frames);
+    const size_t size = bson_optimize_with(&stack, bson);
+    bson_stack_free(&stack);
+    return size;
+}
+
+/**
+ * Same as bson_optimize, walking nested arrays and objects with the given stack.
+ * @return Size of the BSON object in bytes, SIZE_MAX with errno set if it is nested deeper than the max_depth of the
+ * stack or the stack could not grow, in which case the sizes of the containers being walked stay uncached
+ */
+size_t bson_optimize_with(bson_stack_t *stack, bson_t *bson) {
+    if (!optimize_walked(bson)) return value_size(bson);
+    if (stack_reserve(stack, 0) != 0) return SIZE_MAX;
+    // The container being walked stays in locals, the frames only hold the ones around it
+    bson_t *parent = bson;
+    size_t size = 8;
+    uint32_t next = 0, depth = 0;
+    for (;;) {
+        bson_t *child;
+        if (parent->type == BSON_ARRAY && next < parent->array.length) {
+            child = &parent->array.elements[next++];
+        } else if (parent->type == BSON_OBJECT && next < parent->object.length) {
+            object_pair_t *pair = &parent->object.elements[next++];
+            size += 4 + pair->key.length;
+            child = &pair->value;
+        } else {
+            const size_t child_size = optimize_finish(parent, size);
+            if (depth == 0) return child_size;
+            const bson_frame_t *frame = &stack->frames[--depth];
+            parent = frame->bson;
+            size = frame->position + 1 + child_size;
+            next = frame->next;
+            continue;
+        }
+
+        if (!optimize_walked(child)) {
+            size += 1 + value_size(child);
+        } else if (stack_reserve(stack, depth + 1) != 0) {
+            return SIZE_MAX;
+        } else {
+            stack->frames[depth++] = (bson_frame_t){.bson = parent, .position = size, .next = next};
+            parent = child;
+            size = 8;
+            next = 0;
+        }
+    }
+}
 
 /**
  * @param buffer Buffer to write BSON data into
@@ -93,19 +497,22 @@ size_t bson_optimize(bson_t *bson) { // NOLINT(*-no-recursion)
  * @param bson BSON value to write
  * @return Updated index in the buffer after writing
  */
-size_t bson_write_iter(uint8_t *buffer, const size_t index, const bson_t *bson) { // NOLINT(*-no-recursion)
-    buffer[index] = bson->type;
+size_t bson_write_iter(uint8_t *buffer, const size_t index, const bson_t *bson) {
+    buffer[index] = bson_wire_type(bson);
     if (bson->type == BSON_INVALID) return index + 1;
     return bson_write_iter_typed(buffer, index + 1, bson);
 }
 
+// Arrays laid out as rows and objects, the values bson_write_iter_typed walks
+#define write_walked(bson) \
+    ((bson)->type == BSON_OBJECT || ((bson)->type == BSON_ARRAY && (bson)->array.layout == BSON_LAYOUT_ROWS))
+
 /**
- * @param buffer Buffer to write BSON data into
- * @param index Current index in the buffer
- * @param bson BSON value to write
- * @return Updated index in the buffer after writing
+ * Writes a value bson_write_iter_typed does not walk: scalars, strings, tables and delta arrays.
+ * @param depth Depth of the value
  */
-size_t bson_write_iter_typed(uint8_t *buffer, size_t index, const bson_t *bson) { // NOLINT(*-no-recursion)
+static size_t write_value(bson_stack_t *stack, const uint32_t depth, uint8_t *buffer, // NOLINT(*-no-recursion)
+                          size_t index, const bson_t *bson) {
     switch (bson->type) {
         case BSON_I8:
         case BSON_U8:
@@ -146,61 +553,135 @@ size_t bson_write_iter_typed(uint8_t *buffer, size_t index, const bson_t *bson)
         case BSON_STRING:
         case BSON_BYTES:
             buf_write_32(bson->string.length);
-            memcpy(&buffer[index], bson->string.data, bson->string.length);
+            if (bson->string.length) memcpy(&buffer[index], bson->string.data, bson->string.length);
             index += bson->string.length;
             break;
         case BSON_ARRAY:
-            const array_t arr = bson->array;
-            buf_write_32(arr.length);
-            index += 4;
-            const size_t array_start = index;
-            for (int i = 0; i < arr.length; i++) {
-                buffer[index++] = arr.elements[i].type;
-            }
-            for (int i = 0; i < arr.length; i++) {
-                index = bson_write_iter_typed(buffer, index, &arr.elements[i]);
+            if (bson->array.layout == BSON_LAYOUT_COLUMNS) {
+                return table_write(stack, depth, buffer, index, &bson->array);
             }
-            const size_t array_size = index - array_start;
-            buf_write_32o(array_start - 4, array_size);
-            break;
+            if (bson->array.layout == BSON_LAYOUT_DELTA) return delta_write(buffer, index, &bson->array);
+            return write_at(stack, depth, buffer, index, bson);
         case BSON_OBJECT:
-            const object_t obj = bson->object;
-            buf_write_32(obj.length);
-            index += 4;
-            const size_t object_start = index;
-            for (int i = 0; i < obj.length; i++) {
-                buffer[index++] = obj.elements[i].value.type;
-            }
-            for (int i = 0; i < obj.length; i++) {
-                const object_pair_t *pair = &obj.elements[i];
-                const string_t *key = &pair->key;
-                const size_t key_length = key->length;
-                buf_write_32(key_length);
-                memcpy(&buffer[index], key->data, key->length);
-                index += key->length;
-                index = bson_write_iter_typed(buffer, index, &pair->value);
-            }
-            const size_t object_size = index - object_start;
-            buf_write_32o(object_start - 4, object_size);
-            break;
+            return write_at(stack, depth, buffer, index, bson);
         case BSON_INVALID:
         case BSON_TRUE:
         case BSON_FALSE:
         case BSON_NULL:
+        case BSON_TABLE:
+        case BSON_DELTA:
         case BSON_MAX:
             break;
     }
     return index;
 }
 
+/**
+ * Writes the count and type table of an array laid out as rows or of an object, its size is written after its
+ * children.
+ * @return Index where its children start
+ */
+static size_t write_open(uint8_t *buffer, size_t index, const bson_t *bson) {
+    if (bson->type == BSON_ARRAY) {
+        const array_t *array = &bson->array;
+        buf_write_32(array->length);
+        index += 4;
+        for (uint32_t i = 0; i < array->length; i++) {
+            buffer[index++] = bson_wire_type(&array->elements[i]);
+        }
+        return index;
+    }
+    const object_t *object = &bson->object;
+    buf_write_32(object->length);
+    index += 4;
+    for (uint32_t i = 0; i < object->length; i++) {
+        buffer[index++] = bson_wire_type(&object->elements[i].value);
+    }
+    return index;
+}
+
+/**
+ * Writes a value, walking nested arrays and objects with the frames of the stack from `base` on.
+ * @return Updated index in the buffer after writing, SIZE_MAX with errno set on failure
+ */
+static size_t write_at(bson_stack_t *stack, const uint32_t base, uint8_t *buffer, // NOLINT(*-no-recursion)
+                       size_t index, const bson_t *bson) {
+    if (!write_walked(bson)) return write_value(stack, base, buffer, index, bson);
+    if (stack_reserve(stack, base) != 0) return SIZE_MAX;
+    // The container being written stays in locals, the frames only hold the ones around it
+    const bson_t *parent = bson;
+    size_t start = index + 8;
+    uint32_t next = 0, depth = base;
+    index = write_open(buffer, index, bson);
+    for (;;) {
+        const bson_t *child;
+        if (parent->type == BSON_ARRAY && next < parent->array.length) {
+            child = &parent->array.elements[next++];
+        } else if (parent->type == BSON_OBJECT && next < parent->object.length) {
+            const object_pair_t *pair = &parent->object.elements[next++];
+            const uint32_t key_length = pair->key.length;
+            buf_write_32(key_length);
+            if (key_length) memcpy(&buffer[index], pair->key.data, key_length);
+            index += key_length;
+            child = &pair->value;
+        } else {
+            buf_write_32o(start - 4, index - start);
+            if (depth == base) return index;
+            const bson_frame_t *frame = &stack->frames[--depth];
+            parent = frame->bson;
+            start = frame->position;
+            next = frame->next;
+            continue;
+        }
+
+        if (!write_walked(child)) {
+            index = write_value(stack, depth + 1, buffer, index, child);
+            if (index == SIZE_MAX) return SIZE_MAX;
+        } else if (stack_reserve(stack, depth + 1) != 0) {
+            return SIZE_MAX;
+        } else {
+            stack->frames[depth++] = (bson_frame_t){.bson = (bson_t *) parent, .position = start, .next = next};
+            parent = child;
+            start = index + 8;
+            next = 0;
+            index = write_open(buffer, index, child);
+        }
+    }
+}
+
+/**
+ * @param buffer Buffer to write BSON data into
+ * @param index Current index in the buffer
+ * @param bson BSON value to write, optimized
+ * @return Updated index in the buffer after writing, SIZE_MAX with errno set if it is nested deeper than
+ * BSON_MAX_DEPTH, which bson_optimize would have reported already
+ */
+size_t bson_write_iter_typed(uint8_t *buffer, const size_t index, const bson_t *bson) {
+    bson_frame_t frames[STACK_FRAMES];
+    bson_stack_t stack = default_stack(frames);
+    const size_t end = write_at(&stack, 0, buffer, index, bson);
+    bson_stack_free(&stack);
+    return end;
+}
+
+/**
+ * Same as bson_write_iter_typed, walking nested arrays and objects with the given stack.
+ * @return Updated index in the buffer after writing, SIZE_MAX with errno set if it is nested deeper than the
+ * max_depth of the stack or the stack could not grow
+ */
+size_t bson_write_iter_typed_with(bson_stack_t *stack, uint8_t *buffer, const size_t index, const bson_t *bson) {
+    return write_at(stack, 0, buffer, index, bson);
+}
+
 /**
  * @param buffer Pointer to a buffer that will hold the serialized BSON data
  * @param bson BSON object to serialize
- * @return 0 on success, non-zero on failure
+ * @return 0 on success, non-zero on failure, with errno set to EOVERFLOW if it is nested deeper than BSON_MAX_DEPTH
  */
 int bson_serialize(uint8_t **buffer, bson_t *bson) {
-    const size_t size = 1 + bson_optimize(bson);
-    *buffer = malloc_safe(size, { return 1; });
+    const size_t size = bson_optimize(bson);
+    if (size == SIZE_MAX) return 1;
+    *buffer = malloc_safe(1 + size, { return 1; });
 
     bson_write_iter(*buffer, 0, bson);
 
@@ -223,71 +704,262 @@ int bson_write(FILE *file, bson_t *bson) {
 }
 
 /**
+ * Finds where a serialized value ends without decoding it, checking that it fits in the buffer.
+ * Arrays and objects are skipped in constant time using their size prefix.
+ * @param buffer Buffer holding the serialized data
+ * @param length Length of the buffer in bytes
+ * @param index Index of the value in the buffer, just after its type byte
+ * @param type Type of the value
+ * @param next Receives the index just after the value
+ * @return 0 on success, non-zero if the type is invalid or the value does not fit in the buffer
+ */
+int bson_skip(const uint8_t *buffer, const size_t length, const size_t index, const uint8_t type, size_t *next) {
+    if (type >= BSON_MAX || type <= 0 || index > length) return 1;
+    const size_t available = length - index;
+    size_t size = 0;
+    switch ((bson_type) type) {
+        case BSON_I8:
+        case BSON_U8:
+            size = 1;
+            break;
+        case BSON_I16:
+        case BSON_U16:
+            size = 2;
+            break;
+        case BSON_I32:
+        case BSON_U32:
+        case BSON_F32:
+            size = 4;
+            break;
+        case BSON_I64:
+        case BSON_U64:
+        case BSON_F64:
+        case BSON_DATE:
+            size = 8;
+            break;
+        case BSON_STRING:
+        case BSON_BYTES:
+            if (available < 4) return 1;
+            size = 4 + (size_t) buf_read_u32o(buffer, index);
+            break;
+        case BSON_ARRAY:
+        case BSON_OBJECT:
+        case BSON_TABLE:
+        case BSON_DELTA:
+            if (available < 8) return 1;
+            size = 8 + (size_t) buf_read_u32o(buffer, index + 4);
+            break;
+        case BSON_NULL:
+        case BSON_TRUE:
+        case BSON_FALSE:
+        case BSON_INVALID:
+        case BSON_MAX:
+            break;
+    }
+    if (size > available) return 1;
+    *next = index + size;
+    return 0;
+}
+
+// Arrays and objects with storage, the values bson_free walks
+#define free_walked(bson) \
+    ((bson)->type == BSON_ARRAY ? (bson)->array.elements != NULL \
+                                : (bson)->type == BSON_OBJECT && (bson)->object.elements != NULL)
+
+// Frees the storage of a value bson_free does not walk
+static void free_value(const bson_t *bson) {
+    if ((bson->type == BSON_STRING || bson->type == BSON_BYTES) && bson->string.alloc) free(bson->string.data);
+}
+
+/**
+ * @param bson BSON object to free
+ */
+void bson_free(bson_t *bson) {
+    if (!bson) return;
+    if (!free_walked(bson)) {
+        free_value(bson);
+        return;
+    }
+    bson_frame_t frames[STACK_FRAMES];
+    bson_stack_t stack = default_stack(frames);
+    bson_free_with(&stack, bson);
+    bson_stack_free(&stack);
+}
+
+/**
+ * Same as bson_free, walking nested arrays and objects with the given stack. Freeing cannot be refused, so the stack
+ * grows past its max_depth, and the children of a container it cannot grow for are leaked.
  * @param bson BSON object to free
  */
-void bson_free(bson_t *bson) { // NOLINT(*-no-recursion)
+void bson_free_with(bson_stack_t *stack, bson_t *bson) {
     if (!bson) return;
+    if (!free_walked(bson)) {
+        free_value(bson);
+        return;
+    }
+    if (stack_grow(stack, 0) != 0) return;
+    stack->frames[0] = (bson_frame_t){.bson = bson};
+    uint32_t depth = 0;
+    for (;;) {
+        bson_frame_t *frame = &stack->frames[depth];
+        bson_t *parent = frame->bson;
+        bson_t *child;
+        if (parent->type == BSON_ARRAY && frame->next < parent->array.length) {
+            child = &parent->array.elements[frame->next++];
+        } else if (parent->type == BSON_OBJECT && frame->next < parent->object.length) {
+            object_pair_t *pair = &parent->object.elements[frame->next++];
+            if (pair->key.alloc) free(pair->key.data);
+            child = &pair->value;
+        } else {
+            if (parent->type == BSON_ARRAY && parent->array.alloc) free(parent->array.elements);
+            if (parent->type == BSON_OBJECT && parent->object.alloc) free(parent->object.elements);
+            if (depth == 0) return;
+            depth--;
+            continue;
+        }
+
+        if (!free_walked(child)) {
+            free_value(child);
+        } else if (stack_grow(stack, depth + 1) == 0) {
+            stack->frames[++depth] = (bson_frame_t){.bson = child};
+        }
+    }
+}
 
+#define clone_align(offset) (((offset) + (_Alignof(bson_t) - 1)) & ~(size_t) (_Alignof(bson_t) - 1))
+
+/**
+ * @param bson BSON value to measure
+ * @param offset Offset in the block where its data would start
+ * @return Offset right after the data of the value and all of its children
+ */
+static size_t clone_footprint(const bson_t *bson, size_t offset) { // NOLINT(*-no-recursion)
     switch (bson->type) {
         case BSON_STRING:
         case BSON_BYTES:
-            if (bson->string.alloc) free(bson->string.data);
-            break;
+            return offset + bson->string.length;
         case BSON_ARRAY:
-            if (!bson->object.elements) break;
+            if (bson->array.length == 0) return offset;
+            offset = clone_align(offset) + bson->array.length * sizeof(bson_t);
             for (size_t i = 0; i < bson->array.length; i++) {
-                bson_free(&bson->array.elements[i]);
+                offset = clone_footprint(&bson->array.elements[i], offset);
             }
-            if (bson->array.alloc) free(bson->array.elements);
-            break;
+            return offset;
         case BSON_OBJECT:
-            if (!bson->object.elements) break;
+            if (bson->object.length == 0) return offset;
+            offset = clone_align(offset) + bson->object.length * sizeof(object_pair_t);
             for (size_t i = 0; i < bson->object.length; i++) {
-                bson_free(&bson->object.elements[i].value);
+                const object_pair_t *pair = &bson->object.elements[i];
+                offset = clone_footprint(&pair->value, offset + pair->key.length);
             }
-            if (bson->object.alloc) free(bson->object.elements);
+            return offset;
+        default:
+            return offset;
+    }
+}
+
+static void clone_string(string_t *dst, const string_t *src, uint8_t *block, size_t *offset) {
+    *dst = (string_t){.data = src->length ? (char *) &block[*offset] : NULL, .length = src->length, .alloc = 0};
+    if (src->length) memcpy(dst->data, src->data, src->length);
+    *offset += src->length;
+}
+
+/**
+ * Copies a value into a block sized by clone_footprint, children depth-first after the nodes that point to them.
+ * @param offset Offset in the block to continue from, updated past the copied data
+ */
+static void clone_into(bson_t *dst, const bson_t *src, uint8_t *block, size_t *offset) { // NOLINT(*-no-recursion)
+    *dst = *src;
+    switch (src->type) {
+        case BSON_STRING:
+        case BSON_BYTES:
+            clone_string(&dst->string, &src->string, block, offset);
             break;
-        case BSON_INVALID:
-        case BSON_I8:
-        case BSON_I16:
-        case BSON_I32:
-        case BSON_I64:
-        case BSON_U8:
-        case BSON_U16:
-        case BSON_U32:
-        case BSON_U64:
-        case BSON_F32:
-        case BSON_F64:
-        case BSON_TRUE:
-        case BSON_FALSE:
-        case BSON_DATE:
-        case BSON_NULL:
-        case BSON_MAX:
+        case BSON_ARRAY:
+            dst->array.alloc = 0;
+            if (src->array.length == 0) {
+                dst->array.elements = NULL;
+                break;
+            }
+            *offset = clone_align(*offset);
+            dst->array.elements = (bson_t *) &block[*offset];
+            *offset += src->array.length * sizeof(bson_t);
+            for (size_t i = 0; i < src->array.length; i++) {
+                clone_into(&dst->array.elements[i], &src->array.elements[i], block, offset);
+            }
+            break;
+        case BSON_OBJECT:
+            dst->object.alloc = 0;
+            if (src->object.length == 0) {
+                dst->object.elements = NULL;
+                break;
+            }
+            *offset = clone_align(*offset);
+            dst->object.elements = (object_pair_t *) &block[*offset];
+            *offset += src->object.length * sizeof(object_pair_t);
+            for (size_t i = 0; i < src->object.length; i++) {
+                object_pair_t *pair = &dst->object.elements[i];
+                clone_string(&pair->key, &src->object.elements[i].key, block, offset);
+                clone_into(&pair->value, &src->object.elements[i].value, block, offset);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Deep copy of a value in a single allocation, which is owned by the returned value and released by bson_free.
+ * The whole block starts at the data of the root (string data, array elements or object pairs), so it can also be
+ * released with a single free on that pointer. Cached sizes are kept. Since the children live in the same block, the
+ * containers of the copy must not be grown in place, e.g. by bson_apply_delta.
+ * @param bson BSON value to copy
+ * @return Copy of the value, bson_invalid on allocation failure
+ */
+bson_t bson_clone_flat(const bson_t *bson) {
+    const size_t footprint = clone_footprint(bson, 0);
+    uint8_t *block = footprint ? malloc_safe(footprint, { return bson_invalid; }) : NULL;
+
+    bson_t clone;
+    size_t offset = 0;
+    clone_into(&clone, bson, block, &offset);
+    if (!block) return clone;
+
+    switch (clone.type) {
+        case BSON_STRING:
+        case BSON_BYTES:
+            clone.string.alloc = 1;
+            clone.string.capacity = 0;
+            break;
+        case BSON_ARRAY:
+            clone.array.alloc = 1;
+            clone.array.capacity = 0;
+            break;
+        case BSON_OBJECT:
+            clone.object.alloc = 1;
+            clone.object.capacity = 0;
+            break;
+        default:
             break;
     }
+    return clone;
 }
 
-bson_t bson_read(FILE *file) { // NOLINT(*-no-recursion)
+bson_t bson_read(FILE *file) {
     uint8_t type;
     fread_safe(file, &type, sizeof(uint8_t), 1, { return bson_invalid; });
     return bson_read_typed(file, type);
 }
 
-#define obj_free_rest_temp() \
-while (i != 0) bson_free(&bson.object.elements[--i].value); \
-free(bson.object.elements); \
-return bson_invalid
-
-bson_t bson_read_typed(FILE *file, const uint8_t type) { // NOLINT(*-no-recursion)
-    if (type >= BSON_MAX || type <= 0) {
-        errno = EINVAL;
-        return bson_invalid;
-    }
+static bson_t deserialize_value(bson_stack_t *stack, uint32_t depth, const uint8_t *buffer, uint32_t *index_ref,
+                                uint8_t type);
 
+/**
+ * Reads a value bson_read_typed does not walk: scalars, strings, tables and delta arrays.
+ * @param depth Depth of the value
+ */
+static bson_t read_value(bson_stack_t *stack, const uint32_t depth, FILE *file, const uint8_t type) {
     bson_t bson = {.type = type};
-
-    uint32_t lens[2];
-    uint8_t *types;
     switch ((bson_type) type) {
         case BSON_NULL:
         case BSON_INVALID:
@@ -295,6 +967,29 @@ bson_t bson_read_typed(FILE *file, const uint8_t type) { // NOLINT(*-no-recursio
         case BSON_FALSE:
         case BSON_MAX:
             break;
+        case BSON_TABLE:
+        case BSON_DELTA:
+            // Columns are not stored in row order and deltas are of any length, so the whole value is read first. It is
+            // validated before decoding, since its values are decoded from memory with their lengths trusted.
+            uint8_t header[8];
+            fread_safe(file, header, 1, 8, { return bson_invalid; });
+            const uint32_t payload_size = buf_read_u32o(header, 4);
+            if (payload_size > (1 << 24)) {
+                errno = EOVERFLOW;
+                return bson_invalid;
+            }
+            uint8_t *payload = malloc_safe(9 + (size_t) payload_size, { return bson_invalid; });
+            payload[0] = type;
+            memcpy(payload + 1, header, 8);
+            fread_safe(file, payload + 9, 1, payload_size, { free(payload); return bson_invalid; });
+            if (bson_validate(payload, 9 + (size_t) payload_size) != 0) {
+                free(payload);
+                return bson_invalid;
+            }
+            uint32_t payload_index = 1;
+            bson = deserialize_value(stack, depth, payload, &payload_index, type);
+            free(payload);
+            break;
         case BSON_I8:
         case BSON_U8:
             fread_safe(file, &bson.u8, sizeof(uint8_t), 1, { return bson_invalid; });
@@ -335,79 +1030,128 @@ bson_t bson_read_typed(FILE *file, const uint8_t type) { // NOLINT(*-no-recursio
             bson.size = 4 + len;
             bson.string.data = len ? malloc_safe(bson.string.length, { return bson_invalid; }) : NULL;
             if (len) {
-                fread_safe(file, bson.string.data, 1, bson.string.length, { return bson_invalid; });
-            }
-            break;
-        case BSON_ARRAY:
-            fread_safe(file, &lens, sizeof(uint32_t), 2, { return bson_invalid; });
-            LE_bswap32(lens[0]);
-            LE_bswap32(lens[1]);
-            if (lens[0] > (1 << 24) || lens[1] > (1 << 24)) {
-                errno = EOVERFLOW;
-                return bson_invalid;
-            }
-            types = malloc_safe(lens[0] * sizeof(uint8_t), { return bson_invalid; });
-            fread_safe(file, types, sizeof(uint8_t), lens[0], { free(types); return bson_invalid; });
-            bson.array.alloc = lens[0];
-            bson.array.length = lens[0];
-            bson.size = lens[1];
-            bson.array.elements = lens[0] ? malloc_safe(lens[0] * sizeof(bson_t), { return bson_invalid; }) : NULL;
-            for (size_t i = 0; i < lens[0]; i++) {
-                const bson_t loaded = bson_read_typed(file, types[i]);
-                if (loaded.type == BSON_INVALID) {
-                    while (i != 0) bson_free(&bson.array.elements[--i]);
-                    free(bson.array.elements);
+                fread_safe(file, bson.string.data, 1, bson.string.length, {
+                    free(bson.string.data);
                     return bson_invalid;
-                }
-                // ReSharper thinks it might be a null pointer, but it's not because the loop wouldn't run if it was.
-                // ReSharper disable once CppDFANullDereference
-                bson.array.elements[i] = loaded;
+                });
             }
             break;
+        case BSON_ARRAY:
         case BSON_OBJECT:
-            fread_safe(file, &lens, sizeof(uint32_t), 2, { return bson_invalid; });
-            LE_bswap32(lens[0]);
-            LE_bswap32(lens[1]);
-            if (lens[0] > (1 << 24) || lens[1] > (1 << 24)) {
-                errno = EOVERFLOW;
-                return bson_invalid;
-            }
-            types = malloc_safe(lens[0] * sizeof(uint8_t), { return bson_invalid; });
-            fread_safe(file, types, sizeof(uint8_t), lens[0], { free(types); return bson_invalid; });
-            bson.object.alloc = lens[0];
-            bson.object.length = lens[0];
-            bson.size = lens[1];
-            bson.object.elements = lens[0]
-                                       ? malloc_safe(lens[0] * sizeof(object_pair_t), { return bson_invalid; })
-                                       : NULL;
+            // Walked by bson_read_typed_with
+            errno = EINVAL;
+            return bson_invalid;
+    }
+    return bson;
+}
 
-            for (size_t i = 0; i < lens[0]; i++) {
-                object_pair_t pair;
-                fread_safe(file, &pair.key.length, sizeof(uint32_t), 1, { return bson_invalid; });
-                LE_bswap32(pair.key.length);
+/**
+ * Reads the header and type table of an array or object and allocates its children, which are added to it as they
+ * are read so that it can be freed at any point.
+ * @return 0 on success, non-zero with errno set on failure
+ */
+static int read_open(bson_frame_t *frame, bson_t *bson, FILE *file, const uint8_t type) {
+    uint32_t lens[2];
+    fread_safe(file, &lens, sizeof(uint32_t), 2, { return 1; });
+    LE_bswap32(lens[0]);
+    LE_bswap32(lens[1]);
+    if (lens[0] > (1 << 24) || lens[1] > (1 << 24)) {
+        errno = EOVERFLOW;
+        return 1;
+    }
+    uint8_t *types = malloc_safe(lens[0] * sizeof(uint8_t) + 1, { return 1; });
+    fread_safe(file, types, sizeof(uint8_t), lens[0], { free(types); return 1; });
+    *bson = (bson_t){.type = type, .size = 8 + lens[1]};
+    if (type == BSON_ARRAY) {
+        bson->array.alloc = lens[0] != 0;
+        bson->array.elements = lens[0] ? malloc_safe(lens[0] * sizeof(bson_t), { free(types); return 1; }) : NULL;
+    } else {
+        bson->object.alloc = lens[0] != 0;
+        bson->object.elements = lens[0]
+                                    ? malloc_safe(lens[0] * sizeof(object_pair_t), { free(types); return 1; })
+                                    : NULL;
+    }
+    *frame = (bson_frame_t){.bson = bson, .types = types, .count = lens[0]};
+    return 0;
+}
 
-                if (pair.key.length > (1 << 24)) {
-                    errno = EOVERFLOW;
+bson_t bson_read_typed(FILE *file, const uint8_t type) {
+    bson_frame_t frames[STACK_FRAMES];
+    bson_stack_t stack = default_stack(frames);
+    const bson_t bson = bson_read_typed_with(&stack, file, type);
+    bson_stack_free(&stack);
+    return bson;
+}
 
-                    obj_free_rest_temp();
-                }
-                char *str = malloc_safe(pair.key.length, { obj_free_rest_temp(); });
-
-                pair.key.data = str;
-                fread_safe(file, str, 1, pair.key.length, { free(str); obj_free_rest_temp(); });
-                const bson_t loaded = bson_read_typed(file, types[i]);
-                if (loaded.type == BSON_INVALID) {
-                    free(str);
-                    obj_free_rest_temp();
-                }
-                pair.value = loaded;
-                // ReSharper thinks it might be a null pointer, but it's not because the loop wouldn't run if it was.
-                // ReSharper disable once CppDFANullDereference
-                bson.object.elements[i] = pair;
+/**
+ * Same as bson_read_typed, walking nested arrays and objects with the given stack.
+ * @return Value read, or bson_invalid with errno set on error, EOVERFLOW if it is nested deeper than the max_depth of
+ * the stack
+ */
+bson_t bson_read_typed_with(bson_stack_t *stack, FILE *file, const uint8_t type) {
+    if (type >= BSON_MAX || type <= 0) {
+        errno = EINVAL;
+        return bson_invalid;
+    }
+    if (type != BSON_ARRAY && type != BSON_OBJECT) return read_value(stack, 0, file, type);
+
+    bson_t bson;
+    if (stack_reserve(stack, 0) != 0 || read_open(&stack->frames[0], &bson, file, type) != 0) return bson_invalid;
+    uint32_t depth = 0;
+    for (;;) {
+        bson_frame_t *frame = &stack->frames[depth];
+        if (frame->next == frame->count) {
+            free(frame->types);
+            if (depth == 0) return bson;
+            depth--;
+            continue;
+        }
+        bson_t *parent = frame->bson;
+        const uint8_t child_type = frame->types[frame->next++];
+        if (child_type >= BSON_MAX || child_type <= 0) {
+            errno = EINVAL;
+            goto fail;
+        }
+
+        string_t key = empty_string_t;
+        if (parent->type == BSON_OBJECT) {
+            fread_safe(file, &key.length, sizeof(uint32_t), 1, { goto fail; });
+            LE_bswap32(key.length);
+            if (key.length > (1 << 24)) {
+                errno = EOVERFLOW;
+                goto fail;
             }
-            break;
+            if (key.length) {
+                key.data = malloc_safe(key.length, { goto fail; });
+                key.alloc = 1;
+                fread_safe(file, key.data, 1, key.length, { free(key.data); goto fail; });
+            }
+        }
+
+        bson_t *child = parent->type == BSON_ARRAY
+                            ? &parent->array.elements[parent->array.length]
+                            : &parent->object.elements[parent->object.length].value;
+        if (child_type == BSON_ARRAY || child_type == BSON_OBJECT) {
+            if (stack_reserve(stack, depth + 1) != 0 || read_open(&stack->frames[depth + 1], child, file, child_type)) {
+                free(key.data);
+                goto fail;
+            }
+            depth++;
+        } else {
+            *child = read_value(stack, depth + 1, file, child_type);
+            if (child->type == BSON_INVALID) {
+                free(key.data);
+                goto fail;
+            }
+        }
+        if (parent->type == BSON_ARRAY) parent->array.length++;
+        else parent->object.elements[parent->object.length++].key = key;
     }
-    return bson;
+
+fail:
+    for (uint32_t i = 0; i <= depth; i++) free(stack->frames[i].types);
+    bson_free(&bson);
+    return bson_invalid;
 }
 
 /**
@@ -416,7 +1160,7 @@ bson_t bson_read_typed(FILE *file, const uint8_t type) { // NOLINT(*-no-recursio
  * @param index_ref Pointer to an index in the buffer that will be updated
  * @return Deserialized BSON object, or bson_invalid on error
  */
-bson_t bson_deserialize(const uint8_t *buffer, uint32_t *index_ref) { // NOLINT(*-no-recursion)
+bson_t bson_deserialize(const uint8_t *buffer, uint32_t *index_ref) {
     const uint8_t type = buffer[(*index_ref)++];
     if (type >= BSON_MAX || type <= 0) {
         errno = EINVAL;
@@ -427,15 +1171,11 @@ bson_t bson_deserialize(const uint8_t *buffer, uint32_t *index_ref) { // NOLINT(
 }
 
 /**
- * Deserializes a BSON object of a specific type from the provided buffer.
- * This function reads the BSON data from the buffer starting at the current index,
- * and updates the index reference to point to the next byte after the deserialized data.
- * @param buffer Pointer to a buffer that holds the serialized BSON data
- * @param index_ref Pointer to an index in the buffer that will be updated
- * @param type Type of BSON data to deserialize
- * @return Deserialized BSON object of the specified type, or bson_invalid on error
+ * Deserializes a value bson_deserialize_typed does not walk: scalars, strings, tables and delta arrays.
+ * @param depth Depth of the value
  */
-bson_t bson_deserialize_typed(const uint8_t *buffer, uint32_t *index_ref, const uint8_t type) { // NOLINT(*-no-recursion)
+static bson_t deserialize_value(bson_stack_t *stack, const uint32_t depth, // NOLINT(*-no-recursion)
+                                const uint8_t *buffer, uint32_t *index_ref, const uint8_t type) {
     if (type >= BSON_MAX || type <= 0) {
         errno = EINVAL;
         return bson_invalid;
@@ -443,10 +1183,7 @@ bson_t bson_deserialize_typed(const uint8_t *buffer, uint32_t *index_ref, const
 
     bson_t bson = {.type = type};
 
-    uint32_t index = *index_ref;
-    uint32_t len0, len1;
-    size_t types_index;
-
+    const uint32_t index = *index_ref;
     switch ((bson_type) type) {
         case BSON_NULL:
         case BSON_INVALID:
@@ -454,6 +1191,23 @@ bson_t bson_deserialize_typed(const uint8_t *buffer, uint32_t *index_ref, const
         case BSON_FALSE:
         case BSON_MAX:
             break;
+        case BSON_TABLE:
+            return table_deserialize(stack, depth, buffer, index_ref);
+        case BSON_DELTA:
+            // Delta arrays count toward the depth like the arrays they are decoded into
+            const uint32_t count = buf_read_u32o(buffer, index);
+            if (count == 0 || count > (1 << 24) || depth >= stack->max_depth) {
+                errno = count ? EOVERFLOW : EINVAL;
+                return bson_invalid;
+            }
+            bson = bson_array_heap(malloc_safe(count * sizeof(bson_t), { return bson_invalid; }), count);
+            bson.array.layout = BSON_LAYOUT_DELTA;
+            bson.size = 8 + buf_read_u32o(buffer, index + 4);
+            if (bson_deserialize_delta(buffer, index_ref, bson.array.elements) != 0) {
+                free(bson.array.elements);
+                return bson_invalid;
+            }
+            break;
         case BSON_I8:
         case BSON_U8:
             bson.u8 = buffer[index];
@@ -498,75 +1252,328 @@ bson_t bson_deserialize_typed(const uint8_t *buffer, uint32_t *index_ref, const
             *index_ref += len + 4;
             break;
         case BSON_ARRAY:
-            len0 = buf_read_u32o(buffer, index);
-            len1 = buf_read_u32o(buffer, index + 4);
-            if (len0 > (1 << 24) || len1 > (1 << 24)) {
+        case BSON_OBJECT:
+            return deserialize_at(stack, depth, buffer, index_ref, type);
+    }
+    return bson;
+}
+
+/**
+ * Reads the header of an array or object and allocates its children, which are added to it as they are decoded so
+ * that it can be freed at any point.
+ * @return 0 on success, non-zero with errno set on failure
+ */
+static int deserialize_open(bson_frame_t *frame, bson_t *bson, const uint8_t *buffer, uint32_t *index_ref,
+                            const uint8_t type) {
+    const uint32_t index = *index_ref;
+    const uint32_t len0 = buf_read_u32o(buffer, index);
+    const uint32_t len1 = buf_read_u32o(buffer, index + 4);
+    if (len0 > (1 << 24) || len1 > (1 << 24)) {
+        errno = EOVERFLOW;
+        return 1;
+    }
+    *bson = (bson_t){.type = type, .size = 8 + len1};
+    if (type == BSON_ARRAY) {
+        bson->array.alloc = len0 != 0;
+        bson->array.elements = len0 ? malloc_safe(len0 * sizeof(bson_t), { return 1; }) : NULL;
+    } else {
+        bson->object.alloc = len0 != 0;
+        bson->object.elements = len0 ? malloc_safe(len0 * sizeof(object_pair_t), { return 1; }) : NULL;
+    }
+    *frame = (bson_frame_t){.bson = bson, .position = index + 8, .count = len0};
+    *index_ref += 8 + len0;
+    return 0;
+}
+
+/**
+ * Deserializes a value, walking nested arrays and objects with the frames of the stack from `base` on.
+ */
+static bson_t deserialize_at(bson_stack_t *stack, const uint32_t base, const uint8_t *buffer, // NOLINT(*-no-recursion)
+                             uint32_t *index_ref, const uint8_t type) {
+    if (type != BSON_ARRAY && type != BSON_OBJECT) return deserialize_value(stack, base, buffer, index_ref, type);
+
+    bson_t bson;
+    if (stack_reserve(stack, base) != 0 || deserialize_open(&stack->frames[base], &bson, buffer, index_ref, type)) {
+        return bson_invalid;
+    }
+    uint32_t depth = base;
+    for (;;) {
+        bson_frame_t *frame = &stack->frames[depth];
+        if (frame->next == frame->count) {
+            if (depth == base) return bson;
+            depth--;
+            continue;
+        }
+        bson_t *parent = frame->bson;
+        const uint8_t child_type = buffer[frame->position++];
+        frame->next++;
+
+        string_t key = empty_string_t;
+        if (parent->type == BSON_OBJECT) {
+            key.length = buf_read_u32o(buffer, *index_ref);
+            if (key.length > (1 << 24)) {
                 errno = EOVERFLOW;
-                return bson_invalid;
+                goto fail;
             }
-            types_index = index + 8;
-            bson.array.alloc = len0;
-            bson.array.length = len0;
-            bson.size = len1;
-            bson.array.elements = len0 ? malloc_safe(len0 * sizeof(bson_t), { return bson_invalid; }) : NULL;
-            *index_ref += 8 + len0;
-            for (size_t i = 0; i < len0; i++) {
-                const bson_t loaded = bson_deserialize_typed(buffer, index_ref, buffer[types_index++]);
-                if (loaded.type == BSON_INVALID) {
-                    while (i != 0) bson_free(&bson.array.elements[--i]);
-                    free(bson.array.elements);
-                    return bson_invalid;
-                }
-                // ReSharper thinks it might be a null pointer, but it's not because the loop wouldn't run if it was.
-                // ReSharper disable once CppDFANullDereference
-                bson.array.elements[i] = loaded;
+            if (key.length) {
+                key.data = malloc_safe(key.length, { goto fail; });
+                key.alloc = 1;
+                memcpy(key.data, &buffer[*index_ref + 4], key.length);
             }
-            break;
-        case BSON_OBJECT:
-            len0 = buf_read_u32o(buffer, index);
-            len1 = buf_read_u32o(buffer, index + 4);
-            if (len0 > (1 << 24) || len1 > (1 << 24)) {
-                errno = EOVERFLOW;
-                return bson_invalid;
+            *index_ref += 4 + key.length;
+        }
+
+        bson_t *child = parent->type == BSON_ARRAY
+                            ? &parent->array.elements[parent->array.length]
+                            : &parent->object.elements[parent->object.length].value;
+        if (child_type == BSON_ARRAY || child_type == BSON_OBJECT) {
+            if (stack_reserve(stack, depth + 1) != 0 ||
+                deserialize_open(&stack->frames[depth + 1], child, buffer, index_ref, child_type) != 0) {
+                free(key.data);
+                goto fail;
             }
-            types_index = index + 8;
-            index += len0;
-            bson.object.alloc = len0;
-            bson.object.length = len0;
-            bson.size = len1;
-            bson.object.elements = len0 ? malloc_safe(len0 * sizeof(object_pair_t), { return bson_invalid; }) : NULL;
-            *index_ref += 8 + len0;
-
-            for (size_t i = 0; i < len0; i++) {
-                object_pair_t pair;
-                pair.key.length = buf_read_u32o(buffer, index);
-                index += 4;
-
-                if (pair.key.length > (1 << 24)) {
-                    errno = EOVERFLOW;
-                    obj_free_rest_temp();
-                }
-                char *str = malloc_safe(pair.key.length, { obj_free_rest_temp(); });
-
-                pair.key.data = str;
-                memcpy(str, &buffer[index], pair.key.length);
-                *index_ref += 4 + pair.key.length;
-                index += pair.key.length;
-                const bson_t loaded = bson_deserialize_typed(buffer, index_ref, buffer[types_index++]);
-                if (loaded.type == BSON_INVALID) {
-                    free(str);
-                    obj_free_rest_temp();
-                }
-                pair.value = loaded;
-                // ReSharper thinks it might be a null pointer, but it's not because the loop wouldn't run if it was.
-                // ReSharper disable once CppDFANullDereference
-                bson.object.elements[i] = pair;
+            depth++;
+        } else {
+            *child = deserialize_value(stack, depth + 1, buffer, index_ref, child_type);
+            if (child->type == BSON_INVALID) {
+                free(key.data);
+                goto fail;
             }
-            break;
+        }
+        if (parent->type == BSON_ARRAY) parent->array.length++;
+        else parent->object.elements[parent->object.length++].key = key;
     }
+
+fail:
+    bson_free(&bson);
+    return bson_invalid;
+}
+
+/**
+ * Deserializes a BSON object of a specific type from the provided buffer.
+ * This function reads the BSON data from the buffer starting at the current index,
+ * and updates the index reference to point to the next byte after the deserialized data.
+ * @param buffer Pointer to a buffer that holds the serialized BSON data
+ * @param index_ref Pointer to an index in the buffer that will be updated
+ * @param type Type of BSON data to deserialize
+ * @return Deserialized BSON object of the specified type, or bson_invalid on error, with errno set to EOVERFLOW if
+ * it is nested deeper than BSON_MAX_DEPTH
+ */
+bson_t bson_deserialize_typed(const uint8_t *buffer, uint32_t *index_ref, const uint8_t type) {
+    bson_frame_t frames[STACK_FRAMES];
+    bson_stack_t stack = default_stack(frames);
+    const bson_t bson = deserialize_at(&stack, 0, buffer, index_ref, type);
+    bson_stack_free(&stack);
     return bson;
 }
 
+/**
+ * Same as bson_deserialize_typed, walking nested arrays and objects with the given stack.
+ * @return Deserialized BSON object of the specified type, or bson_invalid on error, with errno set to EOVERFLOW if
+ * it is nested deeper than the max_depth of the stack
+ */
+bson_t bson_deserialize_typed_with(bson_stack_t *stack, const uint8_t *buffer, uint32_t *index_ref,
+                                   const uint8_t type) {
+    return deserialize_at(stack, 0, buffer, index_ref, type);
+}
+
+/**
+ * Makes `bson` an array of `count` children, reusing the heap storage it owns when it is large enough. Children past
+ * `count` are freed, new ones start as bson_invalid.
+ * @return 0 on success, non-zero with errno set on failure, in which case `bson` can still be freed
+ */
+static int into_array(bson_t *bson, const uint32_t count) {
+    if (bson->type != BSON_ARRAY || !bson->array.alloc || capacity_of(bson->array) < count) {
+        bson_free(bson);
+        *bson = (bson_t){.type = BSON_ARRAY, .array = empty_array_t};
+        if (count) {
+            bson->array.elements = malloc_safe(count * sizeof(bson_t), { return 1; });
+            bson->array.alloc = 1;
+        }
+    }
+    const uint32_t capacity = capacity_of(bson->array);
+    for (uint32_t i = count; i < bson->array.length; i++) bson_free(&bson->array.elements[i]);
+    for (uint32_t i = bson->array.length; i < count; i++) bson->array.elements[i] = bson_invalid;
+    bson->array.length = count;
+    bson->array.capacity = capacity;
+    bson->array.layout = BSON_LAYOUT_ROWS;
+    return 0;
+}
+
+/**
+ * Same as into_array, for an object of `count` members.
+ */
+static int into_object(bson_t *bson, const uint32_t count) {
+    if (bson->type != BSON_OBJECT || !bson->object.alloc || capacity_of(bson->object) < count) {
+        bson_free(bson);
+        *bson = (bson_t){.type = BSON_OBJECT, .object = empty_object_t};
+        if (count) {
+            bson->object.elements = malloc_safe(count * sizeof(object_pair_t), { return 1; });
+            bson->object.alloc = 1;
+        }
+    }
+    const uint32_t capacity = capacity_of(bson->object);
+    for (uint32_t i = count; i < bson->object.length; i++) {
+        object_pair_t *pair = &bson->object.elements[i];
+        if (pair->key.alloc) free(pair->key.data);
+        bson_free(&pair->value);
+    }
+    for (uint32_t i = bson->object.length; i < count; i++) {
+        bson->object.elements[i] = (object_pair_t){.key = empty_string_t, .value = bson_invalid};
+    }
+    bson->object.length = count;
+    bson->object.capacity = capacity;
+    return 0;
+}
+
+/**
+ * Reads a string or a key into `string`, reusing its heap storage when it is large enough.
+ * @return 0 on success, non-zero with errno set on failure
+ */
+static int into_string(string_t *string, const uint8_t *buffer, uint32_t *index_ref) {
+    const uint32_t length = buf_read_u32o(buffer, *index_ref);
+    if (length > (1 << 24)) {
+        errno = EOVERFLOW;
+        return 1;
+    }
+    if (!string->alloc || capacity_of(*string) < length) {
+        if (string->alloc) free(string->data);
+        *string = empty_string_t;
+        if (length) {
+            string->data = malloc_safe(length, { return 1; });
+            string->alloc = 1;
+        }
+    }
+    string->capacity = capacity_of(*string);
+    string->length = length;
+    if (length) memcpy(string->data, &buffer[*index_ref + 4], length);
+    *index_ref += 4 + length;
+    return 0;
+}
+
+/**
+ * Decodes a value deserialize_into_typed does not walk into `bson`: scalars, strings, tables and delta arrays.
+ * @param depth Depth of the value, checked against the max_depth of the stack
+ * @return 0 on success, non-zero with errno set on failure, in which case `bson` can still be freed
+ */
+static int into_value(bson_stack_t *stack, const uint32_t depth, bson_t *bson, const uint8_t *buffer,
+                      uint32_t *index_ref, const uint8_t type) {
+    switch (type) {
+        case BSON_STRING:
+        case BSON_BYTES:
+            if (bson->type != BSON_STRING && bson->type != BSON_BYTES) {
+                bson_free(bson);
+                *bson = (bson_t){.type = type, .string = empty_string_t};
+            }
+            if (into_string(&bson->string, buffer, index_ref) != 0) return 1;
+            bson->type = type;
+            bson->size = 4 + bson->string.length;
+            return 0;
+        case BSON_DELTA:
+            const uint32_t count = buf_read_u32o(buffer, *index_ref);
+            const uint32_t size = buf_read_u32o(buffer, *index_ref + 4);
+            if (count == 0 || count > (1 << 24) || size > (1 << 24) || depth >= stack->max_depth) {
+                errno = count ? EOVERFLOW : EINVAL;
+                return 1;
+            }
+            if (into_array(bson, count) != 0) return 1;
+            for (uint32_t i = 0; i < count; i++) bson_free(&bson->array.elements[i]);
+            bson->array.layout = BSON_LAYOUT_DELTA;
+            bson->size = 8 + size;
+            if (bson_deserialize_delta(buffer, index_ref, bson->array.elements) == 0) return 0;
+            for (uint32_t i = 0; i < count; i++) bson->array.elements[i] = bson_invalid;
+            return 1;
+        default:
+            bson_free(bson);
+            *bson = deserialize_value(stack, depth, buffer, index_ref, type);
+            return bson->type == BSON_INVALID;
+    }
+}
+
+/**
+ * Reads the header of an array or object into `bson`, which keeps the storage it can reuse for its children.
+ * @return 0 on success, non-zero with errno set on failure, in which case `bson` can still be freed
+ */
+static int into_open(bson_frame_t *frame, bson_t *bson, const uint8_t *buffer, uint32_t *index_ref,
+                     const uint8_t type) {
+    const uint32_t index = *index_ref;
+    const uint32_t len0 = buf_read_u32o(buffer, index);
+    const uint32_t len1 = buf_read_u32o(buffer, index + 4);
+    if (len0 > (1 << 24) || len1 > (1 << 24)) {
+        errno = EOVERFLOW;
+        return 1;
+    }
+    if ((type == BSON_ARRAY ? into_array(bson, len0) : into_object(bson, len0)) != 0) return 1;
+    bson->size = 8 + len1;
+    *frame = (bson_frame_t){.bson = bson, .position = index + 8, .count = len0};
+    *index_ref += 8 + len0;
+    return 0;
+}
+
+/**
+ * Same as bson_deserialize_typed, but decodes into `bson` and reuses the heap storage it owns for the strings,
+ * arrays and objects at the same position when it is large enough. Nested arrays and objects are walked with the
+ * frames of the stack, like deserialize_at.
+ * @return 0 on success, non-zero with errno set on failure, in which case `bson` can still be freed
+ */
+static int deserialize_into_typed(bson_stack_t *stack, bson_t *bson, const uint8_t *buffer, uint32_t *index_ref,
+                                  const uint8_t type) {
+    if (type != BSON_ARRAY && type != BSON_OBJECT) return into_value(stack, 0, bson, buffer, index_ref, type);
+    if (stack_reserve(stack, 0) != 0 || into_open(&stack->frames[0], bson, buffer, index_ref, type) != 0) return 1;
+    uint32_t depth = 0;
+    for (;;) {
+        bson_frame_t *frame = &stack->frames[depth];
+        if (frame->next == frame->count) {
+            if (depth == 0) return 0;
+            depth--;
+            continue;
+        }
+        bson_t *parent = frame->bson;
+        const uint8_t child_type = buffer[frame->position++];
+        const uint32_t i = frame->next++;
+
+        bson_t *child;
+        if (parent->type == BSON_ARRAY) {
+            child = &parent->array.elements[i];
+        } else {
+            if (into_string(&parent->object.elements[i].key, buffer, index_ref) != 0) return 1;
+            child = &parent->object.elements[i].value;
+        }
+        if (child_type == BSON_ARRAY || child_type == BSON_OBJECT) {
+            if (stack_reserve(stack, depth + 1) != 0 ||
+                into_open(&stack->frames[depth + 1], child, buffer, index_ref, child_type) != 0) {
+                return 1;
+            }
+            depth++;
+        } else if (into_value(stack, depth + 1, child, buffer, index_ref, child_type) != 0) {
+            return 1;
+        }
+    }
+}
+
+/**
+ * Deserializes a BSON value from the provided buffer into an existing value, typically the previous message of
+ * the same shape. Strings, keys, arrays and objects of `bson` that own enough heap storage are overwritten in
+ * place and keep their capacity, whatever `bson` has left over is freed. Decoding values of the same shape again
+ * does not allocate, except for tables which are always decoded from scratch.
+ * @param bson Value to decode into, a previously decoded value or bson_invalid, freed with bson_free as usual
+ * @param buffer Pointer to a buffer that holds the serialized BSON data
+ * @param index_ref Pointer to an index in the buffer that will be updated
+ * @return 0 on success, non-zero with errno set on failure, in which case `bson` is freed and left invalid, EOVERFLOW
+ * if it is nested deeper than BSON_MAX_DEPTH
+ */
+int bson_deserialize_into(bson_t *bson, const uint8_t *buffer, uint32_t *index_ref) {
+    const uint8_t type = buffer[(*index_ref)++];
+    bson_frame_t frames[STACK_FRAMES];
+    bson_stack_t stack = default_stack(frames);
+    const int status = deserialize_into_typed(&stack, bson, buffer, index_ref, type);
+    bson_stack_free(&stack);
+    if (status == 0) return 0;
+    bson_free(bson);
+    *bson = bson_invalid;
+    return 1;
+}
+
 /**
  * This function recursively prints the BSON object, handling different types
  * and formatting them appropriately for better readability.
@@ -671,6 +1678,8 @@ void bson_print_indent(const bson_t *bson, const int indent) { // NOLINT(*-no-re
             printf("}");
             break;
         case BSON_NULL:
+        case BSON_TABLE:
+        case BSON_DELTA:
         case BSON_MAX:
         case BSON_INVALID:
             printf("null");
@@ -27,29 +27,42 @@ typedef enum {
     BSON_ARRAY,
     BSON_OBJECT,
     BSON_NULL,
+    BSON_TABLE, // only on the wire: array of same-shape objects stored column by column, read as a BSON_ARRAY
+    BSON_DELTA, // only on the wire: array of integers or dates of one type stored as varint deltas, read as a BSON_ARRAY
 
     BSON_MAX
 } bson_type;
 
+typedef enum {
+    BSON_LAYOUT_ROWS = 0, // every element after the other, the default
+    BSON_LAYOUT_COLUMNS, // BSON_TABLE if all elements are objects with the same keys, rows otherwise
+    BSON_LAYOUT_DELTA // BSON_DELTA, chosen by bson_optimize for rows of integers or dates when it is smaller
+} bson_layout;
+
 typedef struct bson_t bson_t;
 typedef struct object_pair_t object_pair_t;
 
+// `capacity` is how many bytes or elements the heap storage can hold, 0 if it holds exactly `length`
 typedef struct {
     char *data;
     uint32_t length;
-    uint8_t alloc; // 0 for stack, otherwise heap allocated
+    uint32_t capacity : 31;
+    uint32_t alloc : 1; // 0 for stack, otherwise heap allocated
 } string_t;
 
 typedef struct {
     bson_t *elements;
     uint32_t length;
-    uint8_t alloc; // 0 for stack, otherwise heap allocated
+    uint32_t capacity : 29;
+    uint32_t alloc : 1; // 0 for stack, otherwise heap allocated
+    uint32_t layout : 2; // bson_layout to serialize with, bson_optimize falls back to rows when it does not apply
 } array_t;
 
 typedef struct {
     object_pair_t *elements;
     uint32_t length;
-    uint8_t alloc; // 0 for stack, otherwise heap allocated
+    uint32_t capacity : 31;
+    uint32_t alloc : 1; // 0 for stack, otherwise heap allocated
 } object_t;
 
 // todo: handle padding manually just in case for old systems? (with static_assert() and offsetof())
@@ -90,7 +103,7 @@ static const object_t empty_object_t = {.elements = NULL, .alloc = 0, .length =
 #define array(data) ((array_t){.elements = (bson_t *)(data), .length = sizeof(data) / sizeof(bson_t), .alloc = 0})
 #define array_heap(data, len) ((array_t){.elements = (bson_t *) (data), .length = (len), .alloc = 1})
 #define object(data) ((object_t){.elements = (object_pair_t *) (data), .length = sizeof(data) / sizeof(object_pair_t), .alloc = 0})
-#define object_heap(data, len) ((object_t){.elements = (object_pair_t *)(k), .length = (len), .alloc = 1})
+#define object_heap(data, len) ((object_t){.elements = (object_pair_t *)(data), .length = (len), .alloc = 1})
 
 #define bson_u8(value) ((bson_t){.type = BSON_U8, .size = 1, .u8 = (value)})
 #define bson_u16(value) ((bson_t){.type = BSON_U16, .size = 2, .u16 = (value)})
@@ -111,6 +124,12 @@ static const object_t empty_object_t = {.elements = NULL, .alloc = 0, .length =
 #define bson_array_heap(data, len) ((bson_t){.type = BSON_ARRAY, .size = (1 << 25), .array = array_heap(data, len)})
 #define bson_object(data) ((bson_t){.type = BSON_OBJECT, .size = (1 << 25), .object = object(data)})
 #define bson_object_heap(data, len) ((bson_t){.type = BSON_OBJECT, .size = (1 << 25), .object = object_heap(data, len)})
+#define bson_table(data) \
+    ((bson_t){.type = BSON_ARRAY, .size = (1 << 25), .array = {.elements = (bson_t *)(data), \
+     .length = sizeof(data) / sizeof(bson_t), .layout = BSON_LAYOUT_COLUMNS}})
+#define bson_table_heap(data, len) \
+    ((bson_t){.type = BSON_ARRAY, .size = (1 << 25), .array = {.elements = (bson_t *)(data), .length = (len), \
+     .alloc = 1, .layout = BSON_LAYOUT_COLUMNS}})
 #define bson_bool(value) ((bson_t){.type = (value) ? BSON_TRUE : BSON_FALSE, .size = 1})
 
 static const bson_t empty_bson_string = {.type = BSON_STRING, .size = 4, .string = empty_string_t};
@@ -122,26 +141,83 @@ static const bson_t bson_false = {.type = BSON_FALSE, .size = 1};
 
 static const bson_t bson_invalid = {.type = BSON_INVALID};
 
+// Type byte written for an optimized value, which differs from its type for arrays serialized as tables or deltas
+#define bson_wire_type(bson) \
+    ((bson)->type != BSON_ARRAY || (bson)->array.layout == BSON_LAYOUT_ROWS \
+         ? (bson)->type \
+         : (bson)->array.layout == BSON_LAYOUT_COLUMNS ? BSON_TABLE : BSON_DELTA)
+
+// Arrays, objects and tables nested deeper than this are rejected by the decoders and bson_validate by default
+#define BSON_MAX_DEPTH 512
+
+// Container being walked by one of the functions taking a bson_stack_t
+typedef struct {
+    bson_t *bson;
+
+    union {
+        size_t position; // size so far, start of the payload or index of the next type, depending on the walk
+        uint8_t *types; // type table read from a file
+    };
+
+    uint32_t next; // next child to visit
+    uint32_t count; // children of the container
+} bson_frame_t;
+
+/*
+ * Explicit stack of the containers bson_optimize, bson_write_iter_typed, bson_deserialize_typed, bson_read_typed and
+ * bson_free are in the middle of, so nesting costs a frame instead of a function call and deep documents cannot
+ * overflow the C stack. The functions without a stack keep BSON_MAX_DEPTH frames on the C stack, the `_with` variants
+ * take one that keeps its frames on the heap between calls and can have another depth limit.
+ */
+typedef struct {
+    bson_frame_t *frames;
+    uint32_t capacity : 31;
+    uint32_t alloc : 1; // 0 for stack, otherwise heap allocated
+    uint32_t max_depth; // containers nested deeper than this are rejected with EOVERFLOW, bson_free has no limit
+} bson_stack_t;
+
+#define bson_stack(depth) ((bson_stack_t){.frames = NULL, .capacity = 0, .alloc = 0, .max_depth = (depth)})
+
+void bson_stack_free(bson_stack_t *stack);
+
 void bson_free(bson_t *bson);
 
+void bson_free_with(bson_stack_t *stack, bson_t *bson);
+
+bson_t bson_clone_flat(const bson_t *bson);
+
 size_t bson_optimize(bson_t *bson);
 
+size_t bson_optimize_with(bson_stack_t *stack, bson_t *bson);
+
 int bson_serialize(uint8_t **buffer, bson_t *bson);
 
 bson_t bson_deserialize(const uint8_t *buffer, uint32_t *index_ref);
 
 bson_t bson_deserialize_typed(const uint8_t *buffer, uint32_t *index_ref, const uint8_t type);
 
+bson_t bson_deserialize_typed_with(bson_stack_t *stack, const uint8_t *buffer, uint32_t *index_ref, uint8_t type);
+
+int bson_deserialize_into(bson_t *bson, const uint8_t *buffer, uint32_t *index_ref);
+
+int bson_deserialize_delta(const uint8_t *buffer, uint32_t *index_ref, bson_t *elements);
+
 int bson_write(FILE *file, bson_t *bson);
 
 size_t bson_write_iter(uint8_t *buffer, const size_t index, const bson_t *bson);
 
 size_t bson_write_iter_typed(uint8_t *buffer, size_t index, const bson_t *bson);
 
+size_t bson_write_iter_typed_with(bson_stack_t *stack, uint8_t *buffer, size_t index, const bson_t *bson);
+
+int bson_skip(const uint8_t *buffer, size_t length, size_t index, uint8_t type, size_t *next);
+
 bson_t bson_read(FILE *file);
 
 bson_t bson_read_typed(FILE *file, const uint8_t type);
 
+bson_t bson_read_typed_with(bson_stack_t *stack, FILE *file, uint8_t type);
+
 void bson_print_indent(const bson_t *bson, const int indent);
 
 void bson_print(const bson_t *bson);
@@ -0,0 +1,517 @@
+#include "canonical.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include "utils.h"
+
+#define CANONICAL_STACK_PAIRS 16
+
+static int is_integer(const bson_type type) {
+    return type >= BSON_I8 && type <= BSON_U64;
+}
+
+/**
+ * @param bson Integer BSON value
+ * @param bits Receives the value sign extended to 64 bits
+ * @return 1 if the value is negative, 0 otherwise
+ */
+static int integer_bits(const bson_t *bson, uint64_t *bits) {
+    int64_t i64;
+    switch (bson->type) {
+        case BSON_I8:
+            i64 = bson->i8;
+            break;
+        case BSON_I16:
+            i64 = bson->i16;
+            break;
+        case BSON_I32:
+            i64 = bson->i32;
+            break;
+        case BSON_I64:
+            i64 = bson->i64;
+            break;
+        case BSON_U8:
+            *bits = bson->u8;
+            return 0;
+        case BSON_U16:
+            *bits = bson->u16;
+            return 0;
+        case BSON_U32:
+            *bits = bson->u32;
+            return 0;
+        default:
+            *bits = bson->u64;
+            return 0;
+    }
+    *bits = (uint64_t) i64;
+    return i64 < 0;
+}
+
+/**
+ * Integers are canonically stored in the narrowest type that holds them, unsigned unless they are negative.
+ * @param bson Integer BSON value
+ * @return Canonical form of the integer
+ */
+static bson_t canonical_integer(const bson_t *bson) {
+    uint64_t bits;
+    if (integer_bits(bson, &bits)) {
+        const int64_t i64 = (int64_t) bits;
+        if (i64 >= INT8_MIN) return bson_i8(i64);
+        if (i64 >= INT16_MIN) return bson_i16(i64);
+        if (i64 >= INT32_MIN) return bson_i32(i64);
+        return bson_i64(i64);
+    }
+    if (bits <= UINT8_MAX) return bson_u8(bits);
+    if (bits <= UINT16_MAX) return bson_u16(bits);
+    if (bits <= UINT32_MAX) return bson_u32(bits);
+    return bson_u64(bits);
+}
+
+static uint8_t canonical_type(const bson_t *bson) {
+    return is_integer(bson->type) ? canonical_integer(bson).type : bson->type;
+}
+
+static int key_compare(const string_t *a, const string_t *b) {
+    const uint32_t common = a->length < b->length ? a->length : b->length;
+    const int c = common ? memcmp(a->data, b->data, common) : 0;
+    if (c != 0) return c;
+    return a->length < b->length ? -1 : a->length > b->length;
+}
+
+static int pair_compare(const void *a, const void *b) {
+    const object_pair_t *x = *(const object_pair_t *const *) a;
+    const object_pair_t *y = *(const object_pair_t *const *) b;
+    const int c = key_compare(&x->key, &y->key);
+    if (c != 0) return c;
+    // duplicate keys keep their original order so the result does not depend on the sort implementation
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @param object Object whose members to sort
+ * @param stack Buffer of CANONICAL_STACK_PAIRS entries used for small objects
+ * @return Members sorted by key, either `stack` or a heap array, NULL on allocation failure
+ */
+static const object_pair_t **sorted_pairs(const object_t *object, const object_pair_t **stack) {
+    const object_pair_t **pairs = stack;
+    if (object->length > CANONICAL_STACK_PAIRS) {
+        pairs = malloc_safe(object->length * sizeof(object_pair_t *), { return NULL; });
+    }
+    int sorted = 1;
+    for (uint32_t i = 0; i < object->length; i++) {
+        pairs[i] = &object->elements[i];
+        if (i > 0 && sorted && key_compare(&pairs[i - 1]->key, &pairs[i]->key) > 0) sorted = 0;
+    }
+    if (!sorted) qsort(pairs, object->length, sizeof(object_pair_t *), pair_compare);
+    return pairs;
+}
+
+/**
+ * @param depth Depth of the value, containers at BSON_MAX_DEPTH or below are rejected like bson_optimize does
+ * @return Size of the canonical encoding of the value, SIZE_MAX with errno set to EOVERFLOW if it is nested too deep
+ */
+static size_t canonical_size(const bson_t *bson, const uint32_t depth) { // NOLINT(*-no-recursion)
+    if ((bson->type == BSON_ARRAY || bson->type == BSON_OBJECT) && depth >= BSON_MAX_DEPTH) {
+        errno = EOVERFLOW;
+        return SIZE_MAX;
+    }
+    size_t size = 8, child;
+    switch (bson->type) {
+        case BSON_I8:
+        case BSON_I16:
+        case BSON_I32:
+        case BSON_I64:
+        case BSON_U8:
+        case BSON_U16:
+        case BSON_U32:
+        case BSON_U64:
+            return canonical_integer(bson).size;
+        case BSON_F32:
+            return 4;
+        case BSON_F64:
+        case BSON_DATE:
+            return 8;
+        case BSON_STRING:
+        case BSON_BYTES:
+            return 4 + bson->string.length;
+        case BSON_ARRAY:
+            for (size_t i = 0; i < bson->array.length; i++) {
+                child = canonical_size(&bson->array.elements[i], depth + 1);
+                if (child == SIZE_MAX) return SIZE_MAX;
+                size += 1 + child;
+            }
+            return size;
+        case BSON_OBJECT:
+            for (size_t i = 0; i < bson->object.length; i++) {
+                const object_pair_t *pair = &bson->object.elements[i];
+                child = canonical_size(&pair->value, depth + 1);
+                if (child == SIZE_MAX) return SIZE_MAX;
+                size += 4 + pair->key.length + 1 + child;
+            }
+            return size;
+        case BSON_NULL:
+        case BSON_TRUE:
+        case BSON_FALSE:
+        case BSON_INVALID:
+        case BSON_TABLE:
+        case BSON_DELTA:
+        case BSON_MAX:
+            break;
+    }
+    return 0;
+}
+
+/**
+ * @param bson BSON value to measure
+ * @return Size of the canonical encoding of the value in bytes, not counting its type byte, SIZE_MAX with errno set
+ * to EOVERFLOW if it is nested deeper than BSON_MAX_DEPTH
+ */
+size_t bson_canonical_size(const bson_t *bson) {
+    return canonical_size(bson, 0);
+}
+
+/**
+ * Writes a value that is neither an array nor an object, with integers in their canonical width.
+ * @return Updated index in the buffer after writing
+ */
+static size_t canonical_write_scalar(uint8_t *buffer, size_t index, const bson_t *bson) {
+    const bson_t value = is_integer(bson->type) ? canonical_integer(bson) : *bson;
+    switch (value.type) {
+        case BSON_I8:
+        case BSON_U8:
+            buf_write_8(value.u8);
+            break;
+        case BSON_I16:
+        case BSON_U16:
+            const uint16_t u16 = value.u16;
+            buf_write_16(u16);
+            break;
+        case BSON_I32:
+        case BSON_U32:
+        case BSON_F32:
+            const uint32_t u32 = value.u32;
+            buf_write_32(u32);
+            break;
+        case BSON_I64:
+        case BSON_U64:
+        case BSON_F64:
+        case BSON_DATE:
+            const uint64_t u64 = value.u64;
+            buf_write_64(u64);
+            break;
+        case BSON_STRING:
+        case BSON_BYTES:
+            buf_write_32(value.string.length);
+            if (value.string.length) memcpy(&buffer[index], value.string.data, value.string.length);
+            index += value.string.length;
+            break;
+        default:
+            break;
+    }
+    return index;
+}
+
+/**
+ * Same as bson_write_iter_typed, but with sorted object keys and normalized integers.
+ * @param depth Depth of the value, containers at BSON_MAX_DEPTH or below are rejected
+ * @return Updated index in the buffer after writing, 0 with errno set on failure
+ */
+static size_t canonical_write_typed(uint8_t *buffer, size_t index, const bson_t *bson, // NOLINT(*-no-recursion)
+                                    const uint32_t depth) {
+    if (bson->type != BSON_ARRAY && bson->type != BSON_OBJECT) return canonical_write_scalar(buffer, index, bson);
+    if (depth >= BSON_MAX_DEPTH) {
+        errno = EOVERFLOW;
+        return 0;
+    }
+
+    size_t start;
+    switch (bson->type) {
+        case BSON_ARRAY:
+            const array_t arr = bson->array;
+            buf_write_32(arr.length);
+            index += 4;
+            start = index;
+            for (uint32_t i = 0; i < arr.length; i++) {
+                buffer[index++] = canonical_type(&arr.elements[i]);
+            }
+            for (uint32_t i = 0; i < arr.length; i++) {
+                index = canonical_write_typed(buffer, index, &arr.elements[i], depth + 1);
+                if (index == 0) return 0;
+            }
+            buf_write_32o(start - 4, index - start);
+            return index;
+        case BSON_OBJECT:
+            const object_t obj = bson->object;
+            const object_pair_t *stack[CANONICAL_STACK_PAIRS];
+            const object_pair_t **pairs = sorted_pairs(&obj, stack);
+            if (!pairs) return 0;
+            buf_write_32(obj.length);
+            index += 4;
+            start = index;
+            for (uint32_t i = 0; i < obj.length; i++) {
+                buffer[index++] = canonical_type(&pairs[i]->value);
+            }
+            for (uint32_t i = 0; i < obj.length; i++) {
+                const string_t *key = &pairs[i]->key;
+                buf_write_32(key->length);
+                if (key->length) memcpy(&buffer[index], key->data, key->length);
+                index += key->length;
+                index = canonical_write_typed(buffer, index, &pairs[i]->value, depth + 1);
+                if (index == 0) break;
+            }
+            if (pairs != stack) free(pairs);
+            if (index == 0) return 0;
+            buf_write_32o(start - 4, index - start);
+            return index;
+        default:
+            return index;
+    }
+}
+
+/**
+ * Writes the canonical encoding of a BSON value, including its type byte.
+ * The buffer must hold at least 1 + bson_canonical_size(bson) bytes from `index`.
+ * @param buffer Buffer to write BSON data into
+ * @param index Current index in the buffer
+ * @param bson BSON value to write
+ * @return Updated index in the buffer after writing, 0 with errno set on allocation failure or to EOVERFLOW if it
+ * is nested deeper than BSON_MAX_DEPTH
+ */
+size_t bson_write_canonical(uint8_t *buffer, const size_t index, const bson_t *bson) {
+    buffer[index] = canonical_type(bson);
+    if (bson->type == BSON_INVALID) return index + 1;
+    return canonical_write_typed(buffer, index + 1, bson, 0);
+}
+
+/**
+ * Serializes a BSON value in its canonical form: object members are sorted by key (bytewise) and integers
+ * are stored in the narrowest type that holds them, unsigned unless negative. Two values that are
+ * bson_equal serialize to the same bytes, so they can be compared with memcmp and hashed with bson_hash.
+ * The output is a regular serialization and can be read back with bson_deserialize.
+ * @param buffer Pointer to a buffer that will hold the serialized BSON data
+ * @param length Receives the length of the serialized data
+ * @param bson BSON value to serialize, it is not modified
+ * @return 0 on success, non-zero on failure, with errno set to EOVERFLOW if it is nested deeper than BSON_MAX_DEPTH
+ */
+int bson_serialize_canonical(uint8_t **buffer, size_t *length, const bson_t *bson) {
+    const size_t payload = bson_canonical_size(bson);
+    if (payload == SIZE_MAX) return 1;
+    const size_t size = 1 + payload;
+    *buffer = malloc_safe(size, { return 1; });
+
+    if (bson_write_canonical(*buffer, 0, bson) == 0) {
+        free(*buffer);
+        *buffer = NULL;
+        return 1;
+    }
+    *length = size;
+    return 0;
+}
+
+/**
+ * @param depth Depth of the values, containers at BSON_MAX_DEPTH or below are reported as different
+ * @return 1 if the values are equal, 0 otherwise
+ */
+static int values_equal(const bson_t *a, const bson_t *b, const uint32_t depth) { // NOLINT(*-no-recursion)
+    if (is_integer(a->type) && is_integer(b->type)) {
+        uint64_t a_bits, b_bits;
+        return integer_bits(a, &a_bits) == integer_bits(b, &b_bits) && a_bits == b_bits;
+    }
+    if (a->type != b->type) return 0;
+    if ((a->type == BSON_ARRAY || a->type == BSON_OBJECT) && depth >= BSON_MAX_DEPTH) {
+        errno = EOVERFLOW;
+        return 0;
+    }
+
+    switch (a->type) {
+        case BSON_F32:
+            return a->u32 == b->u32;
+        case BSON_F64:
+        case BSON_DATE:
+            return a->u64 == b->u64;
+        case BSON_STRING:
+        case BSON_BYTES:
+            return a->string.length == b->string.length &&
+                   (a->string.length == 0 || memcmp(a->string.data, b->string.data, a->string.length) == 0);
+        case BSON_ARRAY:
+            if (a->array.length != b->array.length) return 0;
+            for (uint32_t i = 0; i < a->array.length; i++) {
+                if (!values_equal(&a->array.elements[i], &b->array.elements[i], depth + 1)) return 0;
+            }
+            return 1;
+        case BSON_OBJECT:
+            if (a->object.length != b->object.length) return 0;
+            uint32_t i = 0;
+            while (i < a->object.length &&
+                   key_compare(&a->object.elements[i].key, &b->object.elements[i].key) == 0) {
+                i++;
+            }
+            if (i == a->object.length) {
+                for (i = 0; i < a->object.length; i++) {
+                    if (!values_equal(&a->object.elements[i].value, &b->object.elements[i].value, depth + 1)) return 0;
+                }
+                return 1;
+            }
+
+            const object_pair_t *a_stack[CANONICAL_STACK_PAIRS], *b_stack[CANONICAL_STACK_PAIRS];
+            const object_pair_t **a_pairs = sorted_pairs(&a->object, a_stack);
+            const object_pair_t **b_pairs = a_pairs ? sorted_pairs(&b->object, b_stack) : NULL;
+            int equal = a_pairs && b_pairs;
+            for (i = 0; equal && i < a->object.length; i++) {
+                equal = key_compare(&a_pairs[i]->key, &b_pairs[i]->key) == 0 &&
+                        values_equal(&a_pairs[i]->value, &b_pairs[i]->value, depth + 1);
+            }
+            if (a_pairs && a_pairs != a_stack) free(a_pairs);
+            if (b_pairs && b_pairs != b_stack) free(b_pairs);
+            return equal;
+        default:
+            return 1;
+    }
+}
+
+/**
+ * Compares two BSON values structurally. Integers are equal when their values are equal whatever their
+ * width or signedness, objects are equal when they hold the same members in any order, floats are
+ * compared bitwise. This is the equality under which canonical encodings are identical.
+ * @param a First BSON value
+ * @param b Second BSON value
+ * @return 1 if the values are equal, 0 otherwise, also with errno set to EOVERFLOW if they are both nested deeper
+ * than BSON_MAX_DEPTH
+ */
+int bson_equal(const bson_t *a, const bson_t *b) {
+    return values_equal(a, b, 0);
+}
+
+// bson_hash is XXH64, which is fast on long inputs and can be computed incrementally.
+#define HASH_P1 11400714785074694791ULL
+#define HASH_P2 14029467366897019727ULL
+#define HASH_P3 1609587929392839161ULL
+#define HASH_P4 9650029242287828579ULL
+#define HASH_P5 2870177450012600261ULL
+
+static uint64_t hash_rotl(const uint64_t x, const int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t hash_round(uint64_t acc, const uint64_t input) {
+    acc += input * HASH_P2;
+    acc = hash_rotl(acc, 31);
+    return acc * HASH_P1;
+}
+
+static uint64_t hash_merge(uint64_t acc, const uint64_t value) {
+    acc ^= hash_round(0, value);
+    return acc * HASH_P1 + HASH_P4;
+}
+
+static void hash_stripe(uint64_t acc[4], const uint8_t *stripe) {
+    acc[0] = hash_round(acc[0], buf_read_u64o(stripe, 0));
+    acc[1] = hash_round(acc[1], buf_read_u64o(stripe, 8));
+    acc[2] = hash_round(acc[2], buf_read_u64o(stripe, 16));
+    acc[3] = hash_round(acc[3], buf_read_u64o(stripe, 24));
+}
+
+/**
+ * @param state Hash state to initialize
+ * @param seed Seed of the hash, 0 for bson_hash compatible results
+ */
+void bson_hash_init(bson_hash_state_t *state, const uint64_t seed) {
+    state->seed = seed;
+    state->acc[0] = seed + HASH_P1 + HASH_P2;
+    state->acc[1] = seed + HASH_P2;
+    state->acc[2] = seed;
+    state->acc[3] = seed - HASH_P1;
+    state->total = 0;
+    state->tail_length = 0;
+}
+
+/**
+ * Feeds more bytes to a hash. Hashing data in several calls gives the same result as hashing it at once.
+ * @param state Initialized hash state
+ * @param data Bytes to hash
+ * @param length Number of bytes
+ */
+void bson_hash_update(bson_hash_state_t *state, const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    state->total += length;
+
+    if (state->tail_length + length < 32) {
+        if (length) memcpy(&state->tail[state->tail_length], bytes, length);
+        state->tail_length += length;
+        return;
+    }
+    if (state->tail_length) {
+        const size_t fill = 32 - state->tail_length;
+        memcpy(&state->tail[state->tail_length], bytes, fill);
+        hash_stripe(state->acc, state->tail);
+        bytes += fill;
+        length -= fill;
+        state->tail_length = 0;
+    }
+    uint64_t acc[4] = {state->acc[0], state->acc[1], state->acc[2], state->acc[3]};
+    while (length >= 32) {
+        hash_stripe(acc, bytes);
+        bytes += 32;
+        length -= 32;
+    }
+    memcpy(state->acc, acc, sizeof(acc));
+    if (length) memcpy(state->tail, bytes, length);
+    state->tail_length = length;
+}
+
+/**
+ * @param state Hash state, it is not modified so more data can still be added afterward
+ * @return 64-bit hash of all the bytes fed so far
+ */
+uint64_t bson_hash_final(const bson_hash_state_t *state) {
+    uint64_t h;
+    if (state->total >= 32) {
+        h = hash_rotl(state->acc[0], 1) + hash_rotl(state->acc[1], 7) + hash_rotl(state->acc[2], 12) +
+            hash_rotl(state->acc[3], 18);
+        for (int i = 0; i < 4; i++) h = hash_merge(h, state->acc[i]);
+    } else {
+        h = state->seed + HASH_P5;
+    }
+    h += state->total;
+
+    const uint8_t *tail = state->tail;
+    uint32_t remaining = state->tail_length;
+    while (remaining >= 8) {
+        h ^= hash_round(0, buf_read_u64o(tail, 0));
+        h = hash_rotl(h, 27) * HASH_P1 + HASH_P4;
+        tail += 8;
+        remaining -= 8;
+    }
+    if (remaining >= 4) {
+        h ^= (uint64_t) buf_read_u32o(tail, 0) * HASH_P1;
+        h = hash_rotl(h, 23) * HASH_P2 + HASH_P3;
+        tail += 4;
+        remaining -= 4;
+    }
+    while (remaining--) {
+        h ^= *tail++ * HASH_P5;
+        h = hash_rotl(h, 11) * HASH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= HASH_P2;
+    h ^= h >> 29;
+    h *= HASH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/**
+ * Hashes serialized BSON data. Hash the output of bson_serialize_canonical to get the same hash for
+ * all values that are bson_equal.
+ * @param buffer Serialized BSON data
+ * @param length Length of the data in bytes
+ * @return 64-bit hash of the data
+ */
+uint64_t bson_hash(const uint8_t *buffer, const size_t length) {
+    bson_hash_state_t state;
+    bson_hash_init(&state, 0);
+    bson_hash_update(&state, buffer, length);
+    return bson_hash_final(&state);
+}
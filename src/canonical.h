@@ -0,0 +1,30 @@
+#ifndef BSON_CANONICAL_H
+#define BSON_CANONICAL_H
+
+#include "bson.h"
+
+typedef struct {
+    uint64_t acc[4];
+    uint64_t seed;
+    uint64_t total; // number of bytes hashed so far
+    uint8_t tail[32]; // bytes not yet folded into acc
+    uint32_t tail_length;
+} bson_hash_state_t;
+
+size_t bson_canonical_size(const bson_t *bson);
+
+int bson_serialize_canonical(uint8_t **buffer, size_t *length, const bson_t *bson);
+
+size_t bson_write_canonical(uint8_t *buffer, size_t index, const bson_t *bson);
+
+int bson_equal(const bson_t *a, const bson_t *b);
+
+void bson_hash_init(bson_hash_state_t *state, uint64_t seed);
+
+void bson_hash_update(bson_hash_state_t *state, const void *data, size_t length);
+
+uint64_t bson_hash_final(const bson_hash_state_t *state);
+
+uint64_t bson_hash(const uint8_t *buffer, size_t length);
+
+#endif
@@ -0,0 +1,459 @@
+#include "columns.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include "utils.h"
+
+typedef enum {
+    COLUMN_SUM,
+    COLUMN_MIN,
+    COLUMN_MAX
+} column_op;
+
+typedef struct {
+    enum { NUMBER_SIGNED, NUMBER_UNSIGNED, NUMBER_FLOAT } kind;
+
+    int64_t i64;
+    uint64_t u64;
+    double f64;
+} column_number_t;
+
+/**
+ * Finds a column of a table inside a buffer.
+ * @param start Index of the table in the buffer, just after its BSON_TABLE type byte
+ * @return 0 on success, non-zero with errno set if the table is malformed (EINVAL) or has no such field (ENOENT)
+ */
+static int column_find(const uint8_t *buffer, const size_t length, const size_t start, const char *key,
+                       bson_column_t *column) {
+    size_t end;
+    if (bson_skip(buffer, length, start, BSON_TABLE, &end) != 0 || end - start < 12) {
+        errno = EINVAL;
+        return 1;
+    }
+    const uint32_t rows = buf_read_u32o(buffer, start);
+    const uint32_t fields = buf_read_u32o(buffer, start + 8);
+    const size_t key_length = strlen(key);
+
+    int64_t match = -1;
+    uint8_t type = BSON_INVALID;
+    size_t index = start + 12;
+    for (uint32_t j = 0; j < fields; j++) {
+        if (end - index < 5) break;
+        const uint32_t field_length = buf_read_u32o(buffer, index + 1);
+        if (field_length > end - index - 5) break;
+        if (match < 0 && field_length == key_length && memcmp(&buffer[index + 5], key, key_length) == 0) {
+            match = j;
+            type = buffer[index];
+        }
+        index += 5 + field_length;
+    }
+    for (uint32_t j = 0; j < fields && match >= 0; j++) {
+        if (end - index < 4) break;
+        const uint32_t column_length = buf_read_u32o(buffer, index);
+        if (column_length > end - index - 4) break;
+        if (j != match) {
+            index += 4 + column_length;
+            continue;
+        }
+        const uint32_t types_length = type == BSON_INVALID ? rows : 0;
+        if (types_length > column_length) break;
+        column->types = types_length ? &buffer[index + 4] : NULL;
+        column->values = &buffer[index + 4 + types_length];
+        column->rows = rows;
+        column->length = column_length - types_length;
+        column->type = type;
+        return 0;
+    }
+    errno = match < 0 ? ENOENT : EINVAL;
+    return 1;
+}
+
+/**
+ * Looks up one segment of a path inside a serialized array or object, bounded by the buffer.
+ * @param index Index of the container, just after its type byte, receives the index of the child
+ * @param type Type of the container, receives the type of the child
+ * @return 0 if the child was found, ENOENT if it does not exist, EINVAL if the container is malformed
+ */
+static int column_child(const uint8_t *buffer, const size_t length, size_t *index, uint8_t *type,
+                        const char *segment, const size_t segment_length) {
+    if (*type != BSON_ARRAY && *type != BSON_OBJECT) return ENOENT;
+    if (length - *index < 8) return EINVAL;
+    const uint32_t count = buf_read_u32o(buffer, *index);
+    const size_t types = *index + 8;
+    if (count > length - types) return EINVAL;
+    size_t cursor = types + count;
+
+    if (*type == BSON_ARRAY) {
+        uint64_t position = 0;
+        for (size_t i = 0; i < segment_length; i++) {
+            if (segment[i] < '0' || segment[i] > '9' || position >= count) return ENOENT;
+            position = position * 10 + (segment[i] - '0');
+        }
+        if (segment_length == 0 || position >= count) return ENOENT;
+        for (uint64_t i = 0; i < position; i++) {
+            if (bson_skip(buffer, length, cursor, buffer[types + i], &cursor) != 0) return EINVAL;
+        }
+        *index = cursor;
+        *type = buffer[types + position];
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (length - cursor < 4) return EINVAL;
+        const uint32_t key_length = buf_read_u32o(buffer, cursor);
+        if (key_length > length - cursor - 4) return EINVAL;
+        const size_t value = cursor + 4 + key_length;
+        if (key_length == segment_length && memcmp(&buffer[cursor + 4], segment, key_length) == 0) {
+            *index = value;
+            *type = buffer[types + i];
+            return 0;
+        }
+        if (bson_skip(buffer, length, value, buffer[types + i], &cursor) != 0) return EINVAL;
+    }
+    return ENOENT;
+}
+
+/**
+ * Finds a column of a serialized table.
+ * @param buffer Serialized table, starting with its BSON_TABLE type byte
+ * @param length Number of readable bytes in the buffer
+ * @param key Name of the field
+ * @param column Receives the column
+ * @return 0 on success, non-zero with errno set if the table is malformed (EINVAL) or has no such field (ENOENT)
+ */
+int bson_column(const uint8_t *buffer, const size_t length, const char *key, bson_column_t *column) {
+    return bson_column_path(buffer, length, "", key, column);
+}
+
+/**
+ * Finds a column of a table nested in a serialized document, without decoding anything on the way. Only the values
+ * before the ones on the path are skipped, through their length prefixes.
+ * @param buffer Serialized document, starting with its type byte
+ * @param length Number of readable bytes in the buffer
+ * @param path Dotted path of the table, with member keys for objects and indices for arrays like the scan filters,
+ * or "" for the document itself
+ * @param key Name of the field
+ * @param column Receives the column
+ * @return 0 on success, non-zero with errno set if the path does not exist or the table has no such field (ENOENT),
+ * or if the value at the path is malformed or not stored as a table (EINVAL)
+ */
+int bson_column_path(const uint8_t *buffer, const size_t length, const char *path, const char *key,
+                     bson_column_t *column) {
+    if (length == 0) {
+        errno = EINVAL;
+        return 1;
+    }
+    size_t index = 1;
+    uint8_t type = buffer[0];
+    while (*path) {
+        size_t segment_length = 0;
+        while (path[segment_length] && path[segment_length] != '.') segment_length++;
+        const int status = column_child(buffer, length, &index, &type, path, segment_length);
+        if (status != 0) {
+            errno = status;
+            return 1;
+        }
+        path += segment_length + (path[segment_length] == '.');
+    }
+    if (type != BSON_TABLE) {
+        errno = EINVAL;
+        return 1;
+    }
+    return column_find(buffer, length, index, key, column);
+}
+
+/*
+ * Kernels for columns holding a single fixed size numeric type. They load `lanes` values at a time into
+ * GCC vectors, which compile to the SIMD instructions of the target, and reduce the vector at the end.
+ * Integer sums wrap around on overflow, like unsigned arithmetic.
+ */
+#define COLUMN_KERNELS(name, value_t, mask_t, sum_t, lanes) \
+    typedef value_t name##_vector __attribute__((vector_size((lanes) * sizeof(value_t)))); \
+    typedef mask_t name##_mask __attribute__((vector_size((lanes) * sizeof(mask_t)))); \
+    typedef sum_t name##_sum_vector __attribute__((vector_size((lanes) * sizeof(sum_t)))); \
+    \
+    static sum_t name##_sum(const uint8_t *data, const uint32_t rows) { \
+        name##_sum_vector acc = {0}; \
+        uint32_t i = 0; \
+        for (; i + (lanes) <= rows; i += (lanes)) { \
+            name##_vector v; \
+            memcpy(&v, &data[i * sizeof(value_t)], sizeof(v)); \
+            acc += __builtin_convertvector(v, name##_sum_vector); \
+        } \
+        sum_t sum = 0; \
+        for (int l = 0; l < (lanes); l++) sum += acc[l]; \
+        for (; i < rows; i++) { \
+            value_t v; \
+            memcpy(&v, &data[i * sizeof(value_t)], sizeof(v)); \
+            sum += (sum_t) v; \
+        } \
+        return sum; \
+    } \
+    \
+    static value_t name##_extreme(const uint8_t *data, const uint32_t rows, const int max) { \
+        value_t result; \
+        memcpy(&result, data, sizeof(result)); \
+        uint32_t i = 0; \
+        if (rows >= (lanes)) { \
+            name##_vector best; \
+            memcpy(&best, data, sizeof(best)); \
+            for (i = (lanes); i + (lanes) <= rows; i += (lanes)) { \
+                name##_vector v; \
+                memcpy(&v, &data[i * sizeof(value_t)], sizeof(v)); \
+                const name##_mask take = max ? v > best : v < best; \
+                best = (name##_vector) (((name##_mask) v & take) | ((name##_mask) best & ~take)); \
+            } \
+            result = best[0]; \
+            for (int l = 1; l < (lanes); l++) { \
+                if (max ? best[l] > result : best[l] < result) result = best[l]; \
+            } \
+        } \
+        for (; i < rows; i++) { \
+            value_t v; \
+            memcpy(&v, &data[i * sizeof(value_t)], sizeof(v)); \
+            if (max ? v > result : v < result) result = v; \
+        } \
+        return result; \
+    }
+
+COLUMN_KERNELS(column_i8, int8_t, int8_t, uint64_t, 16)
+COLUMN_KERNELS(column_i16, int16_t, int16_t, uint64_t, 16)
+COLUMN_KERNELS(column_i32, int32_t, int32_t, uint64_t, 8)
+COLUMN_KERNELS(column_i64, int64_t, int64_t, uint64_t, 4)
+COLUMN_KERNELS(column_u8, uint8_t, int8_t, uint64_t, 16)
+COLUMN_KERNELS(column_u16, uint16_t, int16_t, uint64_t, 16)
+COLUMN_KERNELS(column_u32, uint32_t, int32_t, uint64_t, 8)
+COLUMN_KERNELS(column_u64, uint64_t, int64_t, uint64_t, 4)
+COLUMN_KERNELS(column_f32, float, int32_t, double, 8)
+COLUMN_KERNELS(column_f64, double, int64_t, double, 4)
+
+static int column_number(const uint8_t *data, const size_t index, const uint8_t type, column_number_t *number) {
+    switch (type) {
+        case BSON_I8:
+            *number = (column_number_t){.kind = NUMBER_SIGNED, .i64 = (int8_t) data[index]};
+            return 0;
+        case BSON_I16:
+            *number = (column_number_t){.kind = NUMBER_SIGNED, .i64 = (int16_t) buf_read_u16o(data, index)};
+            return 0;
+        case BSON_I32:
+            *number = (column_number_t){.kind = NUMBER_SIGNED, .i64 = (int32_t) buf_read_u32o(data, index)};
+            return 0;
+        case BSON_I64:
+            *number = (column_number_t){.kind = NUMBER_SIGNED, .i64 = (int64_t) buf_read_u64o(data, index)};
+            return 0;
+        case BSON_U8:
+            *number = (column_number_t){.kind = NUMBER_UNSIGNED, .u64 = data[index]};
+            return 0;
+        case BSON_U16:
+            *number = (column_number_t){.kind = NUMBER_UNSIGNED, .u64 = buf_read_u16o(data, index)};
+            return 0;
+        case BSON_U32:
+            *number = (column_number_t){.kind = NUMBER_UNSIGNED, .u64 = buf_read_u32o(data, index)};
+            return 0;
+        case BSON_U64:
+            *number = (column_number_t){.kind = NUMBER_UNSIGNED, .u64 = buf_read_u64o(data, index)};
+            return 0;
+        case BSON_F32: {
+            union {
+                uint32_t u;
+                float f;
+            } f32_union = {.u = buf_read_u32o(data, index)};
+            *number = (column_number_t){.kind = NUMBER_FLOAT, .f64 = f32_union.f};
+            return 0;
+        }
+        case BSON_F64: {
+            union {
+                uint64_t u;
+                double d;
+            } f64_union = {.u = buf_read_u64o(data, index)};
+            *number = (column_number_t){.kind = NUMBER_FLOAT, .f64 = f64_union.d};
+            return 0;
+        }
+        default:
+            return 1;
+    }
+}
+
+static double column_number_real(const column_number_t *number) {
+    if (number->kind == NUMBER_FLOAT) return number->f64;
+    return number->kind == NUMBER_SIGNED ? (double) number->i64 : (double) number->u64;
+}
+
+static int column_number_less(const column_number_t *a, const column_number_t *b) {
+    if (a->kind == NUMBER_FLOAT || b->kind == NUMBER_FLOAT) return column_number_real(a) < column_number_real(b);
+    if (a->kind == NUMBER_SIGNED && b->kind == NUMBER_SIGNED) return a->i64 < b->i64;
+    if (a->kind == NUMBER_SIGNED) return a->i64 < 0 || (uint64_t) a->i64 < b->u64;
+    if (b->kind == NUMBER_SIGNED) return b->i64 >= 0 && a->u64 < (uint64_t) b->i64;
+    return a->u64 < b->u64;
+}
+
+/**
+ * Value by value aggregate, used for columns mixing types (e.g. numbers and nulls) and on big-endian
+ * targets. Values that are not numbers are skipped. Sums are F64 if any value is a float, U64 if they are
+ * all unsigned and I64 otherwise, minimums and maximums keep the type of the value they found.
+ */
+static bson_t column_generic(const bson_column_t *column, const column_op op) {
+    int found = 0, any_float = 0, any_signed = 0;
+    uint64_t sum = 0;
+    double real_sum = 0;
+    column_number_t best = {0};
+    uint8_t best_type = BSON_INVALID;
+    size_t index = 0;
+
+    for (uint32_t i = 0; i < column->rows; i++) {
+        const uint8_t type = column->types ? column->types[i] : column->type;
+        size_t next;
+        if (bson_skip(column->values, column->length, index, type, &next) != 0) return bson_invalid;
+        column_number_t number;
+        if (column_number(column->values, index, type, &number) == 0) {
+            any_float |= number.kind == NUMBER_FLOAT;
+            any_signed |= number.kind == NUMBER_SIGNED;
+            sum += number.kind == NUMBER_SIGNED ? (uint64_t) number.i64 : number.u64;
+            real_sum += column_number_real(&number);
+            if (!found || (op == COLUMN_MIN && column_number_less(&number, &best)) ||
+                (op == COLUMN_MAX && column_number_less(&best, &number))) {
+                best = number;
+                best_type = type;
+            }
+            found = 1;
+        }
+        index = next;
+    }
+    if (!found) return bson_invalid;
+
+    if (op == COLUMN_SUM) {
+        if (any_float) return bson_f64(real_sum);
+        return any_signed ? bson_i64((int64_t) sum) : bson_u64(sum);
+    }
+    switch (best_type) {
+        case BSON_I8:
+            return bson_i8(best.i64);
+        case BSON_I16:
+            return bson_i16(best.i64);
+        case BSON_I32:
+            return bson_i32(best.i64);
+        case BSON_I64:
+            return bson_i64(best.i64);
+        case BSON_U8:
+            return bson_u8(best.u64);
+        case BSON_U16:
+            return bson_u16(best.u64);
+        case BSON_U32:
+            return bson_u32(best.u64);
+        case BSON_U64:
+            return bson_u64(best.u64);
+        case BSON_F32:
+            return bson_f32(best.f64);
+        default:
+            return bson_f64(best.f64);
+    }
+}
+
+#define column_signed_sum(sum) bson_i64((int64_t) (sum))
+
+#define column_dispatch(name, make, sum_make) \
+    if (column->length < column->rows * sizeof(value)) return bson_invalid; \
+    if (op == COLUMN_SUM) return sum_make(name##_sum(column->values, column->rows)); \
+    value = name##_extreme(column->values, column->rows, op == COLUMN_MAX); \
+    return make(value)
+
+static bson_t column_aggregate(const bson_column_t *column, const column_op op) {
+    if (column->rows == 0) return bson_invalid;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    switch (column->type) {
+        case BSON_I8: {
+            int8_t value;
+            column_dispatch(column_i8, bson_i8, column_signed_sum);
+        }
+        case BSON_I16: {
+            int16_t value;
+            column_dispatch(column_i16, bson_i16, column_signed_sum);
+        }
+        case BSON_I32: {
+            int32_t value;
+            column_dispatch(column_i32, bson_i32, column_signed_sum);
+        }
+        case BSON_I64: {
+            int64_t value;
+            column_dispatch(column_i64, bson_i64, column_signed_sum);
+        }
+        case BSON_U8: {
+            uint8_t value;
+            column_dispatch(column_u8, bson_u8, bson_u64);
+        }
+        case BSON_U16: {
+            uint16_t value;
+            column_dispatch(column_u16, bson_u16, bson_u64);
+        }
+        case BSON_U32: {
+            uint32_t value;
+            column_dispatch(column_u32, bson_u32, bson_u64);
+        }
+        case BSON_U64: {
+            uint64_t value;
+            column_dispatch(column_u64, bson_u64, bson_u64);
+        }
+        case BSON_DATE: {
+            uint64_t value;
+            if (op == COLUMN_SUM) return bson_invalid;
+            column_dispatch(column_u64, bson_date, bson_u64);
+        }
+        case BSON_F32: {
+            float value;
+            column_dispatch(column_f32, bson_f32, bson_f64);
+        }
+        case BSON_F64: {
+            double value;
+            column_dispatch(column_f64, bson_f64, bson_f64);
+        }
+        default:
+            break;
+    }
+#endif
+    if (column->type == BSON_DATE && op == COLUMN_SUM) return bson_invalid;
+    if (column->type == BSON_DATE) {
+        const bson_column_t as_u64 = {
+            .values = column->values, .rows = column->rows, .length = column->length, .type = BSON_U64
+        };
+        const bson_t result = column_generic(&as_u64, op);
+        return bson_date(result.u64);
+    }
+    return column_generic(column, op);
+}
+
+/**
+ * @param column Column to sum
+ * @return Sum of the numbers in the column as I64 (signed integers), U64 (unsigned integers) or F64 (floats),
+ * bson_invalid if the column has no numbers or holds dates
+ */
+bson_t bson_column_sum(const bson_column_t *column) {
+    return column_aggregate(column, COLUMN_SUM);
+}
+
+/**
+ * @param column Column to search
+ * @return Smallest number or date in the column, with the type it has in the column, bson_invalid if there is none
+ */
+bson_t bson_column_min(const bson_column_t *column) {
+    return column_aggregate(column, COLUMN_MIN);
+}
+
+/**
+ * @param column Column to search
+ * @return Largest number or date in the column, with the type it has in the column, bson_invalid if there is none
+ */
+bson_t bson_column_max(const bson_column_t *column) {
+    return column_aggregate(column, COLUMN_MAX);
+}
+
+/**
+ * @param column Column to count
+ * @return Number of values in the column that are not null
+ */
+uint32_t bson_column_count(const bson_column_t *column) {
+    if (!column->types) return column->type == BSON_NULL ? 0 : column->rows;
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < column->rows; i++) count += column->types[i] != BSON_NULL;
+    return count;
+}
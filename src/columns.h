@@ -0,0 +1,27 @@
+#ifndef BSON_COLUMNS_H
+#define BSON_COLUMNS_H
+
+#include "bson.h"
+
+// One field of a serialized table (see BSON_LAYOUT_COLUMNS), pointing into the serialized data
+typedef struct {
+    const uint8_t *types; // type of every value, NULL if they all have `type`
+    const uint8_t *values; // values of every row back to back
+    uint32_t rows;
+    uint32_t length; // length of the values in bytes
+    uint8_t type; // type of every value, BSON_INVALID if the column mixes types
+} bson_column_t;
+
+int bson_column(const uint8_t *buffer, size_t length, const char *key, bson_column_t *column);
+
+int bson_column_path(const uint8_t *buffer, size_t length, const char *path, const char *key, bson_column_t *column);
+
+bson_t bson_column_sum(const bson_column_t *column);
+
+bson_t bson_column_min(const bson_column_t *column);
+
+bson_t bson_column_max(const bson_column_t *column);
+
+uint32_t bson_column_count(const bson_column_t *column);
+
+#endif
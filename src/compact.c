@@ -0,0 +1,729 @@
+#include "compact.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include "utils.h"
+
+/**
+ * Allocates the nodes and the heap of an empty tree, whose root is BSON_INVALID and whose heap starts with the empty
+ * key every node without a key refers to.
+ * @param nodes Number of nodes to make room for, root included
+ * @param heap Number of heap bytes to make room for, empty key included
+ * @return 0 on success, non-zero with errno set on failure
+ */
+static int compact_init(bson_compact_t *tree, const size_t nodes, const size_t heap) {
+    *tree = empty_bson_compact;
+    if (nodes >= BSON_COMPACT_NONE || heap > UINT32_MAX) {
+        errno = EOVERFLOW;
+        return 1;
+    }
+    tree->nodes = malloc_safe(nodes * sizeof(bson_node_t), { return 1; });
+    tree->heap = malloc_safe(heap, {
+        free(tree->nodes);
+        *tree = empty_bson_compact;
+        return 1;
+    });
+    tree->capacity = nodes;
+    tree->heap_capacity = heap;
+    tree->nodes[0] = (bson_node_t){.type = BSON_INVALID};
+    tree->length = 1;
+    memset(tree->heap, 0, 4);
+    tree->heap_length = 4;
+    return 0;
+}
+
+/**
+ * Appends `count` nodes, left uninitialized, to the tree.
+ * @return Index of the first of them, BSON_COMPACT_NONE with errno set on failure
+ */
+static uint32_t nodes_push(bson_compact_t *tree, const uint32_t count) {
+    const uint32_t first = tree->length;
+    if (count >= BSON_COMPACT_NONE - first) {
+        errno = EOVERFLOW;
+        return BSON_COMPACT_NONE;
+    }
+    if (first + count > tree->capacity) {
+        uint32_t capacity = tree->capacity < BSON_COMPACT_NONE / 2 ? tree->capacity * 2 : BSON_COMPACT_NONE - 1;
+        if (capacity < first + count) capacity = first + count;
+        bson_node_t *nodes = realloc(tree->nodes, (size_t) capacity * sizeof(bson_node_t));
+        if (!nodes) return BSON_COMPACT_NONE;
+        tree->nodes = nodes;
+        tree->capacity = capacity;
+    }
+    tree->length = first + count;
+    return first;
+}
+
+/**
+ * Appends `size` uninitialized bytes to the heap of the tree.
+ * @return Offset of the first of them, BSON_COMPACT_NONE with errno set on failure
+ */
+static uint32_t heap_push(bson_compact_t *tree, const uint32_t size) {
+    const uint32_t offset = tree->heap_length;
+    if (size >= UINT32_MAX - offset) {
+        errno = EOVERFLOW;
+        return BSON_COMPACT_NONE;
+    }
+    if (offset + size > tree->heap_capacity) {
+        uint32_t capacity = tree->heap_capacity < UINT32_MAX / 2 ? tree->heap_capacity * 2 : UINT32_MAX - 1;
+        if (capacity < offset + size) capacity = offset + size;
+        uint8_t *heap = realloc(tree->heap, capacity);
+        if (!heap) return BSON_COMPACT_NONE;
+        tree->heap = heap;
+        tree->heap_capacity = capacity;
+    }
+    tree->heap_length = offset + size;
+    return offset;
+}
+
+/**
+ * @param tree Tree to initialize with a single BSON_INVALID root
+ * @return 0 on success, non-zero with errno set on failure
+ */
+int bson_compact_init(bson_compact_t *tree) {
+    return compact_init(tree, 16, 256);
+}
+
+void bson_compact_free(bson_compact_t *tree) {
+    if (!tree) return;
+    free(tree->nodes);
+    free(tree->heap);
+    *tree = empty_bson_compact;
+}
+
+/**
+ * Turns a node into an array or an object of `length` BSON_INVALID children with empty keys, to be filled with
+ * bson_compact_set and bson_compact_key. The previous children of the node are not reclaimed.
+ * @return Index of the first child, BSON_COMPACT_NONE with errno set on failure
+ */
+uint32_t bson_compact_container(bson_compact_t *tree, const uint32_t node, const uint8_t type, const uint32_t length) {
+    if ((type != BSON_ARRAY && type != BSON_OBJECT) || node >= tree->length) {
+        errno = EINVAL;
+        return BSON_COMPACT_NONE;
+    }
+    const uint32_t first = nodes_push(tree, length);
+    if (first == BSON_COMPACT_NONE) return BSON_COMPACT_NONE;
+    memset(&tree->nodes[first], 0, (size_t) length * sizeof(bson_node_t));
+
+    bson_node_t *target = &tree->nodes[node];
+    target->type = type;
+    target->offset = first;
+    target->length = length;
+    return first;
+}
+
+/**
+ * Sets the key of a member of an object.
+ * @return 0 on success, non-zero with errno set on failure
+ */
+int bson_compact_key(bson_compact_t *tree, const uint32_t node, const char *key, const uint32_t length) {
+    if (node >= tree->length || length > (1 << 24)) {
+        errno = EINVAL;
+        return 1;
+    }
+    uint32_t offset = 0;
+    if (length) {
+        offset = heap_push(tree, 4 + length);
+        if (offset == BSON_COMPACT_NONE) return 1;
+        uint8_t *buffer = tree->heap;
+        buf_write_32o(offset, length);
+        memcpy(&buffer[offset + 4], key, length);
+    }
+    tree->nodes[node].key = offset;
+    return 0;
+}
+
+/**
+ * Same as bson_compact_set, for a value at `depth`.
+ * @param depth Depth of the value, containers at BSON_MAX_DEPTH or below are rejected like bson_optimize does
+ */
+static int compact_set(bson_compact_t *tree, const uint32_t node, const uint32_t depth, // NOLINT(*-no-recursion)
+                       const bson_t *value) {
+    if (node >= tree->length) {
+        errno = EINVAL;
+        return 1;
+    }
+    if ((value->type == BSON_ARRAY || value->type == BSON_OBJECT) && depth >= BSON_MAX_DEPTH) {
+        errno = EOVERFLOW;
+        return 1;
+    }
+    uint32_t first;
+    switch (value->type) {
+        case BSON_STRING:
+        case BSON_BYTES:
+            const uint32_t length = value->string.length;
+            uint32_t offset = 0;
+            if (length) {
+                offset = heap_push(tree, length);
+                if (offset == BSON_COMPACT_NONE) return 1;
+                memcpy(&tree->heap[offset], value->string.data, length);
+            }
+            bson_node_t *target = &tree->nodes[node];
+            target->type = value->type;
+            target->offset = offset;
+            target->length = length;
+            return 0;
+        case BSON_ARRAY:
+            const array_t *array = &value->array;
+            first = bson_compact_container(tree, node, BSON_ARRAY, array->length);
+            if (first == BSON_COMPACT_NONE) return 1;
+            for (uint32_t i = 0; i < array->length; i++) {
+                if (compact_set(tree, first + i, depth + 1, &array->elements[i]) != 0) return 1;
+            }
+            return 0;
+        case BSON_OBJECT:
+            const object_t *object = &value->object;
+            first = bson_compact_container(tree, node, BSON_OBJECT, object->length);
+            if (first == BSON_COMPACT_NONE) return 1;
+            for (uint32_t i = 0; i < object->length; i++) {
+                const object_pair_t *pair = &object->elements[i];
+                if (bson_compact_key(tree, first + i, pair->key.data, pair->key.length) != 0) return 1;
+                if (compact_set(tree, first + i, depth + 1, &pair->value) != 0) return 1;
+            }
+            return 0;
+        case BSON_INVALID:
+        case BSON_TABLE:
+        case BSON_DELTA:
+        case BSON_MAX:
+            errno = EINVAL;
+            return 1;
+        default:
+            tree->nodes[node].type = value->type;
+            tree->nodes[node].u64 = value->u64;
+            return 0;
+    }
+}
+
+/**
+ * Copies a value into a node, keeping the key of the node. Arrays are stored by rows, they are serialized as deltas
+ * when bson_optimize would and by rows otherwise.
+ * @return 0 on success, non-zero with errno set on failure, EOVERFLOW if it is nested deeper than BSON_MAX_DEPTH
+ */
+int bson_compact_set(bson_compact_t *tree, const uint32_t node, const bson_t *value) {
+    return compact_set(tree, node, 0, value);
+}
+
+/**
+ * Counts the nodes and heap bytes needed to store the children of a value.
+ * @param depth Depth of the value, the children of containers at BSON_MAX_DEPTH or below are left to compact_set to
+ * reject
+ */
+static void compact_footprint(const bson_t *bson, const uint32_t depth, // NOLINT(*-no-recursion)
+                              size_t *nodes, size_t *heap) {
+    if (depth >= BSON_MAX_DEPTH) return;
+    switch (bson->type) {
+        case BSON_STRING:
+        case BSON_BYTES:
+            *heap += bson->string.length;
+            break;
+        case BSON_ARRAY:
+            *nodes += bson->array.length;
+            for (uint32_t i = 0; i < bson->array.length; i++) {
+                compact_footprint(&bson->array.elements[i], depth + 1, nodes, heap);
+            }
+            break;
+        case BSON_OBJECT:
+            *nodes += bson->object.length;
+            for (uint32_t i = 0; i < bson->object.length; i++) {
+                const object_pair_t *pair = &bson->object.elements[i];
+                if (pair->key.length) *heap += 4 + pair->key.length;
+                compact_footprint(&pair->value, depth + 1, nodes, heap);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Builds a compact copy of a tree, allocating both of its blocks once.
+ * @param tree Tree to initialize
+ * @param bson Value to copy
+ * @return 0 on success, non-zero with errno set on failure, in which case the tree is left empty, EOVERFLOW if it is
+ * nested deeper than BSON_MAX_DEPTH
+ */
+int bson_compact_from(bson_compact_t *tree, const bson_t *bson) {
+    size_t nodes = 1, heap = 4;
+    compact_footprint(bson, 0, &nodes, &heap);
+    if (compact_init(tree, nodes, heap) != 0) return 1;
+    if (bson_compact_set(tree, 0, bson) != 0) {
+        bson_compact_free(tree);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @return Key of a member of an object, borrowed from the heap of the tree until it grows
+ */
+string_t bson_compact_key_of(const bson_compact_t *tree, const uint32_t node) {
+    const uint32_t offset = tree->nodes[node].key;
+    return (string_t){.data = (char *) &tree->heap[offset + 4], .length = buf_read_u32o(tree->heap, offset)};
+}
+
+/**
+ * @return Data of a string or bytes node, borrowed from the heap of the tree until it grows
+ */
+string_t bson_compact_string_of(const bson_compact_t *tree, const uint32_t node) {
+    const bson_node_t *source = &tree->nodes[node];
+    return (string_t){.data = (char *) &tree->heap[source->offset], .length = source->length};
+}
+
+/**
+ * @return Index of the member of an object with the given key, BSON_COMPACT_NONE if there is none
+ */
+uint32_t bson_compact_get(const bson_compact_t *tree, const uint32_t node, const char *key) {
+    const bson_node_t *object = &tree->nodes[node];
+    if (object->type != BSON_OBJECT) return BSON_COMPACT_NONE;
+    const size_t length = strlen(key);
+    for (uint32_t i = 0; i < object->length; i++) {
+        const uint8_t *stored = &tree->heap[tree->nodes[object->offset + i].key];
+        if (buf_read_u32o(stored, 0) == length && memcmp(&stored[4], key, length) == 0) return object->offset + i;
+    }
+    return BSON_COMPACT_NONE;
+}
+
+/**
+ * Same as bson_compact_value, for a node at `depth`.
+ * @param depth Depth of the node, containers at BSON_MAX_DEPTH or below are rejected like bson_deserialize does
+ */
+static bson_t compact_value(const bson_compact_t *tree, const uint32_t node, // NOLINT(*-no-recursion)
+                            const uint32_t depth) {
+    const bson_node_t *source = &tree->nodes[node];
+    if ((source->type == BSON_ARRAY || source->type == BSON_OBJECT) && depth >= BSON_MAX_DEPTH) {
+        errno = EOVERFLOW;
+        return bson_invalid;
+    }
+    bson_t bson = {.type = source->type, .size = 1 << 25};
+    switch (source->type) {
+        case BSON_STRING:
+        case BSON_BYTES:
+            bson.size = 4 + source->length;
+            bson.string = empty_string_t;
+            bson.string.length = source->length;
+            if (!source->length) break;
+            bson.string.data = malloc_safe(source->length, { return bson_invalid; });
+            bson.string.alloc = 1;
+            memcpy(bson.string.data, &tree->heap[source->offset], source->length);
+            break;
+        case BSON_ARRAY:
+            bson.array = empty_array_t;
+            if (!source->length) break;
+            bson.array.elements = malloc_safe(source->length * sizeof(bson_t), { return bson_invalid; });
+            bson.array.alloc = 1;
+            for (uint32_t i = 0; i < source->length; i++) {
+                bson.array.elements[i] = compact_value(tree, source->offset + i, depth + 1);
+                if (bson.array.elements[i].type == BSON_INVALID) {
+                    bson_free(&bson);
+                    return bson_invalid;
+                }
+                bson.array.length = i + 1;
+            }
+            break;
+        case BSON_OBJECT:
+            bson.object = empty_object_t;
+            if (!source->length) break;
+            bson.object.elements = malloc_safe(source->length * sizeof(object_pair_t), { return bson_invalid; });
+            bson.object.alloc = 1;
+            for (uint32_t i = 0; i < source->length; i++) {
+                object_pair_t *pair = &bson.object.elements[i];
+                const string_t key = bson_compact_key_of(tree, source->offset + i);
+                pair->key = empty_string_t;
+                pair->key.length = key.length;
+                if (key.length) {
+                    pair->key.data = malloc_safe(key.length, {
+                        bson_free(&bson);
+                        return bson_invalid;
+                    });
+                    pair->key.alloc = 1;
+                    memcpy(pair->key.data, key.data, key.length);
+                }
+                pair->value = compact_value(tree, source->offset + i, depth + 1);
+                bson.object.length = i + 1;
+                if (pair->value.type == BSON_INVALID) {
+                    bson_free(&bson);
+                    return bson_invalid;
+                }
+            }
+            break;
+        case BSON_INVALID:
+            errno = EINVAL;
+            return bson_invalid;
+        default:
+            bson.u64 = source->u64;
+            break;
+    }
+    return bson;
+}
+
+/**
+ * Copies a node and its children into a regular tree, to be freed with bson_free.
+ * @return The copy, or bson_invalid with errno set on failure, EOVERFLOW if it is nested deeper than BSON_MAX_DEPTH
+ */
+bson_t bson_compact_value(const bson_compact_t *tree, const uint32_t node) {
+    return compact_value(tree, node, 0);
+}
+
+/**
+ * @param value Receives the value of the node on 64 bits, sign extended for the signed types
+ * @return Byte width of the integer or date node, 0 for any other type
+ */
+static uint8_t node_integer(const bson_node_t *node, uint64_t *value) {
+    switch (node->type) {
+        case BSON_I8:
+            *value = (uint64_t) (int64_t) node->i8;
+            return 1;
+        case BSON_U8:
+            *value = node->u8;
+            return 1;
+        case BSON_I16:
+            *value = (uint64_t) (int64_t) node->i16;
+            return 2;
+        case BSON_U16:
+            *value = node->u16;
+            return 2;
+        case BSON_I32:
+            *value = (uint64_t) (int64_t) node->i32;
+            return 4;
+        case BSON_U32:
+            *value = node->u32;
+            return 4;
+        case BSON_I64:
+        case BSON_U64:
+        case BSON_DATE:
+            *value = node->u64;
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Arrays are written as BSON_DELTA on the same condition as bson_optimize picks BSON_LAYOUT_DELTA, so both produce
+ * the same bytes for the same tree.
+ * @return Serialized size of an array of integers or dates of one type as deltas if that is smaller than as rows,
+ * 0 otherwise
+ */
+static size_t node_delta_size(const bson_compact_t *tree, const bson_node_t *node) {
+    if (node->type != BSON_ARRAY || node->length == 0) return 0;
+    const bson_node_t *elements = &tree->nodes[node->offset];
+    uint64_t value, previous = 0;
+    const uint8_t width = node_integer(&elements[0], &value);
+    if (width == 0) return 0;
+
+    size_t size = 8 + 1;
+    for (uint32_t i = 0; i < node->length; i++) {
+        if (elements[i].type != elements[0].type) return 0;
+        node_integer(&elements[i], &value);
+        size += varint_size(zigzag_encode(value - previous));
+        previous = value;
+    }
+    return size < 8 + (size_t) node->length * (1 + width) ? size : 0;
+}
+
+static uint8_t node_wire_type(const bson_compact_t *tree, const bson_node_t *node) {
+    return node_delta_size(tree, node) ? BSON_DELTA : node->type;
+}
+
+/**
+ * @param depth Depth of the node, containers at BSON_MAX_DEPTH or below are rejected like bson_optimize does
+ * @return Size of the serialized payload of a node, without its type byte, SIZE_MAX with errno set to EOVERFLOW if it
+ * is nested too deep
+ */
+static size_t node_size(const bson_compact_t *tree, const bson_node_t *node, // NOLINT(*-no-recursion)
+                        const uint32_t depth) {
+    if ((node->type == BSON_ARRAY || node->type == BSON_OBJECT) && depth >= BSON_MAX_DEPTH) {
+        errno = EOVERFLOW;
+        return SIZE_MAX;
+    }
+    size_t size = 8, child;
+    switch (node->type) {
+        case BSON_I8:
+        case BSON_U8:
+            return 1;
+        case BSON_I16:
+        case BSON_U16:
+            return 2;
+        case BSON_I32:
+        case BSON_U32:
+        case BSON_F32:
+            return 4;
+        case BSON_I64:
+        case BSON_U64:
+        case BSON_F64:
+        case BSON_DATE:
+            return 8;
+        case BSON_STRING:
+        case BSON_BYTES:
+            return 4 + (size_t) node->length;
+        case BSON_ARRAY:
+            const size_t delta_size = node_delta_size(tree, node);
+            if (delta_size) return delta_size;
+            for (uint32_t i = 0; i < node->length; i++) {
+                child = node_size(tree, &tree->nodes[node->offset + i], depth + 1);
+                if (child == SIZE_MAX) return SIZE_MAX;
+                size += 1 + child;
+            }
+            return size;
+        case BSON_OBJECT:
+            for (uint32_t i = 0; i < node->length; i++) {
+                const bson_node_t *member = &tree->nodes[node->offset + i];
+                child = node_size(tree, member, depth + 1);
+                if (child == SIZE_MAX) return SIZE_MAX;
+                size += 5 + (size_t) buf_read_u32o(tree->heap, member->key) + child;
+            }
+            return size;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * @return Index in the buffer after the serialized payload of the node, whose depth node_size has checked
+ */
+static size_t node_write(uint8_t *buffer, size_t index, const bson_compact_t *tree, // NOLINT(*-no-recursion)
+                         const bson_node_t *node) {
+    switch (node->type) {
+        case BSON_I8:
+        case BSON_U8:
+            buf_write_8(node->u8);
+            break;
+        case BSON_I16:
+        case BSON_U16:
+            const uint16_t u16 = node->u16;
+            buf_write_16(u16);
+            break;
+        case BSON_I32:
+        case BSON_U32:
+        case BSON_F32:
+            const uint32_t u32 = node->u32;
+            buf_write_32(u32);
+            break;
+        case BSON_I64:
+        case BSON_U64:
+        case BSON_F64:
+        case BSON_DATE:
+            const uint64_t u64 = node->u64;
+            buf_write_64(u64);
+            break;
+        case BSON_STRING:
+        case BSON_BYTES:
+            buf_write_32(node->length);
+            if (node->length) memcpy(&buffer[index], &tree->heap[node->offset], node->length);
+            index += node->length;
+            break;
+        case BSON_ARRAY:
+        case BSON_OBJECT:
+            const bson_node_t *children = &tree->nodes[node->offset];
+            buf_write_32(node->length);
+            index += 4;
+            const size_t start = index;
+            if (node_delta_size(tree, node)) {
+                buf_write_8(children[0].type);
+                uint64_t value, previous = 0;
+                for (uint32_t i = 0; i < node->length; i++) {
+                    node_integer(&children[i], &value);
+                    uint64_t zigzag = zigzag_encode(value - previous);
+                    previous = value;
+                    while (zigzag >= 0x80) {
+                        buf_write_8(zigzag | 0x80);
+                        zigzag >>= 7;
+                    }
+                    buf_write_8(zigzag);
+                }
+                buf_write_32o(start - 4, index - start);
+                break;
+            }
+            for (uint32_t i = 0; i < node->length; i++) {
+                buffer[index++] = node_wire_type(tree, &children[i]);
+            }
+            for (uint32_t i = 0; i < node->length; i++) {
+                if (node->type == BSON_OBJECT) {
+                    const uint32_t key_length = buf_read_u32o(tree->heap, children[i].key);
+                    memcpy(&buffer[index], &tree->heap[children[i].key], 4 + key_length);
+                    index += 4 + key_length;
+                }
+                index = node_write(buffer, index, tree, &children[i]);
+            }
+            const size_t size = index - start;
+            buf_write_32o(start - 4, size);
+            break;
+        default:
+            break;
+    }
+    return index;
+}
+
+/**
+ * @param buffer Receives a buffer holding the serialized tree, to be freed by the caller
+ * @param length Receives the length of the buffer
+ * @param tree Tree to serialize
+ * @return 0 on success, non-zero on failure, with errno set to EOVERFLOW if it is nested deeper than BSON_MAX_DEPTH
+ */
+int bson_compact_serialize(uint8_t **buffer, size_t *length, const bson_compact_t *tree) {
+    const bson_node_t *root = &tree->nodes[0];
+    const size_t size = node_size(tree, root, 0);
+    if (size == SIZE_MAX) return 1;
+    *length = 1 + size;
+    *buffer = malloc_safe(*length, { return 1; });
+
+    (*buffer)[0] = node_wire_type(tree, root);
+    node_write(*buffer, 1, tree, root);
+    return 0;
+}
+
+/**
+ * Reads a value of a specific type into a node, keeping the key of the node.
+ * @param depth Depth of the value, containers at BSON_MAX_DEPTH or below are rejected like bson_deserialize does
+ * @return 0 on success, non-zero with errno set on failure
+ */
+static int node_read(bson_compact_t *tree, const uint32_t node, const uint32_t depth, // NOLINT(*-no-recursion)
+                     const uint8_t *buffer, uint32_t *index_ref, const uint8_t type) {
+    // Containers recurse once per level, so the depth bounds the C stack taken by hostile input
+    if ((type == BSON_ARRAY || type == BSON_OBJECT || type == BSON_TABLE || type == BSON_DELTA) &&
+        depth >= BSON_MAX_DEPTH) {
+        errno = EOVERFLOW;
+        return 1;
+    }
+    const uint32_t index = *index_ref;
+    bson_node_t *target = &tree->nodes[node];
+    switch ((bson_type) type) {
+        case BSON_NULL:
+        case BSON_TRUE:
+        case BSON_FALSE:
+            target->type = type;
+            return 0;
+        case BSON_I8:
+        case BSON_U8:
+            target->type = type;
+            target->u8 = buffer[index];
+            *index_ref += 1;
+            return 0;
+        case BSON_I16:
+        case BSON_U16:
+            target->type = type;
+            target->u16 = buf_read_u16o(buffer, index);
+            *index_ref += 2;
+            return 0;
+        case BSON_I32:
+        case BSON_U32:
+        case BSON_F32:
+            target->type = type;
+            target->u32 = buf_read_u32o(buffer, index);
+            *index_ref += 4;
+            return 0;
+        case BSON_I64:
+        case BSON_U64:
+        case BSON_F64:
+        case BSON_DATE:
+            target->type = type;
+            target->u64 = buf_read_u64o(buffer, index);
+            *index_ref += 8;
+            return 0;
+        case BSON_STRING:
+        case BSON_BYTES:
+            const uint32_t len = buf_read_u32o(buffer, index);
+            if (len > (1 << 24)) {
+                errno = EOVERFLOW;
+                return 1;
+            }
+            uint32_t offset = 0;
+            if (len) {
+                offset = heap_push(tree, len);
+                if (offset == BSON_COMPACT_NONE) return 1;
+                memcpy(&tree->heap[offset], &buffer[index + 4], len);
+            }
+            target->type = type;
+            target->offset = offset;
+            target->length = len;
+            *index_ref += 4 + len;
+            return 0;
+        case BSON_TABLE:
+        case BSON_DELTA:
+            // Decoded with what is left of the depth limit, from the top of its own stack
+            bson_stack_t stack = bson_stack(BSON_MAX_DEPTH - depth);
+            bson_t decoded = bson_deserialize_typed_with(&stack, buffer, index_ref, type);
+            bson_stack_free(&stack);
+            if (decoded.type == BSON_INVALID) return 1;
+            // Already bounded by the stack, and rows of tables are not counted as a level of their own
+            const int status = bson_compact_set(tree, node, &decoded);
+            bson_free(&decoded);
+            return status;
+        case BSON_ARRAY:
+        case BSON_OBJECT:
+            const uint32_t len0 = buf_read_u32o(buffer, index);
+            const uint32_t len1 = buf_read_u32o(buffer, index + 4);
+            if (len0 > (1 << 24) || len1 > (1 << 24)) {
+                errno = EOVERFLOW;
+                return 1;
+            }
+            const uint32_t first = nodes_push(tree, len0);
+            if (first == BSON_COMPACT_NONE) return 1;
+            target = &tree->nodes[node];
+            target->type = type;
+            target->offset = first;
+            target->length = len0;
+
+            size_t types_index = index + 8;
+            *index_ref += 8 + len0;
+            for (uint32_t i = 0; i < len0; i++) {
+                uint32_t key = 0;
+                if (type == BSON_OBJECT) {
+                    const uint32_t key_length = buf_read_u32o(buffer, *index_ref);
+                    if (key_length > (1 << 24)) {
+                        errno = EOVERFLOW;
+                        return 1;
+                    }
+                    if (key_length) {
+                        // the wire already stores keys as they are in the heap, a u32 length and the bytes
+                        key = heap_push(tree, 4 + key_length);
+                        if (key == BSON_COMPACT_NONE) return 1;
+                        memcpy(&tree->heap[key], &buffer[*index_ref], 4 + key_length);
+                    }
+                    *index_ref += 4 + key_length;
+                }
+                tree->nodes[first + i].key = key;
+                if (node_read(tree, first + i, depth + 1, buffer, index_ref, buffer[types_index++]) != 0) return 1;
+            }
+            return 0;
+        case BSON_INVALID:
+        case BSON_MAX:
+            break;
+    }
+    errno = EINVAL;
+    return 1;
+}
+
+/**
+ * Deserializes a value into a new compact tree, whose blocks are trimmed to their final length.
+ * @param tree Tree to initialize
+ * @param buffer Pointer to a buffer that holds the serialized BSON data
+ * @param index_ref Pointer to an index in the buffer that will be updated
+ * @return 0 on success, non-zero with errno set on failure, in which case the tree is left empty, EOVERFLOW if it is
+ * nested deeper than BSON_MAX_DEPTH
+ */
+int bson_compact_deserialize(bson_compact_t *tree, const uint8_t *buffer, uint32_t *index_ref) {
+    const uint8_t type = buffer[(*index_ref)++];
+    // strings and keys cannot take more room in the heap than the whole container on the wire
+    size_t heap = 256;
+    if (type == BSON_ARRAY || type == BSON_OBJECT) heap = 4 + (size_t) buf_read_u32o(buffer, *index_ref + 4);
+    if (heap > 4 + (1 << 24)) heap = 4 + (1 << 24);
+    if (compact_init(tree, 16, heap) != 0) return 1;
+    if (node_read(tree, 0, 0, buffer, index_ref, type) != 0) {
+        bson_compact_free(tree);
+        return 1;
+    }
+
+    bson_node_t *nodes = realloc(tree->nodes, (size_t) tree->length * sizeof(bson_node_t));
+    if (nodes) {
+        tree->nodes = nodes;
+        tree->capacity = tree->length;
+    }
+    uint8_t *trimmed = realloc(tree->heap, tree->heap_length);
+    if (trimmed) {
+        tree->heap = trimmed;
+        tree->heap_capacity = tree->heap_length;
+    }
+    return 0;
+}
@@ -0,0 +1,75 @@
+#ifndef BSON_COMPACT_H
+#define BSON_COMPACT_H
+
+#include "bson.h"
+
+// Index of a node that does not exist
+#define BSON_COMPACT_NONE UINT32_MAX
+
+// 16 byte value of a compact tree, keys and string payloads live in the heap of the tree
+typedef struct {
+    uint8_t type;
+    uint32_t key; // offset in the heap of the key as a u32 length and its bytes, 0 (the empty key) outside of objects
+
+    union {
+        uint8_t u8;
+        uint16_t u16;
+        uint32_t u32;
+        uint64_t u64;
+        int8_t i8;
+        int16_t i16;
+        int32_t i32;
+        int64_t i64;
+        float f32;
+        double f64;
+
+        struct {
+            uint32_t offset; // strings and bytes: offset of the data in the heap, containers: index of the first child
+            uint32_t length; // bytes or children
+        };
+    };
+} bson_node_t;
+
+_Static_assert(sizeof(bson_node_t) == 16, "bson_node_t should stay 16 bytes");
+
+/*
+ * Tree stored in two allocations instead of one per string, array and object: the nodes, where the children of a
+ * container are contiguous and nodes[0] is the root, and a heap holding every key and string. Nodes are referred to by
+ * index since adding nodes may move them.
+ */
+typedef struct {
+    bson_node_t *nodes;
+    uint8_t *heap;
+    uint32_t length; // nodes in use
+    uint32_t capacity;
+    uint32_t heap_length;
+    uint32_t heap_capacity;
+} bson_compact_t;
+
+static const bson_compact_t empty_bson_compact = {.nodes = NULL, .heap = NULL};
+
+int bson_compact_init(bson_compact_t *tree);
+
+void bson_compact_free(bson_compact_t *tree);
+
+uint32_t bson_compact_container(bson_compact_t *tree, uint32_t node, uint8_t type, uint32_t length);
+
+int bson_compact_key(bson_compact_t *tree, uint32_t node, const char *key, uint32_t length);
+
+int bson_compact_set(bson_compact_t *tree, uint32_t node, const bson_t *value);
+
+int bson_compact_from(bson_compact_t *tree, const bson_t *bson);
+
+string_t bson_compact_key_of(const bson_compact_t *tree, uint32_t node);
+
+string_t bson_compact_string_of(const bson_compact_t *tree, uint32_t node);
+
+uint32_t bson_compact_get(const bson_compact_t *tree, uint32_t node, const char *key);
+
+bson_t bson_compact_value(const bson_compact_t *tree, uint32_t node);
+
+int bson_compact_serialize(uint8_t **buffer, size_t *length, const bson_compact_t *tree);
+
+int bson_compact_deserialize(bson_compact_t *tree, const uint8_t *buffer, uint32_t *index_ref);
+
+#endif
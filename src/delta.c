@@ -0,0 +1,771 @@
+#include "delta.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include "utils.h"
+
+typedef struct {
+    bson_t *ops;
+    uint32_t length;
+    uint32_t capacity;
+    bson_t *path; // segments leading to the values being compared, keys are borrowed from `after`
+    uint32_t depth;
+    uint32_t path_capacity;
+} delta_builder_t;
+
+typedef struct {
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+} delta_buffer_t;
+
+typedef struct {
+    uint32_t count; // number of elements of the parent
+    size_t types; // index of the parent's type table
+    uint32_t slot; // position of the child in the type table, `count` if it was not found
+    size_t entry; // start of the child's bytes (its key for object members), end of the parent if not found
+    size_t value; // start of the child's value
+    size_t end; // end of the child's bytes
+} raw_slot_t;
+
+static int copy_string(string_t *dst, const string_t *src) {
+    *dst = empty_string_t;
+    if (src->length == 0) return 0;
+    dst->data = malloc_safe(src->length, { return 1; });
+    memcpy(dst->data, src->data, src->length);
+    dst->length = src->length;
+    dst->alloc = 1;
+    return 0;
+}
+
+/**
+ * Deep copies a BSON value into heap memory owned by the copy.
+ * @return 0 on success, non-zero on allocation failure in which case `dst` is left invalid
+ */
+static int copy_value(bson_t *dst, const bson_t *src) { // NOLINT(*-no-recursion)
+    *dst = *src;
+    switch (src->type) {
+        case BSON_STRING:
+        case BSON_BYTES:
+            if (copy_string(&dst->string, &src->string) != 0) break;
+            return 0;
+        case BSON_ARRAY:
+            dst->array = empty_array_t;
+            dst->array.layout = src->array.layout;
+            if (src->array.length == 0) return 0;
+            bson_t *elements = malloc_safe(src->array.length * sizeof(bson_t), { break; });
+            for (uint32_t i = 0; i < src->array.length; i++) {
+                if (copy_value(&elements[i], &src->array.elements[i]) == 0) continue;
+                while (i != 0) bson_free(&elements[--i]);
+                free(elements);
+                *dst = bson_invalid;
+                return 1;
+            }
+            dst->array = array_heap(elements, src->array.length);
+            dst->array.layout = src->array.layout;
+            return 0;
+        case BSON_OBJECT:
+            dst->object = empty_object_t;
+            if (src->object.length == 0) return 0;
+            object_pair_t *pairs = malloc_safe(src->object.length * sizeof(object_pair_t), { break; });
+            for (uint32_t i = 0; i < src->object.length; i++) {
+                if (copy_string(&pairs[i].key, &src->object.elements[i].key) == 0) {
+                    if (copy_value(&pairs[i].value, &src->object.elements[i].value) == 0) continue;
+                    if (pairs[i].key.alloc) free(pairs[i].key.data);
+                }
+                dst->object = object_heap(pairs, i);
+                bson_free(dst);
+                *dst = bson_invalid;
+                return 1;
+            }
+            dst->object = object_heap(pairs, src->object.length);
+            return 0;
+        default:
+            return 0;
+    }
+    *dst = bson_invalid;
+    return 1;
+}
+
+static int key_compare(const string_t *a, const string_t *b) {
+    const uint32_t common = a->length < b->length ? a->length : b->length;
+    const int c = common ? memcmp(a->data, b->data, common) : 0;
+    if (c != 0) return c;
+    return a->length < b->length ? -1 : a->length > b->length;
+}
+
+static int pair_compare(const void *a, const void *b) {
+    const object_pair_t *x = *(const object_pair_t *const *) a;
+    const object_pair_t *y = *(const object_pair_t *const *) b;
+    const int c = key_compare(&x->key, &y->key);
+    if (c != 0) return c;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Exact comparison, unlike bson_equal the types and the order of object members have to match too.
+ * @return 1 if both values serialize to the same bytes, 0 otherwise
+ */
+static int same_value(const bson_t *a, const bson_t *b) { // NOLINT(*-no-recursion)
+    if (a->type != b->type) return 0;
+    switch (a->type) {
+        case BSON_I8:
+        case BSON_U8:
+            return a->u8 == b->u8;
+        case BSON_I16:
+        case BSON_U16:
+            return a->u16 == b->u16;
+        case BSON_I32:
+        case BSON_U32:
+        case BSON_F32:
+            return a->u32 == b->u32;
+        case BSON_I64:
+        case BSON_U64:
+        case BSON_F64:
+        case BSON_DATE:
+            return a->u64 == b->u64;
+        case BSON_STRING:
+        case BSON_BYTES:
+            return a->string.length == b->string.length &&
+                   (a->string.length == 0 || memcmp(a->string.data, b->string.data, a->string.length) == 0);
+        case BSON_ARRAY:
+            if (a->array.length != b->array.length) return 0;
+            for (uint32_t i = 0; i < a->array.length; i++) {
+                if (!same_value(&a->array.elements[i], &b->array.elements[i])) return 0;
+            }
+            return 1;
+        case BSON_OBJECT:
+            if (a->object.length != b->object.length) return 0;
+            for (uint32_t i = 0; i < a->object.length; i++) {
+                if (key_compare(&a->object.elements[i].key, &b->object.elements[i].key) != 0 ||
+                    !same_value(&a->object.elements[i].value, &b->object.elements[i].value)) {
+                    return 0;
+                }
+            }
+            return 1;
+        default:
+            return 1;
+    }
+}
+
+static int path_push(delta_builder_t *builder, const bson_t segment) {
+    if (builder->depth == builder->path_capacity) {
+        const uint32_t capacity = builder->path_capacity ? builder->path_capacity * 2 : 16;
+        bson_t *path = realloc(builder->path, capacity * sizeof(bson_t));
+        if (!path) return 1;
+        builder->path = path;
+        builder->path_capacity = capacity;
+    }
+    builder->path[builder->depth++] = segment;
+    return 0;
+}
+
+/**
+ * Appends an operation on the current path to the delta.
+ * @param value Value of the operation, NULL for BSON_DELTA_REMOVE
+ * @return 0 on success, non-zero on allocation failure
+ */
+static int delta_emit(delta_builder_t *builder, const bson_delta_op code, const bson_t *value) {
+    if (builder->length == builder->capacity) {
+        const uint32_t capacity = builder->capacity ? builder->capacity * 2 : 8;
+        bson_t *ops = realloc(builder->ops, capacity * sizeof(bson_t));
+        if (!ops) return 1;
+        builder->ops = ops;
+        builder->capacity = capacity;
+    }
+
+    const bson_t path = {
+        .type = BSON_ARRAY, .size = 1 << 25, .array = {.elements = builder->path, .length = builder->depth}
+    };
+    bson_t *op = malloc_safe(3 * sizeof(bson_t), { return 1; });
+    op[0] = bson_u8(code);
+    if (copy_value(&op[1], &path) != 0) {
+        free(op);
+        return 1;
+    }
+    if (value && copy_value(&op[2], value) != 0) {
+        bson_free(&op[1]);
+        free(op);
+        return 1;
+    }
+    builder->ops[builder->length++] = bson_array_heap(op, value ? 3 : 2);
+    return 0;
+}
+
+static int diff_value(delta_builder_t *builder, const bson_t *before, const bson_t *after);
+
+static int diff_object(delta_builder_t *builder, const object_t *before, const object_t *after) { // NOLINT(*-no-recursion)
+    int status = 1;
+    uint8_t *seen = calloc(before->length + 1, 1);
+    const object_pair_t **sorted = NULL; // built on the first member that moved
+    if (!seen) return 1;
+
+    for (uint32_t i = 0; i < after->length; i++) {
+        const object_pair_t *pair = &after->elements[i];
+        int64_t match = -1;
+        if (i < before->length && !seen[i] && key_compare(&before->elements[i].key, &pair->key) == 0) {
+            match = i;
+        } else if (before->length) {
+            if (!sorted) {
+                sorted = malloc_safe(before->length * sizeof(object_pair_t *), { goto end; });
+                for (uint32_t j = 0; j < before->length; j++) sorted[j] = &before->elements[j];
+                qsort(sorted, before->length, sizeof(object_pair_t *), pair_compare);
+            }
+            uint32_t low = 0, high = before->length;
+            while (low < high) {
+                const uint32_t mid = low + (high - low) / 2;
+                if (key_compare(&sorted[mid]->key, &pair->key) < 0) low = mid + 1;
+                else high = mid;
+            }
+            for (; low < before->length && key_compare(&sorted[low]->key, &pair->key) == 0; low++) {
+                const uint32_t j = sorted[low] - before->elements;
+                if (seen[j]) continue;
+                match = j;
+                break;
+            }
+        }
+
+        if (path_push(builder, (bson_t){.type = BSON_STRING, .size = 4 + pair->key.length, .string = pair->key}) != 0) {
+            goto end;
+        }
+        if (match < 0) {
+            if (delta_emit(builder, BSON_DELTA_SET, &pair->value) != 0) goto end;
+        } else {
+            seen[match] = 1;
+            if (diff_value(builder, &before->elements[match].value, &pair->value) != 0) goto end;
+        }
+        builder->depth--;
+    }
+
+    for (uint32_t j = 0; j < before->length; j++) {
+        if (seen[j]) continue;
+        const string_t key = before->elements[j].key;
+        if (path_push(builder, (bson_t){.type = BSON_STRING, .size = 4 + key.length, .string = key}) != 0) goto end;
+        if (delta_emit(builder, BSON_DELTA_REMOVE, NULL) != 0) goto end;
+        builder->depth--;
+    }
+    status = 0;
+
+end:
+    free(seen);
+    free(sorted);
+    return status;
+}
+
+static int diff_array(delta_builder_t *builder, const array_t *before, const array_t *after) { // NOLINT(*-no-recursion)
+    const uint32_t shortest = before->length < after->length ? before->length : after->length;
+    uint32_t prefix = 0, suffix = 0;
+    while (prefix < shortest && same_value(&before->elements[prefix], &after->elements[prefix])) prefix++;
+    while (suffix < shortest - prefix &&
+           same_value(&before->elements[before->length - 1 - suffix], &after->elements[after->length - 1 - suffix])) {
+        suffix++;
+    }
+
+    // Elements in the changed middle are diffed pairwise, the extra ones are inserted or removed
+    const uint32_t before_middle = before->length - prefix - suffix;
+    const uint32_t after_middle = after->length - prefix - suffix;
+    const uint32_t common = before_middle < after_middle ? before_middle : after_middle;
+
+    for (uint32_t i = prefix; i < prefix + common; i++) {
+        if (path_push(builder, bson_u32(i)) != 0) return 1;
+        if (diff_value(builder, &before->elements[i], &after->elements[i]) != 0) return 1;
+        builder->depth--;
+    }
+    for (uint32_t i = prefix + common; i < prefix + after_middle; i++) {
+        if (path_push(builder, bson_u32(i)) != 0) return 1;
+        if (delta_emit(builder, BSON_DELTA_INSERT, &after->elements[i]) != 0) return 1;
+        builder->depth--;
+    }
+    for (uint32_t i = prefix + before_middle; i > prefix + common; i--) {
+        if (path_push(builder, bson_u32(i - 1)) != 0) return 1;
+        if (delta_emit(builder, BSON_DELTA_REMOVE, NULL) != 0) return 1;
+        builder->depth--;
+    }
+    return 0;
+}
+
+static int diff_value(delta_builder_t *builder, const bson_t *before, const bson_t *after) { // NOLINT(*-no-recursion)
+    if (before->type == BSON_OBJECT && after->type == BSON_OBJECT) {
+        return diff_object(builder, &before->object, &after->object);
+    }
+    if (before->type == BSON_ARRAY && after->type == BSON_ARRAY) {
+        return diff_array(builder, &before->array, &after->array);
+    }
+    if (same_value(before, after)) return 0;
+    return delta_emit(builder, BSON_DELTA_SET, after);
+}
+
+/**
+ * Computes the operations that turn one BSON value into another. The delta is a regular BSON array (see
+ * delta.h), so it can be serialized and sent like any other value. Its size depends on what changed
+ * rather than on the size of the values: unchanged members and array elements produce nothing and
+ * elements inserted or removed in the middle of an array do not shift the rest.
+ * @param before Original value
+ * @param after Updated value
+ * @return Heap allocated delta, or bson_invalid on allocation failure
+ */
+bson_t bson_diff(const bson_t *before, const bson_t *after) {
+    delta_builder_t builder = {0};
+    const int status = diff_value(&builder, before, after);
+    free(builder.path);
+
+    bson_t delta = bson_array_heap(builder.ops, builder.length);
+    if (status != 0) {
+        bson_free(&delta);
+        return bson_invalid;
+    }
+    return delta;
+}
+
+/**
+ * Splits a delta operation into its parts.
+ * @return 0 on success, non-zero if the operation is malformed
+ */
+static int op_parts(const bson_t *op, bson_delta_op *code, const array_t **path, const bson_t **value) {
+    if (op->type != BSON_ARRAY || op->array.length < 2) return 1;
+    const bson_t *parts = op->array.elements;
+    if (parts[0].type != BSON_U8 || parts[1].type != BSON_ARRAY) return 1;
+    *code = parts[0].u8;
+    *path = &parts[1].array;
+    *value = NULL;
+    if (*code == BSON_DELTA_REMOVE) return 0;
+    if ((*code != BSON_DELTA_SET && *code != BSON_DELTA_INSERT) || op->array.length < 3) return 1;
+    *value = &parts[2];
+    return 0;
+}
+
+static int segment_index(const bson_t *segment, uint32_t *index) {
+    switch (segment->type) {
+        case BSON_U8:
+            *index = segment->u8;
+            return 0;
+        case BSON_U16:
+            *index = segment->u16;
+            return 0;
+        case BSON_U32:
+            *index = segment->u32;
+            return 0;
+        case BSON_I32:
+            if (segment->i32 < 0) return 1;
+            *index = segment->i32;
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+static int64_t object_find(const object_t *object, const bson_t *segment) {
+    if (segment->type != BSON_STRING) return -1;
+    for (uint32_t i = 0; i < object->length; i++) {
+        if (key_compare(&object->elements[i].key, &segment->string) == 0) return i;
+    }
+    return -1;
+}
+
+/**
+ * Makes sure an array owns heap storage for at least `length` elements, with room to spare for the next ones.
+ * @return 0 on success, non-zero on allocation failure
+ */
+static int array_grow(array_t *array, const uint32_t length) {
+    if (array->alloc && capacity_of(*array) >= length) return 0;
+    const uint32_t capacity = length + length / 2;
+    bson_t *elements;
+    if (array->alloc) {
+        elements = realloc(array->elements, capacity * sizeof(bson_t));
+        if (!elements) return 1;
+    } else {
+        elements = malloc_safe(capacity * sizeof(bson_t), { return 1; });
+        if (array->length) memcpy(elements, array->elements, array->length * sizeof(bson_t));
+        array->alloc = 1;
+    }
+    array->elements = elements;
+    array->capacity = capacity;
+    return 0;
+}
+
+static int object_grow(object_t *object, const uint32_t length) {
+    if (object->alloc && capacity_of(*object) >= length) return 0;
+    const uint32_t capacity = length + length / 2;
+    object_pair_t *elements;
+    if (object->alloc) {
+        elements = realloc(object->elements, capacity * sizeof(object_pair_t));
+        if (!elements) return 1;
+    } else {
+        elements = malloc_safe(capacity * sizeof(object_pair_t), { return 1; });
+        if (object->length) memcpy(elements, object->elements, object->length * sizeof(object_pair_t));
+        object->alloc = 1;
+    }
+    object->elements = elements;
+    object->capacity = capacity;
+    return 0;
+}
+
+static int apply_op(bson_t *bson, const bson_t *op) {
+    bson_delta_op code;
+    const array_t *path;
+    const bson_t *value;
+    if (op_parts(op, &code, &path, &value) != 0) return EINVAL;
+
+    bson_t copy;
+    if (path->length == 0) {
+        if (code != BSON_DELTA_SET) return EINVAL;
+        if (copy_value(&copy, value) != 0) return ENOMEM;
+        bson_free(bson);
+        *bson = copy;
+        return 0;
+    }
+
+    // Cached sizes along the path no longer hold, bson_optimize recomputes them
+    bson_t *parent = bson;
+    for (uint32_t i = 0; i + 1 < path->length; i++) {
+        const bson_t *segment = &path->elements[i];
+        uint32_t index;
+        if (parent->type == BSON_OBJECT) {
+            const int64_t found = object_find(&parent->object, segment);
+            if (found < 0) return EINVAL;
+            parent->size = 1 << 25;
+            parent = &parent->object.elements[found].value;
+        } else if (parent->type == BSON_ARRAY) {
+            if (segment_index(segment, &index) != 0 || index >= parent->array.length) return EINVAL;
+            parent->size = 1 << 25;
+            parent = &parent->array.elements[index];
+        } else {
+            return EINVAL;
+        }
+    }
+
+    const bson_t *segment = &path->elements[path->length - 1];
+    if (parent->type == BSON_OBJECT) {
+        object_t *object = &parent->object;
+        const int64_t found = object_find(object, segment);
+        if (code == BSON_DELTA_INSERT || (code == BSON_DELTA_REMOVE && found < 0)) return EINVAL;
+        if (segment->type != BSON_STRING) return EINVAL;
+        parent->size = 1 << 25;
+
+        if (code == BSON_DELTA_REMOVE) {
+            object_pair_t *pair = &object->elements[found];
+            if (pair->key.alloc) free(pair->key.data);
+            bson_free(&pair->value);
+            memmove(pair, pair + 1, (object->length - found - 1) * sizeof(object_pair_t));
+            object->length--;
+            return 0;
+        }
+        if (copy_value(&copy, value) != 0) return ENOMEM;
+        if (found >= 0) {
+            bson_free(&object->elements[found].value);
+            object->elements[found].value = copy;
+            return 0;
+        }
+        object_pair_t pair = {.value = copy};
+        if (copy_string(&pair.key, &segment->string) != 0 || object_grow(object, object->length + 1) != 0) {
+            if (pair.key.alloc) free(pair.key.data);
+            bson_free(&copy);
+            return ENOMEM;
+        }
+        object->elements[object->length++] = pair;
+        return 0;
+    }
+
+    if (parent->type != BSON_ARRAY) return EINVAL;
+    array_t *array = &parent->array;
+    uint32_t index;
+    if (segment_index(segment, &index) != 0) return EINVAL;
+    if (index > array->length || (index == array->length && code != BSON_DELTA_INSERT)) return EINVAL;
+    parent->size = 1 << 25;
+
+    if (code == BSON_DELTA_REMOVE) {
+        bson_free(&array->elements[index]);
+        memmove(&array->elements[index], &array->elements[index + 1], (array->length - index - 1) * sizeof(bson_t));
+        array->length--;
+        return 0;
+    }
+    if (copy_value(&copy, value) != 0) return ENOMEM;
+    if (code == BSON_DELTA_SET) {
+        bson_free(&array->elements[index]);
+        array->elements[index] = copy;
+        return 0;
+    }
+    if (array_grow(array, array->length + 1) != 0) {
+        bson_free(&copy);
+        return ENOMEM;
+    }
+    memmove(&array->elements[index + 1], &array->elements[index], (array->length - index) * sizeof(bson_t));
+    array->elements[index] = copy;
+    array->length++;
+    return 0;
+}
+
+/**
+ * Applies a delta produced by bson_diff to a BSON value in place. Values from the delta are copied, so the
+ * delta can be freed afterward. Arrays and objects that need to grow are moved to the heap if they were not
+ * heap allocated already.
+ * @param bson BSON value to update
+ * @param delta Delta to apply
+ * @return 0 on success, non-zero with errno set on failure, in which case the operations before the failing
+ * one stay applied
+ */
+int bson_apply_delta(bson_t *bson, const bson_t *delta) {
+    if (delta->type != BSON_ARRAY) {
+        errno = EINVAL;
+        return 1;
+    }
+    for (uint32_t i = 0; i < delta->array.length; i++) {
+        const int status = apply_op(bson, &delta->array.elements[i]);
+        if (status != 0) {
+            errno = status;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int buffer_reserve(delta_buffer_t *buffer, const size_t length) {
+    if (length <= buffer->capacity) return 0;
+    size_t capacity = buffer->capacity + buffer->capacity / 2;
+    if (capacity < length) capacity = length;
+    uint8_t *data = realloc(buffer->data, capacity);
+    if (!data) return 1;
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+/**
+ * Replaces `remove` bytes at `index` with a gap of `insert` bytes. The capacity has to be reserved beforehand.
+ */
+static void buffer_splice(delta_buffer_t *buffer, const size_t index, const size_t remove, const size_t insert) {
+    memmove(&buffer->data[index + insert], &buffer->data[index + remove], buffer->length - index - remove);
+    buffer->length = buffer->length - remove + insert;
+}
+
+/**
+ * Locates a child of a serialized array or object.
+ * @return 0 on success, non-zero if the parent is malformed or the segment cannot address it
+ */
+static int raw_locate(const uint8_t *buffer, const size_t length, const size_t index, const uint8_t type,
+                      const bson_t *segment, raw_slot_t *slot) {
+    if ((type != BSON_ARRAY && type != BSON_OBJECT) || length - index < 8) return 1;
+    const uint32_t count = buf_read_u32o(buffer, index);
+    const uint32_t size = buf_read_u32o(buffer, index + 4);
+    if (size > length - index - 8 || count > size) return 1;
+    const size_t end = index + 8 + size;
+
+    slot->count = count;
+    slot->types = index + 8;
+    size_t cursor = slot->types + count;
+
+    if (type == BSON_ARRAY) {
+        uint32_t target;
+        if (segment_index(segment, &target) != 0 || target > count) return 1;
+        for (uint32_t i = 0; i < target; i++) {
+            if (bson_skip(buffer, end, cursor, buffer[slot->types + i], &cursor) != 0) return 1;
+        }
+        slot->slot = target;
+        slot->entry = slot->value = slot->end = cursor;
+        if (target < count && bson_skip(buffer, end, cursor, buffer[slot->types + target], &slot->end) != 0) return 1;
+        return 0;
+    }
+
+    if (segment->type != BSON_STRING) return 1;
+    for (uint32_t i = 0; i < count; i++) {
+        if (end - cursor < 4) return 1;
+        const uint32_t key_length = buf_read_u32o(buffer, cursor);
+        if (key_length > end - cursor - 4) return 1;
+        const size_t value = cursor + 4 + key_length;
+        size_t next;
+        if (bson_skip(buffer, end, value, buffer[slot->types + i], &next) != 0) return 1;
+        if (key_length == segment->string.length &&
+            (key_length == 0 || memcmp(&buffer[cursor + 4], segment->string.data, key_length) == 0)) {
+            slot->slot = i;
+            slot->entry = cursor;
+            slot->value = value;
+            slot->end = next;
+            return 0;
+        }
+        cursor = next;
+    }
+    slot->slot = count;
+    slot->entry = slot->value = slot->end = cursor;
+    return 0;
+}
+
+static void header_write_u32(uint8_t *buffer, const size_t index, const uint32_t value) {
+    buf_write_32o(index, value);
+}
+
+static void header_add(uint8_t *buffer, const size_t index, const int count, const int64_t size) {
+    header_write_u32(buffer, index, buf_read_u32o(buffer, index) + count);
+    header_write_u32(buffer, index + 4, buf_read_u32o(buffer, index + 4) + size);
+}
+
+/**
+ * Delta arrays have no bytes per element to patch, so the one the operation addresses is decoded, patched like a tree
+ * and written back with the layout bson_optimize picks for it, which keeps the buffer identical to serializing the
+ * patched tree.
+ * @param headers Headers of the containers holding the array
+ * @param depth Number of containers holding the array
+ * @param type_index Index of the type byte of the array
+ * @param index Index of the array just after its type byte
+ */
+static int apply_buffer_delta_array(delta_buffer_t *buffer, const bson_t *op, const size_t *headers,
+                                    const uint32_t depth, const size_t type_index, const size_t index) {
+    // Its size has to fit in the buffer, the elements are then decoded without reading past it
+    size_t end;
+    if (bson_skip(buffer->data, buffer->length, index, BSON_DELTA, &end) != 0) return EINVAL;
+    if (end > UINT32_MAX) return EOVERFLOW;
+    uint32_t decoded = index;
+    bson_t array = bson_deserialize_typed(buffer->data, &decoded, BSON_DELTA);
+    if (array.type == BSON_INVALID) return errno;
+
+    // The same operation with its path reduced to the index in the array
+    const array_t *path = &op->array.elements[1].array;
+    bson_t parts[3];
+    const uint32_t length = op->array.length < 3 ? op->array.length : 3;
+    memcpy(parts, op->array.elements, length * sizeof(bson_t));
+    parts[1] = (bson_t){
+        .type = BSON_ARRAY, .size = 1 << 25, .array = {.elements = &path->elements[path->length - 1], .length = 1}
+    };
+    const bson_t local = {.type = BSON_ARRAY, .size = 1 << 25, .array = {.elements = parts, .length = length}};
+    int status = apply_op(&array, &local);
+    if (status == 0) {
+        const size_t size = bson_optimize(&array);
+        const int64_t grow = (int64_t) size - (int64_t) (end - index);
+        if (size == SIZE_MAX) {
+            status = EOVERFLOW;
+        } else if (grow > 0 && buffer_reserve(buffer, buffer->length + grow) != 0) {
+            status = ENOMEM;
+        } else {
+            buffer_splice(buffer, index, end - index, size);
+            bson_write_iter_typed(buffer->data, index, &array);
+            buffer->data[type_index] = bson_wire_type(&array);
+            for (uint32_t i = 0; i < depth; i++) header_add(buffer->data, headers[i], 0, grow);
+        }
+    }
+    bson_free(&array);
+    return status;
+}
+
+static int apply_buffer_op(delta_buffer_t *buffer, bson_t *op) {
+    bson_delta_op code;
+    const array_t *path;
+    const bson_t *value;
+    if (op_parts(op, &code, &path, &value) != 0 || buffer->length == 0) return EINVAL;
+    bson_t *new_value = (bson_t *) value;
+    const size_t value_size = new_value ? bson_optimize(new_value) : 0;
+    if (value_size == SIZE_MAX) return EOVERFLOW;
+
+    if (path->length == 0) {
+        if (code != BSON_DELTA_SET) return EINVAL;
+        if (buffer_reserve(buffer, 1 + value_size) != 0) return ENOMEM;
+        buffer->length = 1 + value_size;
+        bson_write_iter(buffer->data, 0, new_value);
+        return 0;
+    }
+
+    // Headers of every container on the path, they all come before the modified bytes so splicing keeps them
+    size_t *headers = malloc_safe(path->length * sizeof(size_t), { return ENOMEM; });
+    raw_slot_t slot;
+    size_t index = 1, type_index = 0;
+    uint8_t type = buffer->data[0];
+    for (uint32_t i = 0;; i++) {
+        if (type == BSON_DELTA && i + 1 == path->length) {
+            const int status = apply_buffer_delta_array(buffer, op, headers, i, type_index, index);
+            free(headers);
+            return status;
+        }
+        if (raw_locate(buffer->data, buffer->length, index, type, &path->elements[i], &slot) != 0) {
+            free(headers);
+            return EINVAL;
+        }
+        headers[i] = index;
+        if (i + 1 == path->length) break;
+        if (slot.slot == slot.count) {
+            free(headers);
+            return EINVAL;
+        }
+        type_index = slot.types + slot.slot;
+        type = buffer->data[type_index];
+        index = slot.value;
+    }
+
+    const int found = slot.slot < slot.count;
+    const string_t *key = &path->elements[path->length - 1].string;
+    int64_t grow;
+    int count = 0;
+    if (type == BSON_OBJECT && code == BSON_DELTA_SET && !found) {
+        grow = 1 + 4 + key->length + value_size;
+        count = 1;
+    } else if (type == BSON_ARRAY && code == BSON_DELTA_INSERT) {
+        grow = 1 + value_size;
+        count = 1;
+    } else if (found && code == BSON_DELTA_SET) {
+        grow = (int64_t) value_size - (int64_t) (slot.end - slot.value);
+    } else if (found && code == BSON_DELTA_REMOVE) {
+        grow = -(int64_t) (1 + slot.end - slot.entry);
+        count = -1;
+    } else {
+        free(headers);
+        return EINVAL;
+    }
+    if (grow > 0 && buffer_reserve(buffer, buffer->length + grow) != 0) {
+        free(headers);
+        return ENOMEM;
+    }
+
+    uint8_t *data = buffer->data;
+    if (count == 0) {
+        buffer_splice(buffer, slot.value, slot.end - slot.value, value_size);
+        bson_write_iter_typed(buffer->data, slot.value, new_value);
+        buffer->data[slot.types + slot.slot] = bson_wire_type(new_value);
+    } else if (count < 0) {
+        buffer_splice(buffer, slot.entry, slot.end - slot.entry, 0);
+        buffer_splice(buffer, slot.types + slot.slot, 1, 0);
+    } else {
+        // The value goes in first since it comes after the type table
+        size_t at = slot.entry;
+        buffer_splice(buffer, at, 0, grow - 1);
+        if (type == BSON_OBJECT) {
+            header_write_u32(data, at, key->length);
+            if (key->length) memcpy(&data[at + 4], key->data, key->length);
+            at += 4 + key->length;
+        }
+        bson_write_iter_typed(data, at, new_value);
+        buffer_splice(buffer, slot.types + slot.slot, 0, 1);
+        data[slot.types + slot.slot] = bson_wire_type(new_value);
+    }
+
+    for (uint32_t i = 0; i < path->length; i++) {
+        header_add(data, headers[i], i + 1 == path->length ? count : 0, grow);
+    }
+    free(headers);
+    return 0;
+}
+
+/**
+ * Applies a delta produced by bson_diff directly to serialized BSON data, without deserializing it. Only the
+ * containers on each operation's path are walked, the rest of the buffer is moved with memmove.
+ * @param buffer Pointer to a heap allocated buffer holding the serialized data, it may be reallocated
+ * @param length Pointer to the length of the data, updated with the new length
+ * @param delta Delta to apply, sizes of its values are cached like in bson_optimize
+ * @return 0 on success, non-zero with errno set on failure, in which case the operations before the failing
+ * one stay applied
+ */
+int bson_apply_delta_buffer(uint8_t **buffer, size_t *length, bson_t *delta) {
+    if (delta->type != BSON_ARRAY) {
+        errno = EINVAL;
+        return 1;
+    }
+    delta_buffer_t data = {.data = *buffer, .length = *length, .capacity = *length};
+    int status = 0;
+    for (uint32_t i = 0; i < delta->array.length && status == 0; i++) {
+        status = apply_buffer_op(&data, &delta->array.elements[i]);
+    }
+    *buffer = data.data;
+    *length = data.length;
+    if (status != 0) {
+        errno = status;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef BSON_DELTA_H
+#define BSON_DELTA_H
+
+#include "bson.h"
+
+/*
+ * A delta is a BSON array of operations applied in order. Every operation is itself an array of
+ * [u8 code, path, value], where path is an array of string keys and u32 indices leading from the root
+ * to the modified value and value is left out for BSON_DELTA_REMOVE.
+ */
+typedef enum {
+    BSON_DELTA_SET = 1, // replace the value at path, or add the key if the parent object does not have it
+    BSON_DELTA_REMOVE, // remove the object member or array element at path
+    BSON_DELTA_INSERT // insert a value into an array before the index at path, the index can be its length
+} bson_delta_op;
+
+bson_t bson_diff(const bson_t *before, const bson_t *after);
+
+int bson_apply_delta(bson_t *bson, const bson_t *delta);
+
+int bson_apply_delta_buffer(uint8_t **buffer, size_t *length, bson_t *delta);
+
+#endif
@@ -0,0 +1,741 @@
+#include "scan.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "view.h"
+
+typedef enum {
+    FILTER_TEST,
+    FILTER_AND,
+    FILTER_OR,
+    FILTER_NOT
+} filter_kind;
+
+typedef enum {
+    FILTER_EXISTS,
+    FILTER_EQ,
+    FILTER_NE,
+    FILTER_LT,
+    FILTER_LE,
+    FILTER_GT,
+    FILTER_GE
+} filter_op;
+
+typedef enum {
+    LITERAL_NONE,
+    LITERAL_INT, // negative integer
+    LITERAL_UINT, // non-negative integer
+    LITERAL_FLOAT,
+    LITERAL_STRING,
+    LITERAL_TRUE,
+    LITERAL_FALSE,
+    LITERAL_NULL
+} literal_kind;
+
+typedef struct {
+    const char *key;
+    uint32_t length;
+    int64_t index; // array index, -1 when the segment is not a number
+} path_segment_t;
+
+typedef struct {
+    filter_kind kind;
+    filter_op op;
+    literal_kind literal;
+    uint32_t left, right; // child nodes of AND / OR / NOT
+    uint32_t path_start, path_length; // range in bson_filter_t.segments
+    uint32_t string_length;
+    const char *string; // points into bson_filter_t.text
+
+    union {
+        int64_t i64;
+        uint64_t u64;
+        double f64;
+    } number;
+} filter_node_t;
+
+struct bson_filter_t {
+    char *text; // private copy of the expression, string literals are unescaped in place
+    filter_node_t *nodes;
+    uint32_t node_count;
+    uint32_t node_capacity;
+    path_segment_t *segments;
+    uint32_t segment_count;
+    uint32_t segment_capacity;
+    uint32_t root;
+};
+
+typedef struct {
+    bson_filter_t *filter;
+    char *cursor;
+} filter_parser_t;
+
+/**
+ * Looks up one path segment inside a serialized array or object without decoding it.
+ * @return 0 if the child was found, non-zero otherwise
+ */
+static int raw_child(const uint8_t *buffer, const size_t end, const size_t pos, const uint8_t type,
+                     const path_segment_t *segment, size_t *child_pos, uint8_t *child_type) {
+    if (type != BSON_ARRAY && type != BSON_OBJECT) return 1;
+    if (end - pos < 8) return 1;
+    const uint32_t count = buf_read_u32o(buffer, pos);
+    const size_t types = pos + 8;
+    if (count > end - types) return 1;
+    size_t cursor = types + count;
+
+    if (type == BSON_ARRAY) {
+        if (segment->index < 0 || segment->index >= count) return 1;
+        for (int64_t i = 0; i < segment->index; i++) {
+            if (bson_skip(buffer, end, cursor, buffer[types + i], &cursor) != 0) return 1;
+        }
+        *child_pos = cursor;
+        *child_type = buffer[types + segment->index];
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (end - cursor < 4) return 1;
+        const uint32_t key_length = buf_read_u32o(buffer, cursor);
+        if (key_length > end - cursor - 4) return 1;
+        const size_t value = cursor + 4 + key_length;
+        if (key_length == segment->length && memcmp(&buffer[cursor + 4], segment->key, key_length) == 0) {
+            *child_pos = value;
+            *child_type = buffer[types + i];
+            return 0;
+        }
+        if (bson_skip(buffer, end, value, buffer[types + i], &cursor) != 0) return 1;
+    }
+    return 1;
+}
+
+/**
+ * Looks up one element of a serialized delta array. Elements have no bytes of their own, so the element is rebuilt
+ * into `element` as a little-endian value of its type.
+ * @return 0 if the element was found, non-zero otherwise
+ */
+static int raw_delta_element(const uint8_t *buffer, const size_t end, const size_t pos, const path_segment_t *segment,
+                             uint8_t element[8], uint8_t *element_type) {
+    if (end - pos < 9) return 1;
+    const uint32_t count = buf_read_u32o(buffer, pos);
+    const uint32_t size = buf_read_u32o(buffer, pos + 4);
+    if (size > end - pos - 8 || segment->index < 0 || segment->index >= count) return 1;
+
+    const size_t delta_end = pos + 8 + size;
+    size_t cursor = pos + 9;
+    uint64_t value = 0;
+    for (int64_t i = 0; i <= segment->index; i++) {
+        uint64_t zigzag;
+        if (!buf_read_varint(buffer, cursor, delta_end, zigzag)) return 1;
+        value += zigzag_decode(zigzag);
+    }
+    for (int i = 0; i < 8; i++) element[i] = value >> (8 * i);
+    *element_type = buffer[pos + 8];
+    return 0;
+}
+
+/**
+ * Compares a serialized scalar against the literal of a test node.
+ * @return -1, 0 or 1 like memcmp, 2 if the values are unordered (NaN) and 3 if they are not comparable
+ */
+static int raw_compare(const uint8_t *buffer, const size_t end, const size_t pos, const uint8_t type,
+                       const filter_node_t *node) {
+    int64_t i64 = 0;
+    uint64_t u64 = 0;
+    double f64 = 0;
+    enum { SIGNED, UNSIGNED, FLOATING } number;
+
+    size_t next;
+    if (bson_skip(buffer, end, pos, type, &next) != 0) return 3;
+
+    switch (type) {
+        case BSON_I8:
+            i64 = (int8_t) buffer[pos];
+            number = SIGNED;
+            break;
+        case BSON_I16:
+            i64 = (int16_t) buf_read_u16o(buffer, pos);
+            number = SIGNED;
+            break;
+        case BSON_I32:
+            i64 = (int32_t) buf_read_u32o(buffer, pos);
+            number = SIGNED;
+            break;
+        case BSON_I64:
+            i64 = (int64_t) buf_read_u64o(buffer, pos);
+            number = SIGNED;
+            break;
+        case BSON_U8:
+            u64 = buffer[pos];
+            number = UNSIGNED;
+            break;
+        case BSON_U16:
+            u64 = buf_read_u16o(buffer, pos);
+            number = UNSIGNED;
+            break;
+        case BSON_U32:
+            u64 = buf_read_u32o(buffer, pos);
+            number = UNSIGNED;
+            break;
+        case BSON_U64:
+        case BSON_DATE:
+            u64 = buf_read_u64o(buffer, pos);
+            number = UNSIGNED;
+            break;
+        case BSON_F32: {
+            union {
+                uint32_t u;
+                float f;
+            } f32_union = {.u = buf_read_u32o(buffer, pos)};
+            f64 = f32_union.f;
+            number = FLOATING;
+            break;
+        }
+        case BSON_F64: {
+            union {
+                uint64_t u;
+                double d;
+            } f64_union = {.u = buf_read_u64o(buffer, pos)};
+            f64 = f64_union.d;
+            number = FLOATING;
+            break;
+        }
+        case BSON_STRING: {
+            if (node->literal != LITERAL_STRING) return 3;
+            const uint32_t length = buf_read_u32o(buffer, pos);
+            const uint32_t common = length < node->string_length ? length : node->string_length;
+            const int c = memcmp(&buffer[pos + 4], node->string, common);
+            if (c != 0) return c < 0 ? -1 : 1;
+            return length == node->string_length ? 0 : length < node->string_length ? -1 : 1;
+        }
+        case BSON_TRUE:
+            return node->literal == LITERAL_TRUE ? 0 : node->literal == LITERAL_FALSE ? 1 : 3;
+        case BSON_FALSE:
+            return node->literal == LITERAL_FALSE ? 0 : node->literal == LITERAL_TRUE ? -1 : 3;
+        case BSON_NULL:
+            return node->literal == LITERAL_NULL ? 0 : 3;
+        default:
+            return 3;
+    }
+
+    if (node->literal != LITERAL_INT && node->literal != LITERAL_UINT && node->literal != LITERAL_FLOAT) return 3;
+
+    if (number == FLOATING || node->literal == LITERAL_FLOAT) {
+        const double a = number == FLOATING ? f64 : number == SIGNED ? (double) i64 : (double) u64;
+        const double b = node->literal == LITERAL_FLOAT
+                             ? node->number.f64
+                             : node->literal == LITERAL_INT
+                                   ? (double) node->number.i64
+                                   : (double) node->number.u64;
+        if (a < b) return -1;
+        if (a > b) return 1;
+        return a == b ? 0 : 2;
+    }
+
+    if (number == SIGNED && node->literal == LITERAL_INT) {
+        return i64 < node->number.i64 ? -1 : i64 > node->number.i64;
+    }
+    if (number == SIGNED) {
+        if (i64 < 0) return -1;
+        u64 = (uint64_t) i64;
+    } else if (node->literal == LITERAL_INT) {
+        return 1;
+    }
+    return u64 < node->number.u64 ? -1 : u64 > node->number.u64;
+}
+
+static int filter_eval(const bson_filter_t *filter, const uint32_t index, const uint8_t *buffer, // NOLINT(*-no-recursion)
+                       const size_t end, const size_t pos, const uint8_t type) {
+    const filter_node_t *node = &filter->nodes[index];
+    switch (node->kind) {
+        case FILTER_AND:
+            return filter_eval(filter, node->left, buffer, end, pos, type) &&
+                   filter_eval(filter, node->right, buffer, end, pos, type);
+        case FILTER_OR:
+            return filter_eval(filter, node->left, buffer, end, pos, type) ||
+                   filter_eval(filter, node->right, buffer, end, pos, type);
+        case FILTER_NOT:
+            return !filter_eval(filter, node->left, buffer, end, pos, type);
+        case FILTER_TEST:
+            break;
+    }
+
+    // A path into a delta array leads to an element rebuilt in `element`, which the rest of the test reads from
+    uint8_t element[8];
+    const uint8_t *source = buffer;
+    size_t source_end = end;
+    size_t value = pos;
+    uint8_t value_type = type;
+    for (uint32_t i = 0; i < node->path_length; i++) {
+        const path_segment_t *segment = &filter->segments[node->path_start + i];
+        if (value_type == BSON_DELTA && source == buffer) {
+            if (raw_delta_element(buffer, end, value, segment, element, &value_type) != 0) {
+                return node->op == FILTER_NE;
+            }
+            source = element;
+            source_end = sizeof(element);
+            value = 0;
+            continue;
+        }
+        if (raw_child(source, source_end, value, value_type, segment, &value, &value_type) != 0) {
+            return node->op == FILTER_NE;
+        }
+    }
+    if (node->op == FILTER_EXISTS) return 1;
+
+    const int c = raw_compare(source, source_end, value, value_type, node);
+    switch (node->op) {
+        case FILTER_EQ:
+            return c == 0;
+        case FILTER_NE:
+            return c != 0;
+        case FILTER_LT:
+            return c == -1;
+        case FILTER_LE:
+            return c == -1 || c == 0;
+        case FILTER_GT:
+            return c == 1;
+        case FILTER_GE:
+            return c == 1 || c == 0;
+        case FILTER_EXISTS:
+            break;
+    }
+    return 0;
+}
+
+static void parser_skip_space(filter_parser_t *parser) {
+    while (*parser->cursor == ' ' || *parser->cursor == '\t' || *parser->cursor == '\n' || *parser->cursor == '\r') {
+        parser->cursor++;
+    }
+}
+
+static int parser_accept(filter_parser_t *parser, const char *token) {
+    parser_skip_space(parser);
+    const size_t length = strlen(token);
+    if (strncmp(parser->cursor, token, length) != 0) return 0;
+    parser->cursor += length;
+    return 1;
+}
+
+static int is_path_char(const char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '$';
+}
+
+static int64_t parser_add_node(filter_parser_t *parser, const filter_node_t node) {
+    bson_filter_t *filter = parser->filter;
+    if (filter->node_count == filter->node_capacity) {
+        const uint32_t capacity = filter->node_capacity ? filter->node_capacity * 2 : 8;
+        filter_node_t *nodes = realloc(filter->nodes, capacity * sizeof(filter_node_t));
+        if (!nodes) return -1;
+        filter->nodes = nodes;
+        filter->node_capacity = capacity;
+    }
+    filter->nodes[filter->node_count] = node;
+    return filter->node_count++;
+}
+
+static int parser_add_segment(filter_parser_t *parser, const char *key, const uint32_t length) {
+    bson_filter_t *filter = parser->filter;
+    if (filter->segment_count == filter->segment_capacity) {
+        const uint32_t capacity = filter->segment_capacity ? filter->segment_capacity * 2 : 8;
+        path_segment_t *segments = realloc(filter->segments, capacity * sizeof(path_segment_t));
+        if (!segments) return 1;
+        filter->segments = segments;
+        filter->segment_capacity = capacity;
+    }
+    path_segment_t segment = {.key = key, .length = length, .index = length ? 0 : -1};
+    for (uint32_t i = 0; i < length && segment.index >= 0; i++) {
+        if (key[i] < '0' || key[i] > '9' || segment.index > UINT32_MAX) segment.index = -1;
+        else segment.index = segment.index * 10 + (key[i] - '0');
+    }
+    filter->segments[filter->segment_count++] = segment;
+    return 0;
+}
+
+/**
+ * Parses the literal on the right-hand side of a comparison.
+ * @return 0 on success, non-zero on a syntax error
+ */
+static int parser_literal(filter_parser_t *parser, filter_node_t *node) {
+    parser_skip_space(parser);
+    char *c = parser->cursor;
+
+    if (*c == '"') {
+        char *out = ++c;
+        node->string = out;
+        while (*c != '"') {
+            if (*c == '\0') return 1;
+            if (*c == '\\' && c[1] != '\0') c++;
+            *out++ = *c++;
+        }
+        node->literal = LITERAL_STRING;
+        node->string_length = out - node->string;
+        parser->cursor = c + 1;
+        return 0;
+    }
+    if (strncmp(c, "true", 4) == 0 && !is_path_char(c[4])) {
+        node->literal = LITERAL_TRUE;
+        parser->cursor = c + 4;
+        return 0;
+    }
+    if (strncmp(c, "false", 5) == 0 && !is_path_char(c[5])) {
+        node->literal = LITERAL_FALSE;
+        parser->cursor = c + 5;
+        return 0;
+    }
+    if (strncmp(c, "null", 4) == 0 && !is_path_char(c[4])) {
+        node->literal = LITERAL_NULL;
+        parser->cursor = c + 4;
+        return 0;
+    }
+
+    char *number_end = c + (*c == '-' || *c == '+');
+    while (*number_end >= '0' && *number_end <= '9') number_end++;
+    if (number_end == c || !(number_end[-1] >= '0' && number_end[-1] <= '9')) return 1;
+
+    char *end;
+    errno = 0;
+    if (*number_end == '.' || *number_end == 'e' || *number_end == 'E') {
+        node->literal = LITERAL_FLOAT;
+        node->number.f64 = strtod(c, &end);
+    } else if (*c == '-') {
+        node->literal = LITERAL_INT;
+        node->number.i64 = strtoll(c, &end, 10);
+    } else {
+        node->literal = LITERAL_UINT;
+        node->number.u64 = strtoull(c, &end, 10);
+    }
+    if (errno != 0 || end == c) return 1;
+    parser->cursor = end;
+    return 0;
+}
+
+static int64_t parser_or(filter_parser_t *parser);
+
+static int64_t parser_test(filter_parser_t *parser) {
+    filter_node_t node = {.kind = FILTER_TEST, .op = FILTER_EXISTS, .path_start = parser->filter->segment_count};
+
+    parser_skip_space(parser);
+    for (;;) {
+        char *start = parser->cursor;
+        if (*start == '`') {
+            char *close = strchr(start + 1, '`');
+            if (!close) return -1;
+            if (parser_add_segment(parser, start + 1, close - start - 1) != 0) return -1;
+            parser->cursor = close + 1;
+        } else {
+            while (is_path_char(*parser->cursor)) parser->cursor++;
+            if (parser->cursor == start) return -1;
+            if (parser_add_segment(parser, start, parser->cursor - start) != 0) return -1;
+        }
+        node.path_length++;
+        if (*parser->cursor != '.') break;
+        parser->cursor++;
+    }
+
+    static const struct {
+        const char *token;
+        filter_op op;
+    } operators[] = {
+        {"==", FILTER_EQ}, {"!=", FILTER_NE}, {"<=", FILTER_LE}, {">=", FILTER_GE}, {"<", FILTER_LT}, {">", FILTER_GT}
+    };
+    for (size_t i = 0; i < sizeof(operators) / sizeof(operators[0]); i++) {
+        if (parser_accept(parser, operators[i].token)) {
+            node.op = operators[i].op;
+            if (parser_literal(parser, &node) != 0) return -1;
+            break;
+        }
+    }
+    return parser_add_node(parser, node);
+}
+
+static int64_t parser_unary(filter_parser_t *parser) { // NOLINT(*-no-recursion)
+    parser_skip_space(parser);
+    if (parser->cursor[0] == '!' && parser->cursor[1] != '=') {
+        parser->cursor++;
+        const int64_t operand = parser_unary(parser);
+        if (operand < 0) return -1;
+        return parser_add_node(parser, (filter_node_t){.kind = FILTER_NOT, .left = operand});
+    }
+    if (parser_accept(parser, "(")) {
+        const int64_t inner = parser_or(parser);
+        if (inner < 0 || !parser_accept(parser, ")")) return -1;
+        return inner;
+    }
+    return parser_test(parser);
+}
+
+static int64_t parser_and(filter_parser_t *parser) { // NOLINT(*-no-recursion)
+    int64_t left = parser_unary(parser);
+    while (left >= 0 && parser_accept(parser, "&&")) {
+        const int64_t right = parser_unary(parser);
+        if (right < 0) return -1;
+        left = parser_add_node(parser, (filter_node_t){.kind = FILTER_AND, .left = left, .right = right});
+    }
+    return left;
+}
+
+static int64_t parser_or(filter_parser_t *parser) { // NOLINT(*-no-recursion)
+    int64_t left = parser_and(parser);
+    while (left >= 0 && parser_accept(parser, "||")) {
+        const int64_t right = parser_and(parser);
+        if (right < 0) return -1;
+        left = parser_add_node(parser, (filter_node_t){.kind = FILTER_OR, .left = left, .right = right});
+    }
+    return left;
+}
+
+/**
+ * Compiles a filter expression so it can be evaluated directly on serialized documents.
+ *
+ * Expressions are comparisons of a dotted path against a literal, e.g. `age >= 18 && name == "Alice"`.
+ * Supported operators are ==, !=, <, <=, >, >=, &&, ||, ! and parentheses. A bare path tests that the
+ * field exists. Numeric path segments index into arrays and keys with other characters can be quoted
+ * with backticks. Literals are numbers, "strings", true, false and null.
+ *
+ * @param expression Filter expression
+ * @return Compiled filter, or NULL with errno set to EINVAL on a syntax error
+ */
+bson_filter_t *bson_filter_compile(const char *expression) {
+    bson_filter_t *filter = malloc_safe(sizeof(bson_filter_t), { return NULL; });
+    *filter = (bson_filter_t){0};
+    filter->text = strdup(expression);
+    null_check(filter->text, "Memory allocation failed", { free(filter); return NULL; });
+
+    filter_parser_t parser = {.filter = filter, .cursor = filter->text};
+    const int64_t root = parser_or(&parser);
+    parser_skip_space(&parser);
+    if (root < 0 || *parser.cursor != '\0') {
+        bson_filter_free(filter);
+        errno = EINVAL;
+        return NULL;
+    }
+    filter->root = root;
+    return filter;
+}
+
+/**
+ * @param filter Filter to free
+ */
+void bson_filter_free(bson_filter_t *filter) {
+    if (!filter) return;
+    free(filter->text);
+    free(filter->nodes);
+    free(filter->segments);
+    free(filter);
+}
+
+/**
+ * Evaluates a filter against a single serialized document.
+ * @param filter Compiled filter
+ * @param buffer Serialized document, starting with its type byte
+ * @param length Number of readable bytes in the buffer
+ * @return 1 if the document matches, 0 otherwise
+ */
+int bson_filter_match(const bson_filter_t *filter, const uint8_t *buffer, const size_t length) {
+    if (length == 0) return 0;
+    return filter_eval(filter, filter->root, buffer, length, 1, buffer[0]);
+}
+
+static int scan_result_push(bson_scan_result_t *result, const uint64_t offset, const bson_t *document) {
+    if (result->length == result->capacity) {
+        const size_t capacity = result->capacity ? result->capacity * 2 : 64;
+        uint64_t *offsets = realloc(result->offsets, capacity * sizeof(uint64_t));
+        if (!offsets) return 1;
+        result->offsets = offsets;
+        if (result->documents) {
+            bson_t *documents = realloc(result->documents, capacity * sizeof(bson_t));
+            if (!documents) return 1;
+            result->documents = documents;
+        }
+        result->capacity = capacity;
+    }
+    // A result reused by scans with and without BSON_SCAN_DOCUMENTS keeps a document for every offset
+    if (document && !result->documents) {
+        result->documents = malloc_safe(result->capacity * sizeof(bson_t), { return 1; });
+        for (size_t i = 0; i < result->length; i++) result->documents[i] = bson_invalid;
+    }
+    result->offsets[result->length] = offset;
+    if (result->documents) result->documents[result->length] = document ? *document : bson_invalid;
+    result->length++;
+    return 0;
+}
+
+typedef struct {
+    const uint8_t *buffer;
+    size_t length;
+    size_t start;
+    size_t end;
+    const bson_filter_t *filter;
+    int flags;
+    int status;
+    bson_scan_result_t result;
+} scan_worker_t;
+
+static void *scan_worker(void *arg) {
+    scan_worker_t *worker = arg;
+    const uint8_t *buffer = worker->buffer;
+    size_t pos = worker->start;
+
+    while (pos < worker->end) {
+        const uint8_t type = buffer[pos];
+        size_t next;
+        if (bson_skip(buffer, worker->length, pos + 1, type, &next) != 0) {
+            worker->status = EINVAL;
+            break;
+        }
+        if (filter_eval(worker->filter, worker->filter->root, buffer, next, pos + 1, type)) {
+            bson_t document = bson_invalid;
+            if (worker->flags & BSON_SCAN_DOCUMENTS) {
+                // The filter only reads what it needs, the decoder trusts every length of the document
+                if (bson_validate(&buffer[pos], next - pos) != 0) {
+                    worker->status = errno;
+                    break;
+                }
+                uint32_t index = 0;
+                document = bson_deserialize(&buffer[pos], &index);
+                if (document.type == BSON_INVALID) {
+                    worker->status = errno ? errno : EINVAL;
+                    break;
+                }
+            }
+            if (scan_result_push(&worker->result, pos, worker->flags & BSON_SCAN_DOCUMENTS ? &document : NULL) != 0) {
+                if (worker->flags & BSON_SCAN_DOCUMENTS) bson_free(&document);
+                worker->status = ENOMEM;
+                break;
+            }
+        }
+        pos = next;
+    }
+    return NULL;
+}
+
+/**
+ * Scans a buffer of back to back serialized documents and collects the ones matching the filter.
+ *
+ * The buffer is first walked once using only the length prefixes to split it into `threads`
+ * ranges on document boundaries, then every range is evaluated by its own thread on the raw bytes.
+ * Results are appended to `result` in stream order.
+ *
+ * @param buffer Serialized documents
+ * @param length Length of the buffer in bytes
+ * @param filter Compiled filter
+ * @param threads Number of worker threads, 0 or less to use one per online CPU
+ * @param flags BSON_SCAN_DOCUMENTS to also deserialize the matching documents, which are checked with bson_validate
+ * first so a malformed match fails the scan with its errno instead of being decoded
+ * @param result Result to append the matches to, possibly from earlier scans with other flags
+ * @return 0 on success, non-zero on failure with errno set
+ */
+int bson_scan(const uint8_t *buffer, const size_t length, const bson_filter_t *filter, int threads, const int flags,
+              bson_scan_result_t *result) {
+    if (threads <= 0) {
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int) cpus : 1;
+    }
+    if ((size_t) threads > length / 4096 + 1) threads = (int) (length / 4096 + 1);
+
+    scan_worker_t *workers = malloc_safe(threads * sizeof(scan_worker_t), { return 1; });
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (scan_worker_t){
+            .buffer = buffer, .length = length, .start = length, .end = length, .filter = filter, .flags = flags,
+            .result = empty_bson_scan_result
+        };
+    }
+
+    workers[0].start = 0;
+    size_t pos = 0;
+    int split = 1;
+    while (pos < length && split < threads) {
+        while (split < threads && pos >= length / threads * split) {
+            workers[split - 1].end = pos;
+            workers[split++].start = pos;
+        }
+        if (bson_skip(buffer, length, pos + 1, buffer[pos], &pos) != 0) {
+            free(workers);
+            errno = EINVAL;
+            return 1;
+        }
+    }
+
+    pthread_t *handles = malloc_safe(threads * sizeof(pthread_t), { free(workers); return 1; });
+    int started = 1;
+    for (; started < threads; started++) {
+        if (pthread_create(&handles[started], NULL, scan_worker, &workers[started]) != 0) break;
+    }
+    scan_worker(&workers[0]);
+    for (int i = started; i < threads; i++) scan_worker(&workers[i]);
+    for (int i = 1; i < started; i++) pthread_join(handles[i], NULL);
+    free(handles);
+
+    int status = 0;
+    for (int i = 0; i < threads; i++) {
+        const bson_scan_result_t *part = &workers[i].result;
+        if (workers[i].status != 0 && status == 0) status = workers[i].status;
+        for (size_t j = 0; j < part->length; j++) {
+            if (status == 0 && scan_result_push(result, part->offsets[j], part->documents ? &part->documents[j] : NULL) == 0) {
+                continue;
+            }
+            if (status == 0) status = ENOMEM;
+            if (part->documents) bson_free(&part->documents[j]);
+        }
+        free(part->offsets);
+        free(part->documents);
+    }
+    free(workers);
+
+    if (status != 0) {
+        errno = status;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Maps a file of back to back serialized documents into memory and scans it with bson_scan.
+ * Matching offsets are relative to the start of the file.
+ * @return 0 on success, non-zero on failure with errno set
+ */
+int bson_scan_file(const char *path, const bson_filter_t *filter, const int threads, const int flags,
+                   bson_scan_result_t *result) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) return 1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 1;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    const int status = bson_scan(map, st.st_size, filter, threads, flags, result);
+    const int saved = errno;
+    munmap(map, st.st_size);
+    errno = saved;
+    return status;
+}
+
+/**
+ * @param result Scan result to free, including any deserialized documents
+ */
+void bson_scan_result_free(bson_scan_result_t *result) {
+    if (result->documents) {
+        for (size_t i = 0; i < result->length; i++) bson_free(&result->documents[i]);
+    }
+    free(result->offsets);
+    free(result->documents);
+    *result = empty_bson_scan_result;
+}
@@ -0,0 +1,32 @@
+#ifndef BSON_SCAN_H
+#define BSON_SCAN_H
+
+#include "bson.h"
+
+#define BSON_SCAN_DOCUMENTS 1 // also deserialize every matching document into bson_scan_result_t.documents
+
+typedef struct bson_filter_t bson_filter_t;
+
+typedef struct {
+    uint64_t *offsets; // byte offset of each matching document, in stream order
+    bson_t *documents; // NULL unless BSON_SCAN_DOCUMENTS was requested, bson_invalid for matches of scans without it
+    size_t length;
+    size_t capacity;
+} bson_scan_result_t;
+
+static const bson_scan_result_t empty_bson_scan_result = {.offsets = NULL, .documents = NULL, .length = 0, .capacity = 0};
+
+bson_filter_t *bson_filter_compile(const char *expression);
+
+void bson_filter_free(bson_filter_t *filter);
+
+int bson_filter_match(const bson_filter_t *filter, const uint8_t *buffer, size_t length);
+
+int bson_scan(const uint8_t *buffer, size_t length, const bson_filter_t *filter, int threads, int flags,
+              bson_scan_result_t *result);
+
+int bson_scan_file(const char *path, const bson_filter_t *filter, int threads, int flags, bson_scan_result_t *result);
+
+void bson_scan_result_free(bson_scan_result_t *result);
+
+#endif
@@ -0,0 +1,505 @@
+#include "shared.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "delta.h"
+#include "utils.h"
+
+struct bson_shared_t {
+    atomic_uint references;
+    bson_t value; // every node has a cached size, so readers never write to the tree
+};
+
+// Header in front of the storage of every array, object and string of a shared document
+typedef struct {
+    atomic_uint references; // parent nodes and documents pointing to the storage
+    _Alignas(bson_t) uint8_t data[];
+} block_t;
+
+#define block_of(storage) ((block_t *) ((uint8_t *) (storage) - offsetof(block_t, data)))
+
+static void *block_alloc(const size_t size) {
+    block_t *block = malloc_safe(sizeof(block_t) + size, { return NULL; });
+    atomic_init(&block->references, 1);
+    return block->data;
+}
+
+// Object pairs are followed by their keys in the same block, so copying an object copies its keys too
+static object_pair_t *pairs_alloc(const uint32_t length, const size_t keys) {
+    return block_alloc(length * sizeof(object_pair_t) + keys);
+}
+
+static void key_place(string_t *key, char **cursor, const string_t *source) {
+    *key = (string_t){.data = source->length ? *cursor : NULL, .length = source->length, .alloc = 0};
+    if (source->length) memcpy(*cursor, source->data, source->length);
+    *cursor += source->length;
+}
+
+/**
+ * @return Storage block data of a string, array or object, NULL if it is empty or a scalar
+ */
+static void *node_storage(const bson_t *node) {
+    switch (node->type) {
+        case BSON_STRING:
+        case BSON_BYTES:
+            return node->string.data;
+        case BSON_ARRAY:
+            return node->array.elements;
+        case BSON_OBJECT:
+            return node->object.elements;
+        default:
+            return NULL;
+    }
+}
+
+static void node_retain(const bson_t *node) {
+    void *storage = node_storage(node);
+    if (storage) atomic_fetch_add_explicit(&block_of(storage)->references, 1, memory_order_relaxed);
+}
+
+static void node_release(const bson_t *node) { // NOLINT(*-no-recursion)
+    void *storage = node_storage(node);
+    if (!storage || atomic_fetch_sub_explicit(&block_of(storage)->references, 1, memory_order_acq_rel) != 1) return;
+    if (node->type == BSON_ARRAY) {
+        for (uint32_t i = 0; i < node->array.length; i++) node_release(&node->array.elements[i]);
+    } else if (node->type == BSON_OBJECT) {
+        for (uint32_t i = 0; i < node->object.length; i++) node_release(&node->object.elements[i].value);
+    }
+    free(block_of(storage));
+}
+
+/**
+ * Copies a regular BSON value into reference counted storage. Cached sizes of containers are dropped.
+ * @return 0 on success, non-zero on allocation failure, in which case `dst` is left invalid
+ */
+static int node_copy(bson_t *dst, const bson_t *src) { // NOLINT(*-no-recursion)
+    *dst = *src;
+    switch (src->type) {
+        case BSON_STRING:
+        case BSON_BYTES:
+            dst->string = (string_t){.data = NULL, .length = src->string.length, .alloc = 0};
+            if (src->string.length == 0) return 0;
+            dst->string.data = block_alloc(src->string.length);
+            if (!dst->string.data) break;
+            memcpy(dst->string.data, src->string.data, src->string.length);
+            return 0;
+        case BSON_ARRAY:
+            dst->size = 1 << 25;
+            dst->array.elements = NULL;
+            dst->array.alloc = 0;
+            if (src->array.length == 0) return 0;
+            bson_t *elements = block_alloc(src->array.length * sizeof(bson_t));
+            if (!elements) break;
+            dst->array.elements = elements;
+            for (uint32_t i = 0; i < src->array.length; i++) {
+                if (node_copy(&elements[i], &src->array.elements[i]) == 0) continue;
+                dst->array.length = i;
+                node_release(dst);
+                break;
+            }
+            if (dst->array.length != src->array.length) break;
+            return 0;
+        case BSON_OBJECT:
+            dst->size = 1 << 25;
+            dst->object.elements = NULL;
+            dst->object.alloc = 0;
+            if (src->object.length == 0) return 0;
+            size_t keys = 0;
+            for (uint32_t i = 0; i < src->object.length; i++) keys += src->object.elements[i].key.length;
+            object_pair_t *pairs = pairs_alloc(src->object.length, keys);
+            if (!pairs) break;
+            dst->object.elements = pairs;
+            char *cursor = (char *) &pairs[src->object.length];
+            for (uint32_t i = 0; i < src->object.length; i++) {
+                key_place(&pairs[i].key, &cursor, &src->object.elements[i].key);
+                if (node_copy(&pairs[i].value, &src->object.elements[i].value) == 0) continue;
+                dst->object.length = i;
+                node_release(dst);
+                break;
+            }
+            if (dst->object.length != src->object.length) break;
+            return 0;
+        default:
+            return 0;
+    }
+    *dst = bson_invalid;
+    return 1;
+}
+
+/**
+ * Makes sure the storage of an array or object is only referenced by `node`, so that it can be modified in place.
+ * Storage still shared with other versions is copied, the children are shared between both copies.
+ * @param extra Number of elements to make room for after the existing ones, left uninitialized
+ * @param extra_keys Bytes to make room for after the keys of an object
+ * @param keys_end Set to the start of the `extra_keys` bytes when not NULL
+ * @return 0 on success, non-zero on allocation failure
+ */
+static int node_unshare(bson_t *node, const uint32_t extra, const size_t extra_keys, char **keys_end) {
+    void *storage = node_storage(node);
+    const int unique = !storage || atomic_load_explicit(&block_of(storage)->references, memory_order_acquire) == 1;
+    if (unique && extra == 0) return 0;
+
+    if (node->type == BSON_ARRAY) {
+        const uint32_t length = node->array.length;
+        bson_t *elements = block_alloc((length + extra) * sizeof(bson_t));
+        if (!elements) return 1;
+        if (length) memcpy(elements, node->array.elements, length * sizeof(bson_t));
+        if (unique) {
+            if (storage) free(block_of(storage));
+        } else {
+            for (uint32_t i = 0; i < length; i++) node_retain(&elements[i]);
+            node_release(node);
+        }
+        node->array.elements = elements;
+        return 0;
+    }
+
+    const uint32_t length = node->object.length;
+    size_t keys = 0;
+    for (uint32_t i = 0; i < length; i++) keys += node->object.elements[i].key.length;
+    object_pair_t *pairs = pairs_alloc(length + extra, keys + extra_keys);
+    if (!pairs) return 1;
+    char *cursor = (char *) &pairs[length + extra];
+    for (uint32_t i = 0; i < length; i++) {
+        key_place(&pairs[i].key, &cursor, &node->object.elements[i].key);
+        pairs[i].value = node->object.elements[i].value;
+    }
+    if (keys_end) *keys_end = cursor;
+    if (unique) {
+        if (storage) free(block_of(storage));
+    } else {
+        for (uint32_t i = 0; i < length; i++) node_retain(&pairs[i].value);
+        node_release(node);
+    }
+    node->object.elements = pairs;
+    return 0;
+}
+
+static int segment_index(const bson_t *segment, uint32_t *index) {
+    switch (segment->type) {
+        case BSON_U8:
+            *index = segment->u8;
+            return 0;
+        case BSON_U16:
+            *index = segment->u16;
+            return 0;
+        case BSON_U32:
+            *index = segment->u32;
+            return 0;
+        case BSON_I32:
+            if (segment->i32 < 0) return 1;
+            *index = segment->i32;
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+static int64_t member_find(const object_t *object, const bson_t *segment) {
+    if (segment->type != BSON_STRING) return -1;
+    for (uint32_t i = 0; i < object->length; i++) {
+        const string_t *key = &object->elements[i].key;
+        if (key->length == segment->string.length &&
+            (key->length == 0 || memcmp(key->data, segment->string.data, key->length) == 0)) return i;
+    }
+    return -1;
+}
+
+/**
+ * Applies one operation to the tree of a version that is not published yet, copying the containers along the path
+ * that it still shares with other versions. Operations have the same meaning as in bson_apply_delta.
+ * @return 0 on success, an errno value on failure
+ */
+static int shared_edit(bson_t *root, const bson_delta_op code, const array_t *path, const bson_t *value) {
+    bson_t copy = bson_invalid;
+    if (path->length == 0) {
+        if (code != BSON_DELTA_SET) return EINVAL;
+        if (node_copy(&copy, value) != 0) return ENOMEM;
+        node_release(root);
+        *root = copy;
+        return 0;
+    }
+
+    // Cached sizes along the path no longer hold, bson_optimize recomputes them once the version is done
+    bson_t *parent = root;
+    for (uint32_t i = 0; i + 1 < path->length; i++) {
+        const bson_t *segment = &path->elements[i];
+        uint32_t index;
+        int64_t found = -1;
+        if (parent->type == BSON_OBJECT) {
+            found = member_find(&parent->object, segment);
+        } else if (parent->type == BSON_ARRAY && segment_index(segment, &index) == 0 && index < parent->array.length) {
+            found = index;
+        }
+        if (found < 0) return EINVAL;
+        if (node_unshare(parent, 0, 0, NULL) != 0) return ENOMEM;
+        parent->size = 1 << 25;
+        parent = parent->type == BSON_OBJECT ? &parent->object.elements[found].value : &parent->array.elements[found];
+    }
+
+    const bson_t *segment = &path->elements[path->length - 1];
+    if (parent->type == BSON_OBJECT) {
+        const int64_t found = member_find(&parent->object, segment);
+        if (code == BSON_DELTA_INSERT || segment->type != BSON_STRING) return EINVAL;
+        if (code == BSON_DELTA_REMOVE && found < 0) return EINVAL;
+        if (code == BSON_DELTA_SET && node_copy(&copy, value) != 0) return ENOMEM;
+        char *key = NULL;
+        if (node_unshare(parent, found < 0, found < 0 ? segment->string.length : 0, &key) != 0) {
+            node_release(&copy);
+            return ENOMEM;
+        }
+        parent->size = 1 << 25;
+
+        object_t *object = &parent->object;
+        if (found < 0) {
+            object_pair_t *pair = &object->elements[object->length++];
+            key_place(&pair->key, &key, &segment->string);
+            pair->value = copy;
+            return 0;
+        }
+        object_pair_t *pair = &object->elements[found];
+        node_release(&pair->value);
+        if (code == BSON_DELTA_SET) {
+            pair->value = copy;
+            return 0;
+        }
+        memmove(pair, pair + 1, (object->length - found - 1) * sizeof(object_pair_t));
+        if (--object->length == 0) {
+            free(block_of(object->elements));
+            object->elements = NULL;
+        }
+        return 0;
+    }
+
+    if (parent->type != BSON_ARRAY) return EINVAL;
+    const uint32_t length = parent->array.length;
+    uint32_t index;
+    if (segment_index(segment, &index) != 0) return EINVAL;
+    if (index > length || (index == length && code != BSON_DELTA_INSERT)) return EINVAL;
+    if (code != BSON_DELTA_REMOVE && node_copy(&copy, value) != 0) return ENOMEM;
+    if (node_unshare(parent, code == BSON_DELTA_INSERT, 0, NULL) != 0) {
+        node_release(&copy);
+        return ENOMEM;
+    }
+    parent->size = 1 << 25;
+
+    bson_t *elements = parent->array.elements;
+    if (code == BSON_DELTA_INSERT) {
+        memmove(&elements[index + 1], &elements[index], (length - index) * sizeof(bson_t));
+        elements[index] = copy;
+        parent->array.length++;
+        return 0;
+    }
+    node_release(&elements[index]);
+    if (code == BSON_DELTA_SET) {
+        elements[index] = copy;
+        return 0;
+    }
+    memmove(&elements[index], &elements[index + 1], (length - index - 1) * sizeof(bson_t));
+    if (--parent->array.length == 0) {
+        free(block_of(elements));
+        parent->array.elements = NULL;
+    }
+    return 0;
+}
+
+// Starts a new version that shares the whole tree of `document`
+static bson_shared_t *shared_fork(const bson_shared_t *document) {
+    bson_shared_t *fork = malloc_safe(sizeof(bson_shared_t), { return NULL; });
+    atomic_init(&fork->references, 1);
+    fork->value = document->value;
+    node_retain(&fork->value);
+    return fork;
+}
+
+/**
+ * Caches the sizes of a new version before it is shared, so that readers never write to its nodes. A version nested
+ * too deep for bson_optimize would be left with sizes to compute, and is released instead.
+ */
+static bson_shared_t *shared_finish(bson_shared_t *fork, int status) {
+    if (status == 0 && bson_optimize(&fork->value) == SIZE_MAX) status = EOVERFLOW;
+    if (status != 0) {
+        bson_shared_release(fork);
+        errno = status;
+        return NULL;
+    }
+    return fork;
+}
+
+/**
+ * @param bson BSON value to copy into a new shared document, it is not modified nor referenced afterward
+ * @return Document with one reference, NULL with errno set on failure, EOVERFLOW if it is nested deeper than
+ * BSON_MAX_DEPTH
+ */
+bson_shared_t *bson_shared_new(const bson_t *bson) {
+    bson_shared_t *document = malloc_safe(sizeof(bson_shared_t), { return NULL; });
+    atomic_init(&document->references, 1);
+    if (node_copy(&document->value, bson) != 0) {
+        free(document);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return shared_finish(document, 0);
+}
+
+/**
+ * @param document Document to take a reference to, can be NULL
+ * @return The same document
+ */
+bson_shared_t *bson_shared_retain(bson_shared_t *document) {
+    if (document) atomic_fetch_add_explicit(&document->references, 1, memory_order_relaxed);
+    return document;
+}
+
+/**
+ * Drops a reference to a document, freeing it and the parts of its tree no other version uses with the last one.
+ * @param document Document to release, can be NULL
+ */
+void bson_shared_release(bson_shared_t *document) {
+    if (!document || atomic_fetch_sub_explicit(&document->references, 1, memory_order_acq_rel) != 1) return;
+    node_release(&document->value);
+    free(document);
+}
+
+/**
+ * The value can be passed to any function that does not modify it, including bson_serialize and bson_write,
+ * from any number of threads. It stays valid as long as the caller holds a reference to the document.
+ * @param document Document to read
+ * @return Root of the document
+ */
+const bson_t *bson_shared_value(const bson_shared_t *document) {
+    return &document->value;
+}
+
+/**
+ * @param document Document to make a new version of, it is left unchanged
+ * @param path Array of string keys and unsigned indices leading to the value to set, see delta.h
+ * @param value Value to copy into the new version, the parent object gets the key if it did not have it
+ * @return New version with one reference, NULL with errno set on failure, EOVERFLOW if it would be nested deeper
+ * than BSON_MAX_DEPTH
+ */
+bson_shared_t *bson_shared_set(const bson_shared_t *document, const bson_t *path, const bson_t *value) {
+    if (path->type != BSON_ARRAY) {
+        errno = EINVAL;
+        return NULL;
+    }
+    bson_shared_t *fork = shared_fork(document);
+    if (!fork) return NULL;
+    return shared_finish(fork, shared_edit(&fork->value, BSON_DELTA_SET, &path->array, value));
+}
+
+/**
+ * @param document Document to make a new version of, it is left unchanged
+ * @param path Array of string keys and unsigned indices leading to the object member or array element to remove
+ * @return New version with one reference, NULL with errno set on failure
+ */
+bson_shared_t *bson_shared_remove(const bson_shared_t *document, const bson_t *path) {
+    if (path->type != BSON_ARRAY) {
+        errno = EINVAL;
+        return NULL;
+    }
+    bson_shared_t *fork = shared_fork(document);
+    if (!fork) return NULL;
+    return shared_finish(fork, shared_edit(&fork->value, BSON_DELTA_REMOVE, &path->array, NULL));
+}
+
+/**
+ * Applies a delta produced by bson_diff. Containers copied by an earlier operation are modified in place by the
+ * following ones, so every container is copied at most once.
+ * @param document Document to make a new version of, it is left unchanged
+ * @param delta Delta to apply
+ * @return New version with one reference, NULL with errno set on failure, EOVERFLOW if it would be nested deeper
+ * than BSON_MAX_DEPTH
+ */
+bson_shared_t *bson_shared_apply(const bson_shared_t *document, const bson_t *delta) {
+    if (delta->type != BSON_ARRAY) {
+        errno = EINVAL;
+        return NULL;
+    }
+    bson_shared_t *fork = shared_fork(document);
+    if (!fork) return NULL;
+
+    int status = 0;
+    for (uint32_t i = 0; i < delta->array.length && status == 0; i++) {
+        const bson_t *op = &delta->array.elements[i];
+        if (op->type != BSON_ARRAY || op->array.length < 2) {
+            status = EINVAL;
+            break;
+        }
+        const bson_t *parts = op->array.elements;
+        const bson_delta_op code = parts[0].u8;
+        if (parts[0].type != BSON_U8 || parts[1].type != BSON_ARRAY ||
+            (code != BSON_DELTA_REMOVE && ((code != BSON_DELTA_SET && code != BSON_DELTA_INSERT) ||
+                                           op->array.length < 3))) {
+            status = EINVAL;
+            break;
+        }
+        status = shared_edit(&fork->value, code, &parts[1].array, code == BSON_DELTA_REMOVE ? NULL : &parts[2]);
+    }
+    return shared_finish(fork, status);
+}
+
+/**
+ * @param slot Slot to initialize
+ * @param document Initial version, the slot takes over the caller's reference
+ * @return 0 on success, non-zero with errno set on failure
+ */
+int bson_shared_slot_init(bson_shared_slot_t *slot, bson_shared_t *document) {
+    atomic_init(&slot->current, document);
+    atomic_init(&slot->phase, 0);
+    atomic_init(&slot->readers[0], 0);
+    atomic_init(&slot->readers[1], 0);
+    const int status = pthread_mutex_init(&slot->publishing, NULL);
+    if (status != 0) {
+        errno = status;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Takes a reference to the current version of a slot without locking, it stays usable after newer versions are
+ * published until it is released.
+ * @param slot Slot to read
+ * @return Current version, to release with bson_shared_release
+ */
+bson_shared_t *bson_shared_load(bson_shared_slot_t *slot) {
+    unsigned phase;
+    for (;;) {
+        phase = atomic_load(&slot->phase) & 1;
+        atomic_fetch_add(&slot->readers[phase], 1);
+        if ((atomic_load(&slot->phase) & 1) == phase) break;
+        atomic_fetch_sub(&slot->readers[phase], 1); // a publish flipped the phase in between
+    }
+    bson_shared_t *document = bson_shared_retain(atomic_load(&slot->current));
+    atomic_fetch_sub(&slot->readers[phase], 1);
+    return document;
+}
+
+/**
+ * Replaces the current version of a slot with a single atomic exchange. The previous version is released once
+ * the readers that may have loaded it took their reference.
+ * @param slot Slot to update
+ * @param document New version, the slot takes over the caller's reference
+ */
+void bson_shared_publish(bson_shared_slot_t *slot, bson_shared_t *document) {
+    pthread_mutex_lock(&slot->publishing);
+    bson_shared_t *previous = atomic_exchange(&slot->current, document);
+    const unsigned phase = atomic_fetch_add(&slot->phase, 1) & 1;
+    while (atomic_load(&slot->readers[phase]) != 0) sched_yield();
+    pthread_mutex_unlock(&slot->publishing);
+    bson_shared_release(previous);
+}
+
+/**
+ * Releases the current version of a slot, no other thread may use the slot anymore.
+ * @param slot Slot to destroy
+ */
+void bson_shared_slot_destroy(bson_shared_slot_t *slot) {
+    bson_shared_release(atomic_load(&slot->current));
+    atomic_store(&slot->current, NULL);
+    pthread_mutex_destroy(&slot->publishing);
+}
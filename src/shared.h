@@ -0,0 +1,46 @@
+#ifndef BSON_SHARED_H
+#define BSON_SHARED_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "bson.h"
+
+/*
+ * Immutable, reference counted document. Every array, object and string of the tree is reference counted on its
+ * own, so new versions made by bson_shared_set, bson_shared_remove and bson_shared_apply only copy the containers
+ * along the modified paths and share everything else with the version they were made from.
+ */
+typedef struct bson_shared_t bson_shared_t;
+
+// Location readers load the current version of a document from, while writers publish new versions
+typedef struct {
+    _Atomic(bson_shared_t *) current;
+    atomic_uint phase; // which of `readers` new readers register in, flipped by every publish
+    atomic_uint readers[2]; // readers between loading `current` and taking their reference, per phase
+    pthread_mutex_t publishing; // publishers wait for the readers of the previous phase one at a time
+} bson_shared_slot_t;
+
+bson_shared_t *bson_shared_new(const bson_t *bson);
+
+bson_shared_t *bson_shared_retain(bson_shared_t *document);
+
+void bson_shared_release(bson_shared_t *document);
+
+const bson_t *bson_shared_value(const bson_shared_t *document);
+
+bson_shared_t *bson_shared_set(const bson_shared_t *document, const bson_t *path, const bson_t *value);
+
+bson_shared_t *bson_shared_remove(const bson_shared_t *document, const bson_t *path);
+
+bson_shared_t *bson_shared_apply(const bson_shared_t *document, const bson_t *delta);
+
+int bson_shared_slot_init(bson_shared_slot_t *slot, bson_shared_t *document);
+
+bson_shared_t *bson_shared_load(bson_shared_slot_t *slot);
+
+void bson_shared_publish(bson_shared_slot_t *slot, bson_shared_t *document);
+
+void bson_shared_slot_destroy(bson_shared_slot_t *slot);
+
+#endif
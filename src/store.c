@@ -0,0 +1,636 @@
+#include "store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "canonical.h"
+#include "delta.h"
+#include "utils.h"
+#include "view.h"
+
+// Key and value lengths in front of a record
+#define RECORD_HEADER 8
+// Header and checksum of a record
+#define RECORD_OVERHEAD 16
+
+static int store_reserve(bson_store_t *store, const size_t length) {
+    if (length <= store->buffer_capacity) return 0;
+    size_t capacity = store->buffer_capacity + store->buffer_capacity / 2;
+    if (capacity < length) capacity = length;
+    uint8_t *buffer = realloc(store->buffer, capacity);
+    if (!buffer) return 1;
+    store->buffer = buffer;
+    store->buffer_capacity = capacity;
+    return 0;
+}
+
+/**
+ * @return Slot of the key in the index, or the free slot where it would go
+ */
+static uint32_t index_find(const bson_store_t *store, const char *key, const uint32_t length, const uint64_t hash) {
+    const uint32_t mask = store->capacity - 1;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        const bson_store_entry_t *entry = &store->entries[i];
+        if (entry->offset == 0) return i;
+        if (entry->hash == hash && entry->key.length == length &&
+            (length == 0 || memcmp(entry->key.data, key, length) == 0)) {
+            return i;
+        }
+    }
+}
+
+static int index_grow(bson_store_t *store) {
+    if ((uint64_t) (store->count + 1) * 4 <= (uint64_t) store->capacity * 3) return 0;
+    const uint32_t capacity = store->capacity * 2;
+    bson_store_entry_t *entries = calloc(capacity, sizeof(bson_store_entry_t));
+    if (!entries) return 1;
+    for (uint32_t i = 0; i < store->capacity; i++) {
+        const bson_store_entry_t *entry = &store->entries[i];
+        if (entry->offset == 0) continue;
+        uint32_t slot = entry->hash & (capacity - 1);
+        while (entries[slot].offset != 0) slot = (slot + 1) & (capacity - 1);
+        entries[slot] = *entry;
+    }
+    free(store->entries);
+    store->entries = entries;
+    store->capacity = capacity;
+    return 0;
+}
+
+/**
+ * Removes an entry by moving back the entries after it that probed past its slot, so lookups never need tombstones.
+ */
+static void index_remove(bson_store_t *store, const uint32_t slot) {
+    const uint32_t mask = store->capacity - 1;
+    if (store->entries[slot].key.alloc) free(store->entries[slot].key.data);
+    uint32_t hole = slot;
+    for (uint32_t i = (slot + 1) & mask; store->entries[i].offset != 0; i = (i + 1) & mask) {
+        const uint32_t home = store->entries[i].hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            store->entries[hole] = store->entries[i];
+            hole = i;
+        }
+    }
+    store->entries[hole].offset = 0;
+    store->count--;
+}
+
+/**
+ * Points a key at the value of a record, or removes it for a record without a value, and accounts for the records
+ * this makes garbage.
+ * @param record Offset of the record in the file
+ * @return 0 on success, non-zero if the index could not grow
+ */
+static int index_apply(bson_store_t *store, const char *key, const uint32_t key_length, const uint64_t record,
+                       const uint32_t value_length) {
+    const uint64_t hash = bson_hash((const uint8_t *) key, key_length);
+    uint32_t slot = index_find(store, key, key_length, hash);
+    bson_store_entry_t *entry = &store->entries[slot];
+    if (value_length == 0) {
+        store->garbage += RECORD_OVERHEAD + key_length;
+        if (entry->offset == 0) return 0;
+        store->garbage += RECORD_OVERHEAD + key_length + entry->length;
+        index_remove(store, slot);
+        return 0;
+    }
+
+    const uint64_t offset = record + RECORD_HEADER + key_length;
+    if (entry->offset != 0) {
+        store->garbage += RECORD_OVERHEAD + key_length + entry->length;
+        entry->offset = offset;
+        entry->length = value_length;
+        return 0;
+    }
+    if (index_grow(store) != 0) return 1;
+    char *copy = key_length ? malloc_safe(key_length, { return 1; }) : NULL;
+    if (key_length) memcpy(copy, key, key_length);
+    slot = index_find(store, key, key_length, hash);
+    store->entries[slot] = (bson_store_entry_t){
+        .key = {.data = copy, .length = key_length, .alloc = key_length != 0},
+        .hash = hash,
+        .offset = offset,
+        .length = value_length
+    };
+    store->count++;
+    return 0;
+}
+
+static const bson_store_entry_t *store_find(const bson_store_t *store, const char *key, const uint32_t key_length) {
+    const bson_store_entry_t *entry =
+            &store->entries[index_find(store, key, key_length, bson_hash((const uint8_t *) key, key_length))];
+    return entry->offset != 0 ? entry : NULL;
+}
+
+/**
+ * Starts a record in the buffer of the store, the caller writes the value just after the key.
+ */
+static int record_begin(bson_store_t *store, const char *key, const uint32_t key_length,
+                        const uint32_t value_length) {
+    if (store_reserve(store, (size_t) RECORD_OVERHEAD + key_length + value_length) != 0) return 1;
+    uint8_t *buffer = store->buffer;
+    buf_write_32o(0, key_length);
+    buf_write_32o(4, value_length);
+    if (key_length) memcpy(&buffer[RECORD_HEADER], key, key_length);
+    return 0;
+}
+
+/**
+ * Checksums the record in the buffer of the store, appends it to the file and updates the index. A failed write
+ * leaves the length of the store as it was, so the next record overwrites whatever made it to the file.
+ */
+static int record_end(bson_store_t *store, const uint32_t key_length, const uint32_t value_length) {
+    uint8_t *buffer = store->buffer;
+    const size_t size = RECORD_HEADER + key_length + value_length;
+    const uint64_t checksum = bson_hash(buffer, size);
+    buf_write_64o(size, checksum);
+
+    fseek_safe(store->file, (long) store->length, SEEK_SET, { return 1; });
+    fwrite_safe(store->file, buffer, 1, size + 8, { return 1; });
+    if (fflush(store->file) != 0) return 1;
+
+    const uint64_t record = store->length;
+    store->length += size + 8;
+    return index_apply(store, (const char *) &buffer[RECORD_HEADER], key_length, record, value_length);
+}
+
+/**
+ * Rebuilds the index from the records in the file. A crash in the middle of an append leaves a record that is cut
+ * short or does not match its checksum, which is truncated away along with everything after it.
+ */
+static int store_replay(bson_store_t *store) {
+    fseek_safe(store->file, 0, SEEK_END, { return 1; });
+    const long end = ftell(store->file);
+    if (end < 0) return 1;
+    fseek_safe(store->file, 0, SEEK_SET, { return 1; });
+
+    uint64_t length = 0;
+    while ((uint64_t) end - length >= RECORD_OVERHEAD) {
+        if (store_reserve(store, RECORD_OVERHEAD) != 0) return 1;
+        if (fread(store->buffer, 1, RECORD_HEADER, store->file) != RECORD_HEADER) {
+            if (ferror(store->file)) return 1;
+            break;
+        }
+        const uint32_t key_length = buf_read_u32o(store->buffer, 0);
+        const uint32_t value_length = buf_read_u32o(store->buffer, 4);
+        const uint64_t size = (uint64_t) RECORD_OVERHEAD + key_length + value_length;
+        if (size > (uint64_t) end - length) break;
+        if (store_reserve(store, size) != 0) return 1;
+        if (fread(&store->buffer[RECORD_HEADER], 1, size - RECORD_HEADER, store->file) != size - RECORD_HEADER) {
+            if (ferror(store->file)) return 1;
+            break;
+        }
+        if (buf_read_u64o(store->buffer, size - 8) != bson_hash(store->buffer, size - 8)) break;
+        const char *key = (const char *) &store->buffer[RECORD_HEADER];
+        if (index_apply(store, key, key_length, length, value_length) != 0) return 1;
+        length += size;
+    }
+
+    store->length = length;
+    if (length == (uint64_t) end) return 0;
+    if (fflush(store->file) != 0 || ftruncate(fileno(store->file), (off_t) length) != 0) return 1;
+    return 0;
+}
+
+/**
+ * Opens a store, creating its file if it does not exist, and rebuilds its index by reading the file once.
+ * Records that were being appended when a previous process crashed are dropped from the end of the file.
+ * @param store Store to initialize, closed with bson_store_close
+ * @param path Path of the file of the store
+ * @return 0 on success, non-zero with errno set on failure
+ */
+int bson_store_open(bson_store_t *store, const char *path) {
+    *store = (bson_store_t){.capacity = 16};
+    const int status = pthread_mutex_init(&store->lock, NULL);
+    if (status != 0) {
+        errno = status;
+        return 1;
+    }
+    store->file = fopen(path, "r+b");
+    if (!store->file && errno == ENOENT) store->file = fopen(path, "w+b");
+    store->path = strdup(path);
+    store->entries = calloc(store->capacity, sizeof(bson_store_entry_t));
+    if (!store->file || !store->path || !store->entries || store_replay(store) != 0) {
+        const int error = errno;
+        bson_store_close(store);
+        errno = error;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Waits for a background compaction, closes the file of a store and frees its index. Records are already written,
+ * call bson_store_sync first for them to survive a crash of the system.
+ */
+void bson_store_close(bson_store_t *store) {
+    if (store->compacting == 2) bson_store_compact_wait(store);
+    if (store->file) fclose(store->file);
+    if (store->entries) {
+        for (uint32_t i = 0; i < store->capacity; i++) {
+            if (store->entries[i].offset != 0 && store->entries[i].key.alloc) free(store->entries[i].key.data);
+        }
+    }
+    free(store->entries);
+    free(store->path);
+    free(store->buffer);
+    pthread_mutex_destroy(&store->lock);
+    *store = (bson_store_t){0};
+}
+
+static int store_put(bson_store_t *store, const char *key, const uint32_t key_length, const bson_t *value,
+                     const size_t length) {
+    if (record_begin(store, key, key_length, length) != 0) return 1;
+    bson_write_iter(store->buffer, RECORD_HEADER + key_length, value);
+    return record_end(store, key_length, length);
+}
+
+/**
+ * Appends a new version of a document, with a single write.
+ * @param key Key of the document, which does not have to be NUL terminated
+ * @param key_length Length of the key in bytes
+ * @param value Document to store, its size is cached if it is not yet
+ * @return 0 on success, non-zero with errno set on failure
+ */
+int bson_store_put(bson_store_t *store, const char *key, const uint32_t key_length, bson_t *value) {
+    const size_t size = bson_optimize(value);
+    if (size == SIZE_MAX) return 1;
+    pthread_mutex_lock(&store->lock);
+    const int status = store_put(store, key, key_length, value, 1 + size);
+    pthread_mutex_unlock(&store->lock);
+    return status;
+}
+
+static bson_t store_get(bson_store_t *store, const char *key, const uint32_t key_length) {
+    const bson_store_entry_t *entry = store_find(store, key, key_length);
+    if (!entry) {
+        errno = ENOENT;
+        return bson_invalid;
+    }
+    if (store_reserve(store, entry->length) != 0) return bson_invalid;
+    fseek_safe(store->file, (long) entry->offset, SEEK_SET, { return bson_invalid; });
+    fread_safe(store->file, store->buffer, 1, entry->length, { errno = EIO; return bson_invalid; });
+    if (bson_validate(store->buffer, entry->length) != 0) return bson_invalid;
+    uint32_t index = 0;
+    return bson_deserialize(store->buffer, &index);
+}
+
+/**
+ * Reads the latest version of a document, with a single read.
+ * @return Deserialized document, or bson_invalid with errno set to ENOENT if the key is not in the store, or to
+ * another error if the value could not be read back
+ */
+bson_t bson_store_get(bson_store_t *store, const char *key, const uint32_t key_length) {
+    pthread_mutex_lock(&store->lock);
+    const bson_t value = store_get(store, key, key_length);
+    pthread_mutex_unlock(&store->lock);
+    return value;
+}
+
+static int store_remove(bson_store_t *store, const char *key, const uint32_t key_length) {
+    if (!store_find(store, key, key_length)) {
+        errno = ENOENT;
+        return 1;
+    }
+    if (record_begin(store, key, key_length, 0) != 0) return 1;
+    return record_end(store, key_length, 0);
+}
+
+/**
+ * Appends a record removing a document.
+ * @return 0 on success, non-zero with errno set on failure, ENOENT if the key is not in the store
+ */
+int bson_store_remove(bson_store_t *store, const char *key, const uint32_t key_length) {
+    pthread_mutex_lock(&store->lock);
+    const int status = store_remove(store, key, key_length);
+    pthread_mutex_unlock(&store->lock);
+    return status;
+}
+
+static int store_apply(bson_store_t *store, const char *key, const uint32_t key_length, bson_t *delta) {
+    const bson_store_entry_t *entry = store_find(store, key, key_length);
+    if (!entry) {
+        errno = ENOENT;
+        return 1;
+    }
+    size_t length = entry->length;
+    uint8_t *value = malloc_safe(length, { return 1; });
+    fseek_safe(store->file, (long) entry->offset, SEEK_SET, { free(value); return 1; });
+    fread_safe(store->file, value, 1, length, { free(value); errno = EIO; return 1; });
+    if (bson_apply_delta_buffer(&value, &length, delta) != 0 || record_begin(store, key, key_length, length) != 0) {
+        free(value);
+        return 1;
+    }
+    memcpy(&store->buffer[RECORD_HEADER + key_length], value, length);
+    free(value);
+    return record_end(store, key_length, length);
+}
+
+/**
+ * Updates a document with a delta produced by bson_diff. The latest version is read, patched in its serialized
+ * form with bson_apply_delta_buffer and appended as a new version, without deserializing it.
+ * @param delta Delta to apply, sizes of its values are cached like in bson_optimize
+ * @return 0 on success, non-zero with errno set on failure, ENOENT if the key is not in the store
+ */
+int bson_store_apply(bson_store_t *store, const char *key, const uint32_t key_length, bson_t *delta) {
+    pthread_mutex_lock(&store->lock);
+    const int status = store_apply(store, key, key_length, delta);
+    pthread_mutex_unlock(&store->lock);
+    return status;
+}
+
+/**
+ * Waits for the records appended so far to reach the disk.
+ * @return 0 on success, non-zero with errno set on failure
+ */
+int bson_store_sync(bson_store_t *store) {
+    pthread_mutex_lock(&store->lock);
+    const int status = fflush(store->file) != 0 || fsync(fileno(store->file)) != 0;
+    pthread_mutex_unlock(&store->lock);
+    return status;
+}
+
+// Latest record of a key when a compaction starts
+typedef struct {
+    uint64_t offset; // offset of the value in the file being compacted
+    uint64_t moved; // offset of the value in the compacted file
+    uint32_t header; // bytes of the record before the value
+    uint32_t size; // bytes of the whole record
+} compact_record_t;
+
+/*
+ * A compaction copies the records the index points to when it starts, without holding the lock of the store. The
+ * file only grows meanwhile, so the records appended since then are all after `length`: they are copied as they are
+ * once the lock is taken again, and the index is pointed at the new file.
+ */
+typedef struct {
+    bson_store_t *store;
+    int source; // descriptor of the file being compacted, read with pread so its stream is left alone
+    FILE *file; // compacted file
+    char *temporary; // path of the compacted file until it replaces the one of the store
+    compact_record_t *records; // sorted by offset
+    uint32_t count;
+    uint64_t length; // length of the store when the compaction started
+    uint64_t garbage; // garbage of the store when the compaction started
+    uint64_t compacted; // length of the records of the snapshot in the compacted file
+    uint8_t *buffer;
+    size_t buffer_capacity;
+} compact_job_t;
+
+static int record_compare(const void *a, const void *b) {
+    const uint64_t x = ((const compact_record_t *) a)->offset, y = ((const compact_record_t *) b)->offset;
+    return (x > y) - (x < y);
+}
+
+static void compact_free(compact_job_t *job) {
+    if (job->file) {
+        fclose(job->file);
+        remove(job->temporary);
+    }
+    free(job->temporary);
+    free(job->records);
+    free(job->buffer);
+    free(job);
+}
+
+/**
+ * Reads exactly `size` bytes at an offset of the file being compacted.
+ * @return 0 on success, non-zero with errno set on failure, EIO if the file is shorter
+ */
+static int compact_read(compact_job_t *job, const uint64_t offset, const size_t size) {
+    if (size > job->buffer_capacity) {
+        uint8_t *buffer = realloc(job->buffer, size);
+        if (!buffer) return 1;
+        job->buffer = buffer;
+        job->buffer_capacity = size;
+    }
+    for (size_t done = 0; done < size;) {
+        const ssize_t n = pread(job->source, &job->buffer[done], size - done, (off_t) (offset + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return 1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/**
+ * Takes a snapshot of the index and creates the compacted file, with the lock of the store held.
+ * @return Job to run, NULL with errno set on failure, EBUSY if a compaction is already running
+ */
+static compact_job_t *compact_begin(bson_store_t *store, const int background) {
+    if (store->compacting) {
+        errno = EBUSY;
+        return NULL;
+    }
+    compact_job_t *job = calloc(1, sizeof(compact_job_t));
+    if (!job) return NULL;
+    job->store = store;
+    job->source = fileno(store->file);
+    job->length = store->length;
+    job->garbage = store->garbage;
+
+    const size_t path_length = strlen(store->path);
+    job->temporary = malloc_safe(path_length + sizeof(".compact"), { compact_free(job); return NULL; });
+    memcpy(job->temporary, store->path, path_length);
+    memcpy(&job->temporary[path_length], ".compact", sizeof(".compact"));
+    job->records = malloc_safe(((size_t) store->count + 1) * sizeof(compact_record_t), {
+        compact_free(job);
+        return NULL;
+    });
+    for (uint32_t i = 0; i < store->capacity; i++) {
+        const bson_store_entry_t *entry = &store->entries[i];
+        if (entry->offset == 0) continue;
+        const uint32_t header = RECORD_HEADER + entry->key.length;
+        job->records[job->count++] = (compact_record_t){
+            .offset = entry->offset, .header = header, .size = header + entry->length + 8
+        };
+    }
+    // Copying in file order reads the old file sequentially and keeps the records in the order they were written
+    qsort(job->records, job->count, sizeof(compact_record_t), record_compare);
+
+    job->file = fopen(job->temporary, "w+b");
+    if (!job->file) {
+        const int error = errno;
+        compact_free(job);
+        errno = error;
+        return NULL;
+    }
+    store->compacting = background ? 2 : 1;
+    return job;
+}
+
+/**
+ * Copies the records of the snapshot to the compacted file, without the lock of the store.
+ * @return 0 on success, non-zero with errno set on failure
+ */
+static int compact_copy(compact_job_t *job) {
+    uint64_t length = 0;
+    for (uint32_t i = 0; i < job->count; i++) {
+        compact_record_t *record = &job->records[i];
+        if (compact_read(job, record->offset - record->header, record->size) != 0) return 1;
+        fwrite_safe(job->file, job->buffer, 1, record->size, { return 1; });
+        record->moved = length + record->header;
+        length += record->size;
+    }
+    job->compacted = length;
+    return 0;
+}
+
+/**
+ * Opens the directory holding a file, whose entries a rename changes.
+ * @return Descriptor of the directory, -1 with errno set on failure
+ */
+static int directory_open(const char *path) {
+    const char *slash = strrchr(path, '/');
+    if (!slash) return open(".", O_RDONLY | O_DIRECTORY);
+    if (slash == path) return open("/", O_RDONLY | O_DIRECTORY);
+    char *directory = strndup(path, slash - path);
+    if (!directory) return -1;
+    const int descriptor = open(directory, O_RDONLY | O_DIRECTORY);
+    free(directory);
+    return descriptor;
+}
+
+/**
+ * Copies the records appended since the snapshot, replaces the file of the store with the compacted one and points
+ * the index at it, with the lock of the store held. The rename only survives a crash of the system once the
+ * directory holding the store is synced too, which is done last.
+ * @return 0 on success, non-zero with errno set on failure, in which case the store is unchanged, unless only the
+ * directory could not be synced: the store then uses the compacted file, which a crash may still revert
+ */
+static int compact_end(compact_job_t *job) {
+    bson_store_t *store = job->store;
+    for (uint64_t offset = job->length; offset < store->length;) {
+        const size_t chunk = store->length - offset < (1 << 16) ? store->length - offset : (1 << 16);
+        if (compact_read(job, offset, chunk) != 0) return 1;
+        fwrite_safe(job->file, job->buffer, 1, chunk, { return 1; });
+        offset += chunk;
+    }
+    if (fflush(job->file) != 0 || fsync(fileno(job->file)) != 0) return 1;
+    const int directory = directory_open(store->path);
+    if (directory < 0) return 1;
+    if (rename(job->temporary, store->path) != 0) {
+        const int error = errno;
+        close(directory);
+        errno = error;
+        return 1;
+    }
+
+    // Entries still before the snapshot length point to a record of the snapshot, the others were appended since
+    for (uint32_t i = 0; i < store->capacity; i++) {
+        bson_store_entry_t *entry = &store->entries[i];
+        if (entry->offset == 0) continue;
+        if (entry->offset >= job->length) {
+            entry->offset = entry->offset - job->length + job->compacted;
+            continue;
+        }
+        const compact_record_t key = {.offset = entry->offset};
+        const compact_record_t *record = bsearch(&key, job->records, job->count, sizeof(compact_record_t),
+                                                 record_compare);
+        entry->offset = record->moved;
+    }
+    fclose(store->file);
+    store->file = job->file;
+    job->file = NULL;
+    store->length = store->length - job->length + job->compacted;
+    store->garbage -= job->garbage;
+
+    const int synced = fsync(directory);
+    const int error = errno;
+    close(directory);
+    errno = error;
+    return synced != 0;
+}
+
+// Runs a compaction and frees it, returning the errno value it failed with or 0
+static void *compact_run(void *argument) {
+    compact_job_t *job = argument;
+    bson_store_t *store = job->store;
+    int status = compact_copy(job) != 0 ? errno : 0;
+    pthread_mutex_lock(&store->lock);
+    if (status == 0 && compact_end(job) != 0) status = errno;
+    pthread_mutex_unlock(&store->lock);
+    compact_free(job);
+    return (void *) (intptr_t) status;
+}
+
+/**
+ * Rewrites the file with only the latest record of every key, reclaiming the `garbage` bytes of the store. The
+ * records are copied to a temporary file next to it that replaces it once complete and synced, and the directory is
+ * synced after the rename, so a crash while compacting leaves either the old or the compacted file. Other threads can
+ * keep using the store while the records are copied.
+ * @return 0 on success, non-zero with errno set on failure, in which case the store is unchanged, EBUSY if a
+ * compaction is already running
+ */
+int bson_store_compact(bson_store_t *store) {
+    pthread_mutex_lock(&store->lock);
+    compact_job_t *job = compact_begin(store, 0);
+    pthread_mutex_unlock(&store->lock);
+    if (!job) return 1;
+
+    const int status = (int) (intptr_t) compact_run(job);
+    pthread_mutex_lock(&store->lock);
+    store->compacting = 0;
+    pthread_mutex_unlock(&store->lock);
+    if (status != 0) {
+        errno = status;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Starts bson_store_compact in a thread of its own. The store can be read and written meanwhile: records appended
+ * while the live ones are copied are moved to the compacted file at the end, under the lock of the store.
+ * @return 0 on success, non-zero with errno set on failure, EBUSY if a compaction is already running
+ */
+int bson_store_compact_start(bson_store_t *store) {
+    pthread_mutex_lock(&store->lock);
+    compact_job_t *job = compact_begin(store, 1);
+    if (!job) {
+        pthread_mutex_unlock(&store->lock);
+        return 1;
+    }
+    const int status = pthread_create(&store->compactor, NULL, compact_run, job);
+    if (status != 0) {
+        store->compacting = 0;
+        compact_free(job);
+    }
+    pthread_mutex_unlock(&store->lock);
+    if (status != 0) {
+        errno = status;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Waits for the compaction started by bson_store_compact_start.
+ * @return 0 if it succeeded, non-zero with errno set if it failed, in which case the store is unchanged, EINVAL if
+ * none was started
+ */
+int bson_store_compact_wait(bson_store_t *store) {
+    pthread_mutex_lock(&store->lock);
+    const int started = store->compacting == 2;
+    pthread_mutex_unlock(&store->lock);
+    if (!started) {
+        errno = EINVAL;
+        return 1;
+    }
+    void *result;
+    pthread_join(store->compactor, &result);
+    pthread_mutex_lock(&store->lock);
+    store->compacting = 0;
+    pthread_mutex_unlock(&store->lock);
+    const int status = (int) (intptr_t) result;
+    if (status != 0) {
+        errno = status;
+        return 1;
+    }
+    return 0;
+}
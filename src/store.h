@@ -0,0 +1,60 @@
+#ifndef BSON_STORE_H
+#define BSON_STORE_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "bson.h"
+
+// Where the latest version of a key lives in the file of a store
+typedef struct {
+    string_t key; // heap allocated copy of the key
+    uint64_t hash;
+    uint64_t offset; // offset of the serialized value in the file, 0 for a free slot of the index
+    uint32_t length; // length of the serialized value, type byte included
+} bson_store_entry_t;
+
+/*
+ * Keyed documents appended to a single file. Every record is a u32 key length, a u32 value length, the key, the value
+ * serialized with its type byte and an XXH64 checksum of everything before it; a value length of 0 removes the key.
+ * Replacing or removing a key appends a record and leaves the previous one as garbage until bson_store_compact. The
+ * index from keys to the offsets of their latest values is rebuilt from the file when it is opened. Every operation
+ * holds the lock of the store, so threads can share one, and bson_store_compact_start compacts it in a thread of its
+ * own while it keeps being read and written.
+ */
+typedef struct {
+    FILE *file;
+    char *path;
+    uint64_t length; // end of the last complete record, where the next one is appended
+    uint64_t garbage; // bytes of records that have been replaced or removed
+    bson_store_entry_t *entries; // open addressing with linear probing
+    uint32_t count; // keys in the store
+    uint32_t capacity; // slots in the index, a power of 2
+    uint8_t *buffer; // reused for every record read or written
+    size_t buffer_capacity;
+    pthread_mutex_t lock; // held by every operation, and by a compaction while it switches files
+    pthread_t compactor; // thread of a background compaction
+    int compacting; // 1 while bson_store_compact runs, 2 from bson_store_compact_start to bson_store_compact_wait
+} bson_store_t;
+
+int bson_store_open(bson_store_t *store, const char *path);
+
+void bson_store_close(bson_store_t *store);
+
+int bson_store_put(bson_store_t *store, const char *key, uint32_t key_length, bson_t *value);
+
+bson_t bson_store_get(bson_store_t *store, const char *key, uint32_t key_length);
+
+int bson_store_remove(bson_store_t *store, const char *key, uint32_t key_length);
+
+int bson_store_apply(bson_store_t *store, const char *key, uint32_t key_length, bson_t *delta);
+
+int bson_store_sync(bson_store_t *store);
+
+int bson_store_compact(bson_store_t *store);
+
+int bson_store_compact_start(bson_store_t *store);
+
+int bson_store_compact_wait(bson_store_t *store);
+
+#endif
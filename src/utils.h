@@ -57,4 +57,66 @@
         ptr; \
     })
 
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define LE_bswap16(val) val = __builtin_bswap16(val)
+#define LE_bswap32(val) val = __builtin_bswap32(val)
+#define LE_bswap64(val) val = __builtin_bswap64(val)
+#elif defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define LE_bswap16(val)
+#define LE_bswap32(val)
+#define LE_bswap64(val)
+#else
+#error "Cannot determine endianness"
+#endif
+
+#define buf_read_u8o(buf, index) (buf)[index]
+#define buf_read_u16o(buf, index) ((uint16_t)((buf)[index] | ((buf)[(index) + 1] << 8)))
+#define buf_read_u32o(buf, index) \
+    ((uint32_t)(buf)[index] | ((uint32_t)(buf)[(index) + 1] << 8) | ((uint32_t)(buf)[(index) + 2] << 16) | \
+     ((uint32_t)(buf)[(index) + 3] << 24))
+#define buf_read_u64o(buf, index) \
+    ((uint64_t)(buf)[index] | ((uint64_t)(buf)[(index) + 1] << 8) | ((uint64_t)(buf)[(index) + 2] << 16) | \
+     ((uint64_t)(buf)[(index) + 3] << 24) | ((uint64_t)(buf)[(index) + 4] << 32) | \
+     ((uint64_t)(buf)[(index) + 5] << 40) | ((uint64_t)(buf)[(index) + 6] << 48) | \
+     ((uint64_t)(buf)[(index) + 7] << 56))
+
+// The writers expect a `buffer` in scope, the non-offset ones also advance an `index` variable.
+#define buf_write_8o(index, val) buffer[index] = (val) & 0xFF
+#define buf_write_16o(index, val) buf_write_8o(index, val); buf_write_8o(index + 1, (val) >> 8)
+#define buf_write_32o(index, val) buf_write_16o(index, val); buf_write_16o(index + 2, (val) >> 16)
+#define buf_write_64o(index, val) buf_write_32o(index, val); buf_write_32o(index + 4, (val) >> 32)
+
+#define buf_write_8(val) buffer[index++] = (val) & 0xFF
+#define buf_write_16(val) buf_write_8(val); buf_write_8((val) >> 8)
+#define buf_write_32(val) buf_write_16(val); buf_write_16((val) >> 16)
+#define buf_write_64(val) buf_write_32(val); buf_write_32((val) >> 32)
+
+// Signed integers mapped to unsigned ones so that small magnitudes of either sign stay small: 0, -1, 1, -2, ...
+#define zigzag_encode(val) (((uint64_t) (val) << 1) ^ (uint64_t) ((int64_t) (val) >> 63))
+#define zigzag_decode(val) ((int64_t) ((val) >> 1) ^ -(int64_t) ((val) & 1))
+
+// Number of bytes of an unsigned LEB128 varint, 7 bits per byte
+#define varint_size(val) (1 + (63 - __builtin_clzll((uint64_t) (val) | 1)) / 7)
+
+// Reads an unsigned LEB128 varint before `end` into `val`, advancing `index`. Evaluates to 0 if it is cut or too long
+#define buf_read_varint(buf, index, end, val) \
+    ({ \
+        uint64_t result = 0; \
+        int shift = 0, complete = 0; \
+        while ((index) < (end) && shift < 70) { \
+            const uint8_t byte = (buf)[(index)++]; \
+            result |= (uint64_t) (byte & 0x7F) << shift; \
+            shift += 7; \
+            if (!(byte & 0x80)) { \
+                complete = 1; \
+                break; \
+            } \
+        } \
+        (val) = result; \
+        complete; \
+    })
+
+// Elements or bytes the heap storage of a string_t, array_t or object_t can hold
+#define capacity_of(container) ((container).capacity ? (uint32_t) (container).capacity : (container).length)
+
 #endif
@@ -0,0 +1,631 @@
+#include "view.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include "utils.h"
+
+/**
+ * Checks that bytes are well-formed UTF-8 as per RFC 3629: no overlong encodings, no surrogates and no code points
+ * past U+10FFFF. Scalar version, for short inputs and for targets without byte shuffles.
+ * @return 1 if the bytes are valid, 0 otherwise
+ */
+static int utf8_valid_scalar(const uint8_t *data, const size_t length) {
+    // Two overlapping words cover most keys and short strings at once
+    if (length >= 8 && length <= 16) {
+        uint64_t first, last;
+        memcpy(&first, data, sizeof(first));
+        memcpy(&last, &data[length - 8], sizeof(last));
+        if (((first | last) & 0x8080808080808080) == 0) return 1;
+    }
+    size_t i = 0;
+    while (i < length) {
+        uint64_t word;
+        if (length - i >= sizeof(word)) {
+            memcpy(&word, &data[i], sizeof(word));
+            if ((word & 0x8080808080808080) == 0) {
+                i += sizeof(word);
+                continue;
+            }
+        }
+        const uint8_t lead = data[i];
+        if (lead < 0x80) {
+            i++;
+            continue;
+        }
+        size_t continuation;
+        uint8_t low = 0x80, high = 0xBF; // range of the second byte
+        if (lead >= 0xC2 && lead <= 0xDF) {
+            continuation = 1;
+        } else if (lead >= 0xE0 && lead <= 0xEF) {
+            continuation = 2;
+            if (lead == 0xE0) low = 0xA0; // overlong
+            if (lead == 0xED) high = 0x9F; // surrogates
+        } else if (lead >= 0xF0 && lead <= 0xF4) {
+            continuation = 3;
+            if (lead == 0xF0) low = 0x90; // overlong
+            if (lead == 0xF4) high = 0x8F; // past U+10FFFF
+        } else {
+            return 0;
+        }
+        if (length - i <= continuation) return 0;
+        if (data[i + 1] < low || data[i + 1] > high) return 0;
+        for (size_t k = 2; k <= continuation; k++) {
+            if ((data[i + k] & 0xC0) != 0x80) return 0;
+        }
+        i += 1 + continuation;
+    }
+    return 1;
+}
+
+#if defined(__SSSE3__) || defined(__ARM_NEON)
+#define UTF8_VECTOR
+#define UTF8_VECTOR_TARGET
+#elif defined(__x86_64__) || defined(__i386__)
+// Built for plain x86-64: the vector functions are compiled for SSSE3 on their own and picked at runtime
+#define UTF8_VECTOR
+#define UTF8_VECTOR_DISPATCH
+#define UTF8_VECTOR_TARGET __attribute__((target("ssse3")))
+#endif
+
+#ifdef UTF8_VECTOR
+/*
+ * Blocks of 16 bytes are validated with GCC vectors, following the lookup algorithm of Keiser and Lemire
+ * ("Validating UTF-8 In Less Than One Instruction Per Byte"): every byte is classified together with the byte
+ * before it by three 16-entry tables indexed by nibbles, which compile to byte shuffles (pshufb, tbl). Each table
+ * entry is a set of the errors that nibble is compatible with, so a pair of bytes is invalid if an error remains
+ * after and-ing the three. Third and fourth bytes of a sequence are then matched against their lead bytes.
+ * Without SSSE3 the shuffles would be expanded byte by byte, so x86 builds without -mssse3 only take this path on
+ * processors that have it, see utf8_valid.
+ */
+typedef uint8_t utf8_vector __attribute__((vector_size(16)));
+
+#define UTF8_TOO_SHORT (1 << 0) // lead byte not followed by enough continuation bytes
+#define UTF8_TOO_LONG (1 << 1) // continuation byte after an ASCII byte
+#define UTF8_OVERLONG_3 (1 << 2)
+#define UTF8_TOO_LARGE (1 << 3) // past U+10FFFF
+#define UTF8_SURROGATE (1 << 4)
+#define UTF8_OVERLONG_2 (1 << 5)
+#define UTF8_TOO_LARGE_1000 (1 << 6)
+#define UTF8_OVERLONG_4 (1 << 6)
+#define UTF8_TWO_CONTS (1 << 7) // two continuation bytes, only valid in three and four byte sequences
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+// Errors compatible with the high nibble of the first byte of a pair
+static const utf8_vector utf8_byte_1_high = {
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+    UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+    UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+    UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+    UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4
+};
+
+// Errors compatible with the low nibble of the first byte of a pair
+static const utf8_vector utf8_byte_1_low = {
+    UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+    UTF8_CARRY | UTF8_OVERLONG_2,
+    UTF8_CARRY,
+    UTF8_CARRY,
+    UTF8_CARRY | UTF8_TOO_LARGE,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+};
+
+// Errors compatible with the high nibble of the second byte of a pair
+static const utf8_vector utf8_byte_2_high = {
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+};
+
+UTF8_VECTOR_TARGET static int utf8_zero(const utf8_vector block) {
+    uint64_t words[2];
+    memcpy(words, &block, sizeof(words));
+    return (words[0] | words[1]) == 0;
+}
+
+/**
+ * @param input Block to check
+ * @param previous Block before it, zeros at the start
+ * @return Non-zero bytes where the input is not valid UTF-8
+ */
+UTF8_VECTOR_TARGET static utf8_vector utf8_errors(const utf8_vector input, const utf8_vector previous) {
+    const utf8_vector prev1 = __builtin_shuffle(previous, input,
+                                                (utf8_vector){15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30});
+    const utf8_vector prev2 = __builtin_shuffle(previous, input,
+                                                (utf8_vector){14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29});
+    const utf8_vector prev3 = __builtin_shuffle(previous, input,
+                                                (utf8_vector){13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28});
+    const utf8_vector special = __builtin_shuffle(utf8_byte_1_high, prev1 >> 4) &
+                                __builtin_shuffle(utf8_byte_1_low, prev1 & 0x0F) &
+                                __builtin_shuffle(utf8_byte_2_high, input >> 4);
+    // Two continuation bytes in a row are expected exactly when a three or four byte lead comes before them
+    const utf8_vector must_continue = (utf8_vector) ((prev2 >= 0xE0) | (prev3 >= 0xF0)) & 0x80;
+    return special ^ must_continue;
+}
+
+/**
+ * Checks that bytes are well-formed UTF-8 as per RFC 3629, see utf8_valid_scalar. Takes at least one block.
+ * @return 1 if the bytes are valid, 0 otherwise
+ */
+UTF8_VECTOR_TARGET static int utf8_valid_vector(const uint8_t *data, const size_t length) {
+    // ASCII blocks are tested with plain loads and only go through the lookup after a block that is not ASCII
+    const utf8_vector zero = {0};
+    utf8_vector input, previous, errors = zero;
+    int previous_ascii = 1;
+    size_t i = 0;
+    for (; i + sizeof(utf8_vector) <= length; i += sizeof(utf8_vector)) {
+        uint64_t words[2];
+        memcpy(words, &data[i], sizeof(words));
+        const int ascii = ((words[0] | words[1]) & 0x8080808080808080) == 0;
+        if (!ascii || !previous_ascii) {
+            memcpy(&input, &data[i], sizeof(input));
+            if (i == 0) {
+                previous = zero;
+            } else {
+                memcpy(&previous, &data[i - sizeof(previous)], sizeof(previous));
+            }
+            errors |= utf8_errors(input, previous);
+        }
+        previous_ascii = ascii;
+    }
+
+    // The last block is loaded again from the end and shifted so that zeros follow the remaining bytes, which also
+    // catches a sequence cut short by the end. Without remaining bytes, a block of zeros does the same.
+    memcpy(&previous, &data[i - sizeof(previous)], sizeof(previous));
+    const size_t remaining = length - i;
+    if (remaining == 0 && previous_ascii) return utf8_zero(errors);
+    input = zero;
+    if (remaining) {
+        utf8_vector last;
+        memcpy(&last, &data[length - sizeof(last)], sizeof(last));
+        const utf8_vector shift = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+        input = __builtin_shuffle(last, zero, shift + (uint8_t) (sizeof(utf8_vector) - remaining));
+    }
+    errors |= utf8_errors(input, previous);
+    return utf8_zero(errors);
+}
+#endif
+
+/**
+ * Checks that bytes are well-formed UTF-8 as per RFC 3629, with blocks of 16 bytes when the target has byte shuffles.
+ * @return 1 if the bytes are valid, 0 otherwise
+ */
+static int utf8_valid(const uint8_t *data, const size_t length) {
+#if defined(UTF8_VECTOR_DISPATCH)
+    if (length >= sizeof(utf8_vector) && __builtin_cpu_supports("ssse3")) return utf8_valid_vector(data, length);
+#elif defined(UTF8_VECTOR)
+    if (length >= sizeof(utf8_vector)) return utf8_valid_vector(data, length);
+#endif
+    return utf8_valid_scalar(data, length);
+}
+
+// ASCII check of at most 16 bytes with two overlapping loads, which covers most keys and short strings
+static int short_ascii(const uint8_t *text, const uint32_t length) {
+    uint64_t first, last;
+    if (length >= 8) {
+        memcpy(&first, text, sizeof(first));
+        memcpy(&last, &text[length - 8], sizeof(last));
+    } else if (length >= 4) {
+        uint32_t head, tail;
+        memcpy(&head, text, sizeof(head));
+        memcpy(&tail, &text[length - 4], sizeof(tail));
+        first = head;
+        last = tail;
+    } else {
+        first = length ? text[0] | text[length / 2] << 8 | text[length - 1] << 16 : 0;
+        last = 0;
+    }
+    return ((first | last) & 0x8080808080808080) == 0;
+}
+
+// Keys and strings up to this long are checked in batches, longer ones on their own
+#define TEXT_BATCH_ITEM 256
+#define TEXT_BATCH 4096
+
+/*
+ * Keys and strings waiting to be checked together, each followed by a zero byte. Checking them one by one costs a
+ * call and a partial last block each, which dominates on documents made of many short strings. A zero byte cannot
+ * continue a sequence and nothing can continue one after it, so the batch is valid UTF-8 exactly when each of them is.
+ */
+typedef struct {
+    size_t length;
+    uint8_t data[TEXT_BATCH];
+} text_batch_t;
+
+/**
+ * Checks the texts of a batch and empties it.
+ * @return 0 if they are all valid, EILSEQ otherwise
+ */
+static int text_batch_flush(text_batch_t *batch) {
+    const int valid = utf8_valid(batch->data, batch->length);
+    batch->length = 0;
+    return valid ? 0 : EILSEQ;
+}
+
+/**
+ * Checks a length prefixed key or string that has to fit before `end`. Its UTF-8 may be checked later on, when the
+ * batch is flushed.
+ * @return 0 if it is valid so far, an errno value otherwise
+ */
+static int validate_text(text_batch_t *batch, const uint8_t *buffer, const size_t end, const size_t index,
+                         uint32_t *length) {
+    if (end - index < 4) return EINVAL;
+    *length = buf_read_u32o(buffer, index);
+    if (*length > (1 << 24)) return EOVERFLOW;
+    if (*length > end - index - 4) return EINVAL;
+    const uint8_t *text = &buffer[index + 4];
+    if (*length <= 16 && short_ascii(text, *length)) return 0;
+    if (*length > TEXT_BATCH_ITEM) return utf8_valid(text, *length) ? 0 : EILSEQ;
+
+    if (batch->length + *length + 1 > TEXT_BATCH) {
+        const int status = text_batch_flush(batch);
+        if (status != 0) return status;
+    }
+    memcpy(&batch->data[batch->length], text, *length);
+    batch->length += *length;
+    batch->data[batch->length++] = 0;
+    return 0;
+}
+
+// Payload size of the types that have a fixed one plus one, 0 for the others
+static const uint8_t fixed_sizes[256] = {
+    [BSON_I8] = 2, [BSON_U8] = 2, [BSON_I16] = 3, [BSON_U16] = 3, [BSON_I32] = 5, [BSON_U32] = 5, [BSON_F32] = 5,
+    [BSON_I64] = 9, [BSON_U64] = 9, [BSON_F64] = 9, [BSON_DATE] = 9, [BSON_NULL] = 1, [BSON_TRUE] = 1, [BSON_FALSE] = 1
+};
+
+static int validate_value(text_batch_t *batch, const uint8_t *buffer, size_t end, size_t *index_ref, uint8_t type,
+                          uint32_t depth);
+
+static int validate_container(text_batch_t *batch, const uint8_t *buffer, // NOLINT(*-no-recursion)
+                              const size_t end, size_t *index_ref, const uint8_t type, const uint32_t depth) {
+    const size_t index = *index_ref;
+    if (end - index < 8) return EINVAL;
+    const uint32_t count = buf_read_u32o(buffer, index);
+    const uint32_t size = buf_read_u32o(buffer, index + 4);
+    if (count > (1 << 24) || size > (1 << 24) || depth >= BSON_MAX_DEPTH) return EOVERFLOW;
+    if (size > end - index - 8 || count > size) return EINVAL;
+
+    // The values have to fill the container exactly, so its size prefix can be trusted to skip it
+    const size_t container_end = index + 8 + size;
+    const size_t types = index + 8;
+    size_t cursor = types + count;
+    for (uint32_t i = 0; i < count; i++) {
+        if (type == BSON_OBJECT) {
+            uint32_t key_length;
+            const int status = validate_text(batch, buffer, container_end, cursor, &key_length);
+            if (status != 0) return status;
+            cursor += 4 + key_length;
+        }
+        const uint8_t value_type = buffer[types + i];
+        const size_t fixed = fixed_sizes[value_type];
+        if (fixed) {
+            if (fixed - 1 > container_end - cursor) return EINVAL;
+            cursor += fixed - 1;
+            continue;
+        }
+        const int status = validate_value(batch, buffer, container_end, &cursor, value_type, depth + 1);
+        if (status != 0) return status;
+    }
+    if (cursor != container_end) return EINVAL;
+    *index_ref = container_end;
+    return 0;
+}
+
+/**
+ * Type byte of a table field: BSON_INVALID if its column starts with the type of every row, the type of all of its
+ * values otherwise. bson_serialize gives nested tables and delta arrays their own column types when every row holds
+ * one, and all decoders read them like the values of a mixed column.
+ * @return 1 if the decoders can read a column of that type, 0 otherwise
+ */
+static int table_field_type(const uint8_t type) {
+    switch ((bson_type) type) {
+        case BSON_INVALID:
+        case BSON_I8:
+        case BSON_I16:
+        case BSON_I32:
+        case BSON_I64:
+        case BSON_U8:
+        case BSON_U16:
+        case BSON_U32:
+        case BSON_U64:
+        case BSON_F32:
+        case BSON_F64:
+        case BSON_TRUE:
+        case BSON_FALSE:
+        case BSON_STRING:
+        case BSON_BYTES:
+        case BSON_DATE:
+        case BSON_ARRAY:
+        case BSON_OBJECT:
+        case BSON_NULL:
+        case BSON_TABLE:
+        case BSON_DELTA:
+            return 1;
+        case BSON_MAX:
+            break;
+    }
+    return 0;
+}
+
+/**
+ * Checks a table: its field headers, then every column against its field type, or against the type table at its
+ * start for mixed columns, whose types may not be BSON_INVALID. Values are 2 levels below the table.
+ * @return 0 if it is valid, an errno value otherwise
+ */
+static int validate_table(text_batch_t *batch, const uint8_t *buffer, const size_t end, // NOLINT(*-no-recursion)
+                          size_t *index_ref, const uint32_t depth) {
+    const size_t index = *index_ref;
+    if (end - index < 12) return EINVAL;
+    const uint32_t rows = buf_read_u32o(buffer, index);
+    const uint32_t size = buf_read_u32o(buffer, index + 4);
+    const uint32_t fields = buf_read_u32o(buffer, index + 8);
+    if (rows > (1 << 24) || fields > (1 << 24) || depth >= BSON_MAX_DEPTH) return EOVERFLOW;
+    if (size > end - index - 8 || size < 4 || rows == 0 || fields == 0) return EINVAL;
+
+    const size_t table_end = index + 8 + size;
+    size_t cursor = index + 12;
+    for (uint32_t j = 0; j < fields; j++) {
+        if (table_end - cursor < 1 || !table_field_type(buffer[cursor])) return EINVAL;
+        uint32_t key_length;
+        const int status = validate_text(batch, buffer, table_end, cursor + 1, &key_length);
+        if (status != 0) return status;
+        cursor += 5 + key_length;
+    }
+
+    // Walks the field headers again alongside the columns for their types, which were checked above
+    size_t header = index + 12;
+    for (uint32_t j = 0; j < fields; j++) {
+        const uint8_t field_type = buffer[header];
+        header += 5 + buf_read_u32o(buffer, header + 1);
+
+        if (table_end - cursor < 4) return EINVAL;
+        const uint32_t column_length = buf_read_u32o(buffer, cursor);
+        if (column_length > table_end - cursor - 4) return EINVAL;
+        const size_t column_end = cursor + 4 + column_length;
+        const size_t types = cursor + 4;
+        size_t value = types;
+        if (field_type == BSON_INVALID) {
+            if (rows > column_length) return EINVAL;
+            value += rows;
+        }
+        for (uint32_t i = 0; i < rows; i++) {
+            const uint8_t type = field_type == BSON_INVALID ? buffer[types + i] : field_type;
+            const int status = validate_value(batch, buffer, column_end, &value, type, depth + 2);
+            if (status != 0) return status;
+        }
+        if (value != column_end) return EINVAL;
+        cursor = column_end;
+    }
+    if (cursor != table_end) return EINVAL;
+    *index_ref = table_end;
+    return 0;
+}
+
+/**
+ * Checks a delta array: a count, an integer or date type, then exactly that many varints filling its size.
+ * @return 0 if it is valid, an errno value otherwise
+ */
+static int validate_delta(const uint8_t *buffer, const size_t end, size_t *index_ref, const uint32_t depth) {
+    const size_t index = *index_ref;
+    if (end - index < 8) return EINVAL;
+    const uint32_t count = buf_read_u32o(buffer, index);
+    const uint32_t size = buf_read_u32o(buffer, index + 4);
+    if (count > (1 << 24) || size > (1 << 24) || depth >= BSON_MAX_DEPTH) return EOVERFLOW;
+    if (size > end - index - 8 || size == 0 || count == 0) return EINVAL;
+    const uint8_t type = buffer[index + 8];
+    if (fixed_sizes[type] < 2 || type == BSON_F32 || type == BSON_F64) return EINVAL;
+
+    const size_t delta_end = index + 8 + size;
+    size_t cursor = index + 9;
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t zigzag;
+        if (!buf_read_varint(buffer, cursor, delta_end, zigzag)) return EINVAL;
+        (void) zigzag;
+    }
+    if (cursor != delta_end) return EINVAL;
+    *index_ref = delta_end;
+    return 0;
+}
+
+/**
+ * @param batch Keys and strings whose UTF-8 is still to be checked
+ * @param end End of the innermost container holding the value, which it may not cross
+ * @param index_ref Index of the value just after its type byte, moved past the value when it is valid
+ * @return 0 if the value is valid so far, an errno value otherwise
+ */
+static int validate_value(text_batch_t *batch, const uint8_t *buffer, const size_t end, // NOLINT(*-no-recursion)
+                          size_t *index_ref, const uint8_t type, const uint32_t depth) {
+    const size_t index = *index_ref;
+    size_t size = fixed_sizes[type];
+    if (size) {
+        size--;
+    } else if (type == BSON_STRING) {
+        uint32_t length;
+        const int status = validate_text(batch, buffer, end, index, &length);
+        if (status != 0) return status;
+        size = 4 + length;
+    } else if (type == BSON_BYTES) {
+        if (end - index < 4) return EINVAL;
+        size = 4 + (size_t) buf_read_u32o(buffer, index);
+        if (size > 4 + (1 << 24)) return EOVERFLOW;
+    } else if (type == BSON_ARRAY || type == BSON_OBJECT) {
+        return validate_container(batch, buffer, end, index_ref, type, depth);
+    } else if (type == BSON_TABLE) {
+        return validate_table(batch, buffer, end, index_ref, depth);
+    } else if (type == BSON_DELTA) {
+        return validate_delta(buffer, end, index_ref, depth);
+    } else {
+        return EINVAL;
+    }
+    if (size > end - index) return EINVAL;
+    *index_ref = index + size;
+    return 0;
+}
+
+/**
+ * Checks in a single pass that a buffer holds exactly one well-formed serialized value: valid type bytes, lengths
+ * that stay within the buffer and within the limits of the decoder, containers whose size prefix matches their
+ * contents, and strings and keys that are valid UTF-8. A validated buffer can be decoded with bson_deserialize,
+ * skipped with its size prefixes and read with the view functions without further checks.
+ * @param buffer Serialized value, starting with its type byte
+ * @param length Length of the buffer in bytes
+ * @return 0 if the buffer is valid, non-zero with errno set otherwise: EINVAL if it is malformed, EILSEQ if a
+ * string is not valid UTF-8, EOVERFLOW if a length or the nesting depth is past what the decoder accepts
+ */
+int bson_validate(const uint8_t *buffer, const size_t length) {
+    if (length > UINT32_MAX) {
+        errno = EOVERFLOW;
+        return 1;
+    }
+    if (length == 0) {
+        errno = EINVAL;
+        return 1;
+    }
+    size_t index = 1;
+    text_batch_t batch;
+    batch.length = 0;
+    int status = validate_value(&batch, buffer, length, &index, buffer[0], 0);
+    if (status == 0 && index != length) status = EINVAL;
+    // Texts still in the batch come before whatever failed, so the first error in the buffer is reported
+    if (text_batch_flush(&batch) != 0) status = EILSEQ;
+    if (status != 0) {
+        errno = status;
+        return 1;
+    }
+    return 0;
+}
+
+// Only for validated data, in which the size prefixes can be trusted
+static size_t view_size(const uint8_t *data, const uint8_t type) {
+    size_t next = 0;
+    bson_skip(data, SIZE_MAX, 0, type, &next);
+    return next;
+}
+
+/**
+ * @param buffer Buffer that passed bson_validate
+ * @return View of the value held by the buffer
+ */
+bson_view_t bson_view(const uint8_t *buffer) {
+    return (bson_view_t){.data = &buffer[1], .type = buffer[0]};
+}
+
+/**
+ * @return Number of elements, members or rows of an array, object, table or delta array, length of a string or
+ * bytes, and 0 for anything else
+ */
+uint32_t bson_view_length(const bson_view_t view) {
+    switch (view.type) {
+        case BSON_STRING:
+        case BSON_BYTES:
+        case BSON_ARRAY:
+        case BSON_OBJECT:
+        case BSON_TABLE:
+        case BSON_DELTA:
+            return buf_read_u32o(view.data, 0);
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Tables and delta arrays have no per-element bytes to point to, so iterating them yields nothing, bson_view_value
+ * decodes them.
+ * @param view Array or object to iterate over
+ * @return Iterator before the first element or member, exhausted right away for any other value
+ */
+bson_view_iter_t bson_view_iter(const bson_view_t view) {
+    if (view.type != BSON_ARRAY && view.type != BSON_OBJECT) {
+        return (bson_view_iter_t){.types = NULL, .cursor = NULL, .remaining = 0, .object = 0};
+    }
+    const uint32_t count = buf_read_u32o(view.data, 0);
+    return (bson_view_iter_t){
+        .types = &view.data[8], .cursor = &view.data[8 + count], .remaining = count, .object = view.type == BSON_OBJECT
+    };
+}
+
+/**
+ * @param iter Iterator to advance
+ * @param key Receives the key of object members, pointing into the buffer, can be NULL
+ * @param value Receives the value
+ * @return 1 if there was another element or member, 0 at the end
+ */
+int bson_view_next(bson_view_iter_t *iter, string_t *key, bson_view_t *value) {
+    if (iter->remaining == 0) return 0;
+    if (iter->object) {
+        const uint32_t key_length = buf_read_u32o(iter->cursor, 0);
+        if (key) *key = (string_t){.data = (char *) &iter->cursor[4], .length = key_length, .alloc = 0};
+        iter->cursor += 4 + key_length;
+    } else if (key) {
+        *key = empty_string_t;
+    }
+    *value = (bson_view_t){.data = iter->cursor, .type = *iter->types++};
+    iter->cursor += view_size(iter->cursor, value->type);
+    iter->remaining--;
+    return 1;
+}
+
+/**
+ * @param view Array to index, or object to take the nth member of
+ * @param index Position of the value
+ * @return View of the value, empty_bson_view if there is none
+ */
+bson_view_t bson_view_at(const bson_view_t view, const uint32_t index) {
+    bson_view_iter_t iter = bson_view_iter(view);
+    if (index >= iter.remaining) return empty_bson_view;
+    bson_view_t value;
+    for (uint32_t i = 0; i <= index; i++) bson_view_next(&iter, NULL, &value);
+    return value;
+}
+
+/**
+ * @param view Object to look up the key in
+ * @param key Null terminated key
+ * @return View of the value of the first member with the key, empty_bson_view if there is none
+ */
+bson_view_t bson_view_get(const bson_view_t view, const char *key) {
+    if (view.type != BSON_OBJECT) return empty_bson_view;
+    const size_t key_length = strlen(key);
+    bson_view_iter_t iter = bson_view_iter(view);
+    string_t member;
+    bson_view_t value;
+    while (bson_view_next(&iter, &member, &value)) {
+        if (member.length == key_length && memcmp(member.data, key, key_length) == 0) return value;
+    }
+    return empty_bson_view;
+}
+
+/**
+ * Scalars are read in place and strings and bytes point into the buffer, so neither needs to be freed. Arrays,
+ * objects, tables and delta arrays are decoded into heap allocated values to free with bson_free.
+ * @param view Value to read
+ * @return The value, bson_invalid for an empty view
+ */
+bson_t bson_view_value(const bson_view_t view) {
+    if (view.type == BSON_STRING || view.type == BSON_BYTES) {
+        const uint32_t length = buf_read_u32o(view.data, 0);
+        return (bson_t){
+            .type = view.type, .size = 4 + length,
+            .string = {.data = length ? (char *) &view.data[4] : NULL, .length = length, .alloc = 0}
+        };
+    }
+    if (view.type == BSON_INVALID) return bson_invalid;
+    uint32_t index = 0;
+    return bson_deserialize_typed(view.data, &index, view.type);
+}
@@ -0,0 +1,38 @@
+#ifndef BSON_VIEW_H
+#define BSON_VIEW_H
+
+#include "bson.h"
+
+// Value inside a buffer that passed bson_validate, read in place without decoding it
+typedef struct {
+    const uint8_t *data; // payload of the value, just after its type byte
+    uint8_t type; // BSON_INVALID if the value does not exist
+} bson_view_t;
+
+// Position in the elements of an array or the members of an object
+typedef struct {
+    const uint8_t *types; // type of the next value
+    const uint8_t *cursor; // next key or value
+    uint32_t remaining;
+    uint8_t object; // 1 if every value is preceded by a key
+} bson_view_iter_t;
+
+static const bson_view_t empty_bson_view = {.data = NULL, .type = BSON_INVALID};
+
+int bson_validate(const uint8_t *buffer, size_t length);
+
+bson_view_t bson_view(const uint8_t *buffer);
+
+uint32_t bson_view_length(bson_view_t view);
+
+bson_view_iter_t bson_view_iter(bson_view_t view);
+
+int bson_view_next(bson_view_iter_t *iter, string_t *key, bson_view_t *value);
+
+bson_view_t bson_view_at(bson_view_t view, uint32_t index);
+
+bson_view_t bson_view_get(bson_view_t view, const char *key);
+
+bson_t bson_view_value(bson_view_t view);
+
+#endif
@@ -0,0 +1,88 @@
+/*
+ * Depth limit of shared.h. Documents and versions nested deeper than BSON_MAX_DEPTH are refused, since their sizes
+ * could not be cached before sharing them, and the sizes of the ones accepted are all cached, so that threads can
+ * serialize them at the same time without writing to them.
+ *
+ *     gcc -std=gnu2x -O2 -pthread tests/shared.c src/bson.c src/delta.c src/shared.c src/view.c -o shared && ./shared
+ */
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/shared.h"
+
+#define THREADS 4
+
+// Chain of `levels` arrays, each holding the next one, around a number
+static bson_t *chain(const uint32_t levels) {
+    bson_t *arrays = malloc((levels + 1) * sizeof(bson_t));
+    arrays[0] = bson_u8(7);
+    for (uint32_t d = 1; d <= levels; d++) {
+        arrays[d] = bson_array_heap(&arrays[d - 1], 1);
+        arrays[d].array.alloc = 0;
+    }
+    return arrays;
+}
+
+// Path of `levels` times index 0
+static bson_t path_of(const uint32_t levels) {
+    bson_t *indices = malloc(levels * sizeof(bson_t));
+    for (uint32_t d = 0; d < levels; d++) indices[d] = bson_u32(0);
+    return bson_array_heap(indices, levels);
+}
+
+static void check_cached(const bson_t *bson) {
+    while (bson->type == BSON_ARRAY) {
+        assert(bson->size != 1 << 25);
+        bson = &bson->array.elements[0];
+    }
+}
+
+static void *serialize(void *argument) {
+    uint8_t *buffer;
+    assert(bson_serialize(&buffer, (bson_t *) bson_shared_value(argument)) == 0);
+    return buffer;
+}
+
+int main(void) {
+    bson_t *arrays = chain(BSON_MAX_DEPTH + 1);
+    errno = 0;
+    assert(bson_shared_new(&arrays[BSON_MAX_DEPTH + 1]) == NULL && errno == EOVERFLOW);
+    bson_shared_t *document = bson_shared_new(&arrays[BSON_MAX_DEPTH]);
+    assert(document);
+    check_cached(bson_shared_value(document));
+
+    // Setting the number at the bottom to an array would nest it one level too deep
+    bson_t path = path_of(BSON_MAX_DEPTH);
+    const bson_t empty = bson_array_heap(NULL, 0);
+    errno = 0;
+    assert(bson_shared_set(document, &path, &empty) == NULL && errno == EOVERFLOW);
+    const bson_t number = bson_u8(8);
+    bson_shared_t *version = bson_shared_set(document, &path, &number);
+    assert(version);
+    check_cached(bson_shared_value(version));
+
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) assert(pthread_create(&threads[i], NULL, serialize, version) == 0);
+    uint8_t *first = NULL;
+    const size_t length = 1 + bson_shared_value(version)->size;
+    for (int i = 0; i < THREADS; i++) {
+        void *buffer;
+        assert(pthread_join(threads[i], &buffer) == 0);
+        if (first) assert(memcmp(first, buffer, length) == 0);
+        if (first) free(buffer);
+        if (!first) first = buffer;
+    }
+    assert(first[length - 1] == 8);
+    free(first);
+
+    bson_shared_release(version);
+    bson_shared_release(document);
+    bson_free(&path);
+    free(arrays);
+    printf("shared: ok\n");
+    return 0;
+}
@@ -0,0 +1,206 @@
+/*
+ * Crash consistency and compaction of store.h. A store whose last record was cut short at any byte or corrupted
+ * reopens with every record before it, and a store compacted in the foreground, or in the background while it is
+ * written to, reopens with the same documents and garbage.
+ *
+ *     gcc -std=gnu2x -O2 -pthread tests/store.c src/bson.c src/canonical.c src/delta.c src/store.c src/view.c \
+ *         -o store && ./store
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../src/store.h"
+
+#define KEYS 64
+#define OPERATIONS 3000
+
+static char directory[] = "/tmp/bson-store-XXXXXX";
+static char path[64];
+
+// Version of every key, -1 if it is not in the store
+static int64_t versions[KEYS];
+
+static uint32_t seed = 1;
+
+static uint32_t next_random(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static uint32_t key_of(const uint32_t k, char *key) {
+    return (uint32_t) snprintf(key, 16, "key-%u", k);
+}
+
+static void put(bson_store_t *store, const uint32_t k, const uint32_t version) {
+    static const char padding[64] = {0};
+    char key[16];
+    const uint32_t key_length = key_of(k, key);
+    object_pair_t pairs[] = {
+        {string("key"), bson_string_heap(key, key_length)},
+        {string("version"), bson_u32(version)},
+        {string("padding"), bson_bytes_heap((char *) padding, version % sizeof(padding))}
+    };
+    bson_t document = bson_object(pairs);
+    assert(bson_store_put(store, key, key_length, &document) == 0);
+    versions[k] = version;
+}
+
+static void erase(bson_store_t *store, const uint32_t k) {
+    char key[16];
+    assert(bson_store_remove(store, key, key_of(k, key)) == 0);
+    versions[k] = -1;
+}
+
+// Random put or removal, removals only of keys in the store
+static void mutate(bson_store_t *store, const uint32_t version) {
+    const uint32_t k = next_random() % KEYS;
+    if (versions[k] >= 0 && next_random() % 4 == 0) {
+        erase(store, k);
+    } else {
+        put(store, k, version);
+    }
+}
+
+static void check(bson_store_t *store) {
+    uint32_t count = 0;
+    for (uint32_t k = 0; k < KEYS; k++) {
+        char key[16];
+        const uint32_t key_length = key_of(k, key);
+        errno = 0;
+        bson_t document = bson_store_get(store, key, key_length);
+        if (versions[k] < 0) {
+            assert(document.type == BSON_INVALID && errno == ENOENT);
+            continue;
+        }
+        count++;
+        assert(document.type == BSON_OBJECT && document.object.length == 3);
+        const string_t *stored = &document.object.elements[0].value.string;
+        assert(stored->length == key_length && memcmp(stored->data, key, key_length) == 0);
+        assert(document.object.elements[1].value.u32 == versions[k]);
+        bson_free(&document);
+    }
+    assert(store->count == count);
+}
+
+static uint64_t file_length(void) {
+    struct stat status;
+    assert(stat(path, &status) == 0);
+    return (uint64_t) status.st_size;
+}
+
+static void write_file(const uint8_t *data, const size_t length) {
+    FILE *file = fopen(path, "wb");
+    assert(file && fwrite(data, 1, length, file) == length && fclose(file) == 0);
+}
+
+static uint8_t *read_file(size_t *length) {
+    *length = file_length();
+    uint8_t *data = malloc(*length);
+    FILE *file = fopen(path, "rb");
+    assert(file && fread(data, 1, *length, file) == *length && fclose(file) == 0);
+    return data;
+}
+
+// Reopens the store and checks that it holds the same documents and accounts for the same garbage
+static void reopen(bson_store_t *store) {
+    const uint64_t length = store->length, garbage = store->garbage;
+    bson_store_close(store);
+    assert(bson_store_open(store, path) == 0);
+    assert(store->length == length && store->garbage == garbage && file_length() == length);
+    check(store);
+}
+
+/*
+ * Rewrites the file with its last record cut at every byte, then with every byte of that record flipped. Opening it
+ * has to drop exactly that record, and the store has to accept new records after it.
+ */
+static void test_last_record(void) {
+    bson_store_t store;
+    assert(bson_store_open(&store, path) == 0);
+    for (uint32_t i = 0; i < OPERATIONS; i++) mutate(&store, i);
+    const uint64_t before = store.length;
+    const int64_t previous = versions[7];
+    put(&store, 7, OPERATIONS);
+    bson_store_close(&store);
+    versions[7] = previous;
+
+    size_t length;
+    uint8_t *data = read_file(&length);
+    assert(length > before);
+    for (size_t cut = before; cut <= length; cut++) {
+        for (int flip = 0; flip < 2 && cut < length; flip++) {
+            if (flip) {
+                data[cut] ^= 0x5A;
+                write_file(data, length);
+                data[cut] ^= 0x5A;
+            } else {
+                write_file(data, cut);
+            }
+            assert(bson_store_open(&store, path) == 0);
+            assert(store.length == before && file_length() == before);
+            check(&store);
+            put(&store, 7, OPERATIONS + 1);
+            reopen(&store);
+            bson_store_close(&store);
+            versions[7] = previous;
+        }
+    }
+    write_file(data, length);
+    versions[7] = OPERATIONS;
+    free(data);
+}
+
+static void test_compact(void) {
+    bson_store_t store;
+    assert(bson_store_open(&store, path) == 0);
+    check(&store);
+    for (uint32_t i = 0; i < OPERATIONS; i++) mutate(&store, OPERATIONS + 2 + i);
+    assert(store.garbage > 0);
+    const uint64_t live = store.length - store.garbage;
+    assert(bson_store_compact(&store) == 0);
+    assert(store.garbage == 0 && store.length == live && file_length() == live);
+    check(&store);
+    reopen(&store);
+    bson_store_close(&store);
+}
+
+static void test_compact_background(void) {
+    bson_store_t store;
+    assert(bson_store_open(&store, path) == 0);
+    for (int round = 0; round < 20; round++) {
+        for (uint32_t i = 0; i < OPERATIONS; i++) mutate(&store, round * OPERATIONS + i);
+        assert(bson_store_compact_start(&store) == 0);
+        assert(bson_store_compact_start(&store) != 0 && errno == EBUSY);
+        assert(bson_store_compact(&store) != 0 && errno == EBUSY);
+        // Written to while the compaction copies the records, and likely after it too
+        for (uint32_t i = 0; i < OPERATIONS / 10; i++) mutate(&store, round * OPERATIONS + i);
+        check(&store);
+        assert(bson_store_compact_wait(&store) == 0);
+        check(&store);
+        reopen(&store);
+    }
+    assert(bson_store_compact_wait(&store) != 0 && errno == EINVAL);
+    bson_store_close(&store);
+}
+
+int main(void) {
+    assert(mkdtemp(directory));
+    snprintf(path, sizeof(path), "%s/store.db", directory);
+    for (uint32_t k = 0; k < KEYS; k++) versions[k] = -1;
+
+    test_last_record();
+    test_compact();
+    test_compact_background();
+
+    unlink(path);
+    rmdir(directory);
+    printf("store: ok\n");
+    return 0;
+}